@@ -122,6 +122,8 @@ void Shutdown()
     StopNode();
     {
         LOCK(cs_main);
+        CTxDB::Flush();
+        RemoveOrphanSpill();
 #ifdef ENABLE_WALLET
         if (pwalletMain)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
@@ -188,6 +190,7 @@ std::string HelpMessage()
     strUsage += "  -wallet=<file>         " + _("Specify wallet file within data directory (default: wallet.dat") + "\n";
     strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n";
     strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
+    strUsage += "  -dbflushinterval=<n>   " + _("Write cached block chain database changes to disk at least every <n> seconds (default: 60)") + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n";
     strUsage += "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n";
@@ -211,6 +214,9 @@ std::string HelpMessage()
     strUsage += "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n";
+    strUsage += "  -headersfirst          " + _("Sync headers first and fetch blocks from all peers in parallel while behind (default: 1)") + "\n";
+    strUsage += "  -msgthreads=<n>        " + strprintf(_("Number of threads handling ping, pong, verack and getdata messages next to the message handler, which handles all others (default: %d)"), DEFAULT_MESSAGE_WORKERS) + "\n";
+    strUsage += "  -socketevents=<mode>   " + _("Wait for socket events with <mode>: epoll or select (default: epoll where available)") + "\n";
 #ifdef USE_UPNP
 #if USE_UPNP
     strUsage += "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n";
@@ -254,7 +260,8 @@ std::string HelpMessage()
         strUsage += "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n";
         strUsage += "  -rpcwait               " + _("Wait for RPC server to start") + "\n";
     }
-    strUsage += "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n";
+    strUsage += "  -rpcthreads=<n>        " + strprintf(_("Set the number of threads to service RPC calls (default: %d)"), DEFAULT_RPC_THREADS) + "\n";
+    strUsage += "  -rpcworkqueue=<n>      " + strprintf(_("Set the depth of the work queue to service RPC calls (default: %d)"), DEFAULT_RPC_QUEUE_DEPTH) + "\n";
     strUsage += "  -clamspeech=off        " + _("Set clamspeech=off to turn off random clamspeech quotes in outgoing transactions") + "\n";
     strUsage += "  -clamstake=off         " + _("Set clamstake=off to turn off random clamspeech quotes when staking") + "\n";
     strUsage += "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n";
@@ -269,18 +276,30 @@ std::string HelpMessage()
     strUsage += "  -change=<addr>         " + _("Address to send change to") + "\n";
     strUsage += "  -spendlast=<addr>      " + _("Avoid spending outputs from given address(es) if possible") + "\n";
     strUsage += "  -stake=<addr>          " + _("Stake only outputs at the specified address(es)") + "\n";
+    strUsage += "  -stakethreads=<n>      " + _("Number of threads searching large wallets for stake kernels (default: number of cores)") + "\n";
     strUsage += "  -confchange            " + _("Require a confirmations for change (default: 0)") + "\n";
     strUsage += "  -minimizecoinage       " + _("Minimize weight consumption (experimental) (default: 0)") + "\n";
+    strUsage += "  -checkbalances         " + _("Check the running wallet balances and unspent outputs against a full scan on every read (default: 0)") + "\n";
     strUsage += "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received (%s in cmd is replaced by message)") + "\n";
     strUsage += "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n";
     strUsage += "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n";
     strUsage += "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n";
     strUsage += "  -reindex               " + _("Forces a reindex of the block DB and tx DB") + "\n";
+    strUsage += "  -notaryindex           " + _("Maintain an index of notary transactions, built in the background on first use (default: 0)") + "\n";
     strUsage += "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n";
     strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 500, 0 = all)") + "\n";
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
-    strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
+    strUsage += "  -maxorphanblocks=<n>    " + strprintf(_("Keep at most <n> unconnectable blocks (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
+    strUsage += "  -maxorphanblocksmem=<n> " + strprintf(_("Keep at most <n> MB of unconnectable blocks in memory and spill the rest to disk (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS_MEMORY) + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes, 0 = no limit (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
+    strUsage += "  -limitancestorcount=<n>   " + strprintf(_("Do not accept transactions with <n> or more in-pool ancestors (default: %u)"), DEFAULT_ANCESTOR_LIMIT) + "\n";
+    strUsage += "  -limitancestorsize=<n>    " + strprintf(_("Do not accept transactions whose in-pool ancestors, with the transaction itself, exceed <n> kilobytes (default: %u)"), DEFAULT_ANCESTOR_SIZE_LIMIT) + "\n";
+    strUsage += "  -limitdescendantcount=<n> " + strprintf(_("Do not accept transactions whose in-pool ancestors would get <n> or more in-pool descendants (default: %u)"), DEFAULT_DESCENDANT_LIMIT) + "\n";
+    strUsage += "  -limitdescendantsize=<n>  " + strprintf(_("Do not accept transactions whose in-pool ancestors would get more than <n> kilobytes of descendants (default: %u)"), DEFAULT_DESCENDANT_SIZE_LIMIT) + "\n";
+    strUsage += "  -maxsigcachesize=<n>   " + strprintf(_("Keep at most <n> verified signatures in memory, 32 bytes each (default: %d)"), DEFAULT_MAX_SIG_CACHE_SIZE) + "\n";
+    strUsage += "  -maxsigcachemb=<n>     " + _("Keep at most <n> megabytes of verified signatures in memory, overrides -maxsigcachesize") + "\n";
+    strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
 
     strUsage += "\n" + _("Block creation options:") + "\n";
     strUsage += "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n";
@@ -364,6 +383,9 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     nNodeLifespan = GetArg("-addrlifespan", 7);
     fUseFastIndex = GetBoolArg("-fastindex", true);
+    fNotaryIndex = GetBoolArg("-notaryindex", false);
+    fHeadersFirst = GetBoolArg("-headersfirst", true);
+    mempool.SetMaxUsage(std::max((int64_t)0, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE)) * 1000000);
     fCreditStakesToAccounts = GetBoolArg("-creditstakestoaccounts", false);
     nMinerSleep = GetArg("-minersleep", 500);
     nMaxStakeValue = GetMoneyArg("-maxstakevalue", 0*COIN);
@@ -439,6 +461,15 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     // ********************************************************* Step 3: parameter-to-internal-flags
 
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+
     fDebug = !mapMultiArgs["-debug"].empty();
     // Special-case: if -debug=0/-nodebug is set, turn off debugging messages
     const vector<string>& categories = mapMultiArgs["-debug"];
@@ -515,6 +546,7 @@ bool AppInit2(boost::thread_group& threadGroup)
         if (!ParseMoney(mapArgs["-mininput"], nMinimumInputValue))
             return InitError(strprintf(_("Invalid amount for -mininput=<amount>: '%s'"), mapArgs["-mininput"]));
     }
+    fCheckWalletBalances = GetBoolArg("-checkbalances", false);
 #endif
 
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
@@ -553,6 +585,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (fDaemon)
         fprintf(stdout, "Clam server starting\n");
 
+    if (nScriptCheckThreads) {
+        LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadScriptCheck);
+    }
+
     int64_t nStart;
 
     // ********************************************************* Step 5: verify database integrity
@@ -760,6 +798,13 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
 
+    // a notary index that isn't kept up to date has to be rebuilt when it is enabled again
+    if (!fNotaryIndex)
+    {
+        CTxDB txdb;
+        txdb.EraseNotaryIndexHeight();
+    }
+
     if (GetBoolArg("-printblockindex", false) || GetBoolArg("-printblocktree", false))
     {
         PrintBlockTree();
@@ -896,6 +941,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
 
+    if (fNotaryIndex)
+        threadGroup.create_thread(&ThreadNotaryIndex);
+
     // ********************************************************* Step 10: load peers
 
     uiInterface.InitMessage(_("Loading addresses..."));
@@ -955,6 +1003,12 @@ bool AppInit2(boost::thread_group& threadGroup)
         // Add wallet transactions that aren't already in a block to mapTransactions
         pwalletMain->ReacceptWalletTransactions();
 
+        // Staking figures are otherwise first computed at the next block
+        {
+            LOCK2(cs_main, pwalletMain->cs_wallet);
+            pwalletMain->UpdateStakeStats();
+        }
+
         // Run a thread to flush wallet periodically
         threadGroup.create_thread(boost::bind(&ThreadFlushWalletDB, boost::ref(pwalletMain->strWalletFile)));
 
@@ -4,6 +4,10 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include <openssl/sha.h>
 
 #include "kernel.h"
 #include "txdb.h"
@@ -401,6 +405,166 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBl
         return CheckStakeKernelHashV1(nBits, blockFrom, nTxPrevOffset, txPrev, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
 }
 
+CStakeKernelSearch::CStakeKernelSearch(CBlockIndex* pindexPrevIn, unsigned int nBitsIn, unsigned int nTimeTxIn, unsigned int nSearchIntervalIn)
+{
+    pindexPrev = pindexPrevIn;
+    nBits = nBitsIn;
+    nTimeTx = nTimeTxIn;
+    nSearchInterval = nSearchIntervalIn;
+    fProtocolV2 = IsProtocolV2(pindexPrev->nHeight+1);
+    nFound = 0;
+    nTimeFound = 0;
+}
+
+void CStakeKernelSearch::AddCoin(const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset, CBlockIndex* pindexFrom)
+{
+    Coin coin;
+    coin.ptxPrev = &txPrev;
+    coin.prevout = prevout;
+    coin.nTimeBlockFrom = nTimeBlockFrom;
+    coin.nTxPrevOffset = nTxPrevOffset;
+    coin.pindexFrom = pindexFrom;
+
+    // Weighted target, as in CheckStakeKernelHashV2
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+    bnTarget *= CBigNum(txPrev.vout[prevout.n].nValue);
+    coin.fTargetNone = bnTarget < 0;
+    coin.fTargetOverflow = bnTarget.bitSize() > 256;
+    if (!coin.fTargetNone && !coin.fTargetOverflow)
+        coin.target = bnTarget.getuint256();
+
+    vCoins.push_back(coin);
+}
+
+bool CStakeKernelSearch::CheckCoin(const Coin& coin, unsigned int& nTimeTxRet, uint256& hashProofOfStakeRet) const
+{
+    const CTransaction& txPrev = *coin.ptxPrev;
+
+    if (!fProtocolV2)
+    {
+        CBlock blockFrom = coin.pindexFrom->GetBlockHeader();
+        for (unsigned int n = 0; n < nSearchInterval; n++)
+        {
+            uint256 targetProofOfStake;
+            if (CheckStakeKernelHash(pindexPrev, nBits, blockFrom, coin.nTxPrevOffset, txPrev, coin.prevout, nTimeTx - n, hashProofOfStakeRet, targetProofOfStake))
+            {
+                nTimeTxRet = nTimeTx - n;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    if (coin.fTargetNone)
+        return false;
+
+    // The kernel serialized by CheckStakeKernelHashV2, less the timestamp
+    unsigned char pchKernel[8 + 4 + 4 + 32 + 4];
+    uint64_t nStakeModifier = pindexPrev->nStakeModifier;
+    memcpy(&pchKernel[0], &nStakeModifier, 8);
+    memcpy(&pchKernel[8], &coin.nTimeBlockFrom, 4);
+    memcpy(&pchKernel[12], &txPrev.nTime, 4);
+    memcpy(&pchKernel[16], &coin.prevout.hash, 32);
+    memcpy(&pchKernel[48], &coin.prevout.n, 4);
+
+    SHA256_CTX ctxKernel;
+    SHA256_Init(&ctxKernel);
+    SHA256_Update(&ctxKernel, pchKernel, sizeof(pchKernel));
+
+    // Only timestamps passing CheckCoinStakeTimestamp, newest first
+    for (unsigned int n = nTimeTx & STAKE_TIMESTAMP_MASK; n < nSearchInterval; n += STAKE_TIMESTAMP_MASK + 1)
+    {
+        unsigned int nTimeTry = nTimeTx - n;
+        if (nTimeTry < txPrev.nTime || coin.nTimeBlockFrom + nStakeMinAge > nTimeTry)
+            break; // and so will all older timestamps
+
+        SHA256_CTX ctx = ctxKernel;
+        SHA256_Update(&ctx, &nTimeTry, 4);
+        uint256 hash1, hash2;
+        SHA256_Final((unsigned char*)&hash1, &ctx);
+        SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+
+        if (coin.fTargetOverflow || hash2 <= coin.target)
+        {
+            nTimeTxRet = nTimeTry;
+            hashProofOfStakeRet = hash2;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CStakeKernelSearch::SearchRange(unsigned int nBegin, unsigned int nEnd)
+{
+    for (unsigned int i = nBegin; i < nEnd; i++)
+    {
+        // Stop once a kernel has been found in an earlier coin or the tip moved
+        if ((i - nBegin) % 64 == 0)
+        {
+            boost::this_thread::interruption_point();
+            boost::unique_lock<boost::mutex> lock(mutexFound);
+            if (i >= nFound || pindexPrev != pindexBest)
+                return;
+        }
+
+        unsigned int nTimeTxRet;
+        uint256 hashProofOfStake;
+        if (CheckCoin(vCoins[i], nTimeTxRet, hashProofOfStake))
+        {
+            boost::unique_lock<boost::mutex> lock(mutexFound);
+            if (i < nFound)
+            {
+                nFound = i;
+                nTimeFound = nTimeTxRet;
+                hashFound = hashProofOfStake;
+            }
+            return;
+        }
+    }
+}
+
+bool CStakeKernelSearch::Find(unsigned int& nCoin, unsigned int& nTimeTxRet, uint256& hashProofOfStakeRet)
+{
+    if (nCoin >= vCoins.size())
+        return false;
+    nFound = vCoins.size();
+
+    // Version 1 kernels look up stake modifiers block by block, keep those on one thread
+    unsigned int nRemaining = vCoins.size() - nCoin;
+    unsigned int nThreads = 1;
+    if (fProtocolV2)
+    {
+        nThreads = std::max((int64_t)1, GetArg("-stakethreads", boost::thread::hardware_concurrency()));
+        nThreads = std::max(1u, std::min(nThreads, nRemaining / STAKE_SEARCH_MIN_COINS_PER_THREAD));
+    }
+
+    if (nThreads == 1)
+        SearchRange(nCoin, vCoins.size());
+    else
+    {
+        boost::thread_group threadGroup;
+        unsigned int nChunk = (nRemaining + nThreads - 1) / nThreads;
+        for (unsigned int nBegin = nCoin; nBegin < vCoins.size(); nBegin += nChunk)
+            threadGroup.create_thread(boost::bind(&CStakeKernelSearch::SearchRange, this, nBegin, std::min(nBegin + nChunk, (unsigned int)vCoins.size())));
+        try {
+            threadGroup.join_all();
+        }
+        catch (boost::thread_interrupted&) {
+            threadGroup.interrupt_all();
+            threadGroup.join_all();
+            throw;
+        }
+    }
+
+    if (nFound == vCoins.size() || pindexPrev != pindexBest)
+        return false;
+    nCoin = nFound;
+    nTimeTxRet = nTimeFound;
+    hashProofOfStakeRet = hashFound;
+    return true;
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake)
 {
@@ -6,6 +6,8 @@
 
 #include "main.h"
 
+#include <boost/thread/mutex.hpp>
+
 // To decrease granularity of timestamp
 // Supposed to be 2^n-1
 static const int STAKE_TIMESTAMP_MASK = 15;
@@ -17,6 +19,9 @@ extern unsigned int nModifierInterval;
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
 
+// Coins per thread below which the kernel search is not split up further
+static const unsigned int STAKE_SEARCH_MIN_COINS_PER_THREAD = 256;
+
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 
@@ -24,6 +29,56 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
 
+/** Search a set of coins for a proof-of-stake kernel.
+ *
+ * Coins are tried in the order they were added, each from nTimeTx back over the
+ * search interval, and the first kernel found is returned, as a loop over
+ * CheckStakeKernelHash would find it. Under protocol v2 only timestamps allowed
+ * by STAKE_TIMESTAMP_MASK are tried. Each coin's kernel prefix is hashed once and
+ * its weighted target is computed up front, so a try costs one timestamp update
+ * and a 256-bit compare. Large coin sets are split across -stakethreads threads.
+ */
+class CStakeKernelSearch
+{
+public:
+    CStakeKernelSearch(CBlockIndex* pindexPrevIn, unsigned int nBitsIn, unsigned int nTimeTxIn, unsigned int nSearchIntervalIn);
+
+    void AddCoin(const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset, CBlockIndex* pindexFrom);
+    size_t size() const { return vCoins.size(); }
+
+    // Find the first kernel among the coins from nCoin on. On success nCoin is
+    // the index of its coin. Fails if the best block changes during the search.
+    bool Find(unsigned int& nCoin, unsigned int& nTimeTxRet, uint256& hashProofOfStakeRet);
+
+private:
+    struct Coin
+    {
+        const CTransaction* ptxPrev;
+        COutPoint prevout;
+        unsigned int nTimeBlockFrom;
+        unsigned int nTxPrevOffset;
+        CBlockIndex* pindexFrom;
+        uint256 target;
+        bool fTargetNone;       // negative weighted target, no hash meets it
+        bool fTargetOverflow;   // weighted target does not fit 256 bits, any hash meets it
+    };
+
+    CBlockIndex* pindexPrev;
+    unsigned int nBits;
+    unsigned int nTimeTx;
+    unsigned int nSearchInterval;
+    bool fProtocolV2;
+    std::vector<Coin> vCoins;
+
+    boost::mutex mutexFound;
+    unsigned int nFound;
+    unsigned int nTimeFound;
+    uint256 hashFound;
+
+    bool CheckCoin(const Coin& coin, unsigned int& nTimeTxRet, uint256& hashProofOfStakeRet) const;
+    void SearchRange(unsigned int nBegin, unsigned int nEnd);
+};
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake);
@@ -11,6 +11,7 @@
 #include "alert.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "init.h"
 #include "kernel.h"
@@ -24,6 +25,8 @@
 #include "txmempool.h"
 #include "ui_interface.h"
 
+#include <deque>
+
 using namespace std;
 using namespace boost;
  
@@ -63,20 +66,38 @@ uint256 nBestInvalidTrust = 0;
  
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CChain chainActive;
 int64_t nTimeBestReceived = 0;
 bool fImporting = false;
 bool fReindex = false;
+bool fNotaryIndex = false;
 bool fHaveGUI = false;
+int nScriptCheckThreads = 0;
 
+// An orphan block is kept decoded, with its merkle tree already built, while
+// it is in memory. Orphans far from the tip are spilled to a temporary file
+// once the in-memory pool grows past -maxorphanblocksmem and are decoded again
+// only when their parent arrives.
 struct COrphanBlock {
     uint256 hashBlock;
     uint256 hashPrev;
     std::pair<COutPoint, unsigned int> stake;
-    vector<unsigned char> vchBlock;
+    int64_t nPriority;          // lower is closer to the tip
+    unsigned int nBytes;        // serialized size
+    bool fSpilled;
+    uint64_t nSpillPos;         // offset in the spill file if fSpilled
+    CBlock block;               // empty if fSpilled
 };
 map<uint256, COrphanBlock*> mapOrphanBlocks;
 multimap<uint256, COrphanBlock*> mapOrphanBlocksByPrev;
 set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
+static set<pair<int64_t, COrphanBlock*> > setOrphanBlocksByPriority;
+static set<pair<int64_t, COrphanBlock*> > setOrphanBlocksInMemory;
+static uint64_t nOrphanBlockBytesInMemory = 0;
+static FILE* fileOrphanSpill = NULL;
+static uint64_t nOrphanSpillEnd = 0;                     // end of the used part of the spill file
+static map<uint64_t, uint64_t> mapOrphanSpillFree;       // free ranges below nOrphanSpillEnd, by offset
+static unsigned int nOrphanBlocksSpilled = 0;
  
 map<uint256, CTransaction> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
@@ -108,6 +129,8 @@ struct CMainSignals {
     boost::signals2::signal<void (const uint256 &)> UpdatedTransaction;
     // Notifies listeners of a new active block chain.
     boost::signals2::signal<void (const CBlockLocator &)> SetBestChain;
+    // Notifies listeners of every new best block, after pindexBest moved to it.
+    boost::signals2::signal<void (const CBlockIndex *)> UpdatedBlockTip;
     // Notifies listeners about an inventory item being seen on the network.
     boost::signals2::signal<void (const uint256 &)> Inventory;
     // Tells listeners to broadcast their data.
@@ -121,6 +144,7 @@ void RegisterWallet(CWalletInterface* pwalletIn) {
     g_signals.EraseTransaction.connect(boost::bind(&CWalletInterface::EraseFromWallet, pwalletIn, _1));
     g_signals.UpdatedTransaction.connect(boost::bind(&CWalletInterface::UpdatedTransaction, pwalletIn, _1));
     g_signals.SetBestChain.connect(boost::bind(&CWalletInterface::SetBestChain, pwalletIn, _1));
+    g_signals.UpdatedBlockTip.connect(boost::bind(&CWalletInterface::UpdatedBlockTip, pwalletIn, _1));
     g_signals.Inventory.connect(boost::bind(&CWalletInterface::Inventory, pwalletIn, _1));
     g_signals.Broadcast.connect(boost::bind(&CWalletInterface::ResendWalletTransactions, pwalletIn, _1));
 }
@@ -128,6 +152,7 @@ void RegisterWallet(CWalletInterface* pwalletIn) {
 void UnregisterWallet(CWalletInterface* pwalletIn) {
     g_signals.Broadcast.disconnect(boost::bind(&CWalletInterface::ResendWalletTransactions, pwalletIn, _1));
     g_signals.Inventory.disconnect(boost::bind(&CWalletInterface::Inventory, pwalletIn, _1));
+    g_signals.UpdatedBlockTip.disconnect(boost::bind(&CWalletInterface::UpdatedBlockTip, pwalletIn, _1));
     g_signals.SetBestChain.disconnect(boost::bind(&CWalletInterface::SetBestChain, pwalletIn, _1));
     g_signals.UpdatedTransaction.disconnect(boost::bind(&CWalletInterface::UpdatedTransaction, pwalletIn, _1));
     g_signals.EraseTransaction.disconnect(boost::bind(&CWalletInterface::EraseFromWallet, pwalletIn, _1));
@@ -138,6 +163,7 @@ void UnregisterWallet(CWalletInterface* pwalletIn) {
 void UnregisterAllWallets() {
     g_signals.Broadcast.disconnect_all_slots();
     g_signals.Inventory.disconnect_all_slots();
+    g_signals.UpdatedBlockTip.disconnect_all_slots();
     g_signals.SetBestChain.disconnect_all_slots();
     g_signals.UpdatedTransaction.disconnect_all_slots();
     g_signals.EraseTransaction.disconnect_all_slots();
@@ -285,6 +311,74 @@ bool CTransaction::ReadFromDisk(COutPoint prevout)
     return ReadFromDisk(txdb, prevout, txindex);
 }
 
+// the coinstake speech "clamour <pid> <pid> ..." supports CLAMour petitions by their 8 hex digit pids
+void CTransaction::GetSupport(vector<unsigned int>& vSupport) const
+{
+    vSupport.clear();
+
+    const string& strSpeech = strCLAMSpeech;
+    // LogPrintf("stake speech is '%s'\n", strSpeech);
+
+    if (strSpeech.substr(0, 7) != "clamour")
+        return;
+
+    size_t n = 7;
+    int i;
+    char c = strSpeech[n++];
+    while (true) {
+        // support starts with a space
+        if (c != ' ')
+            break;
+
+        // then 8 lowercase hex digits
+        unsigned int nPid = 0;
+        for (i = 0; i < 8; i++) {
+            c = n < strSpeech.size() ? strSpeech[n++] : '\0';
+            if (c >= '0' && c <= '9')
+                nPid = (nPid << 4) | (c - '0');
+            else if (c >= 'a' && c <= 'f')
+                nPid = (nPid << 4) | (c - 'a' + 10);
+            else
+                break;
+        }
+
+        // break if we exited the loop early
+        if (i != 8)
+            break;
+
+        // must be followed by space or end of string
+        c = n < strSpeech.size() ? strSpeech[n++] : '\0';
+        if (c != ' ' && c != '\0')
+            break;
+
+        // if all that is OK, record the support, and loop to check for other petition IDs
+        vSupport.push_back(nPid);
+    }
+
+    sort(vSupport.begin(), vSupport.end());
+    vSupport.erase(unique(vSupport.begin(), vSupport.end()), vSupport.end());
+}
+
+// notary speech is either "notary <hash>" or the bare hash, exactly as uint256::GetHex() prints it
+bool CTransaction::IsNotary(uint256& hash, bool& fPrefixed) const
+{
+    size_t len = strCLAMSpeech.length();
+
+    if (len == 7+64 && strCLAMSpeech.compare(0, 7, "notary ") == 0)
+        fPrefixed = true;
+    else if (len == 64)
+        fPrefixed = false;
+    else
+        return false;
+
+    size_t start = fPrefixed ? 7 : 0;
+    if (strCLAMSpeech.find_first_not_of("0123456789abcdef", start) != string::npos)
+        return false;
+
+    hash.SetHex(strCLAMSpeech.substr(start));
+    return true;
+}
+
 bool CTransaction::IsCreateClamour(string& strHash, string& strURL) const
 {
     size_t len = strCLAMSpeech.length();
@@ -680,7 +774,7 @@ int64_t GetMinFee(const CTransaction& tx, unsigned int nBlockSize, enum GetMinFe
 
 
 bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs)
+                        bool* pfMissingInputs, bool fBypassLimits)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -722,6 +816,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
     }
     }
 
+    int64_t nFees;
     {
         CTxDB txdb("r");
 
@@ -757,7 +852,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
                           error("AcceptToMemoryPool : too many sigops %s, %d > %d",
                                 hash.ToString(), nSigOps, MAX_TX_SIGOPS));
 
-        int64_t nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
+        nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
         unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
  
         // Don't accept it if it can't get into a block
@@ -766,6 +861,23 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
             return error("AcceptToMemoryPool : not enough fees %s, %d < %d",
                          hash.ToString(),
                          nFees, txMinFee);
+
+        // A pool that had to evict turns away what would be next in line
+        double dPoolMinFeeRate = pool.GetMinFeeRate();
+        if (fLimitFree && nFees < dPoolMinFeeRate * nSize / 1000)
+            return error("AcceptToMemoryPool : mempool min fee not met %s, %d < %.0f",
+                         hash.ToString(), nFees, dPoolMinFeeRate * nSize / 1000);
+
+        // Long chains of unconfirmed transactions make every pool update walk them.
+        // Transactions from a disconnected block were valid in it and are kept.
+        string strPackageError;
+        if (!fBypassLimits && !pool.CheckPackageLimits(tx, nSize,
+                                     GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT),
+                                     GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000,
+                                     GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT),
+                                     GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000,
+                                     strPackageError))
+            return error("AcceptToMemoryPool : too long mempool chain %s, %s", hash.ToString(), strPackageError);
  
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
@@ -798,8 +910,9 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
         }
     }
  
-    // Store transaction in memory
-    pool.addUnchecked(hash, tx);
+    // Store transaction in memory, unless the pool is full of better paying ones
+    if (!pool.addUnchecked(hash, tx, nFees))
+        return error("AcceptToMemoryPool : mempool full, fee rate of %s too low", hash.ToString());
 
     SyncWithWallets(tx, NULL);
 
@@ -943,22 +1056,29 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
  
-static CBlockIndex* pblockindexFBBHLast;
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    return chainActive[nHeight];
+}
+
+void CChain::SetTip(CBlockIndex* pindex)
+{
+    if (pindex == NULL)
+    {
+        vChain.clear();
+        return;
+    }
+    vChain.resize(pindex->nHeight + 1);
+    while (pindex && vChain[pindex->nHeight] != pindex)
+    {
+        vChain[pindex->nHeight] = pindex;
+        pindex = pindex->pprev;
+    }
+}
+
+bool CBlockIndex::IsInMainChain() const
+{
+    return chainActive.Contains(this);
 }
  
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -999,30 +1119,230 @@ uint256 WantedByOrphan(const COrphanBlock* pblockOrphan)
     return pblockOrphan->hashPrev;
 }
 
-// Remove a random orphan block (which does not have any dependent orphans).
-void static PruneOrphanBlocks()
+// Estimated height of an orphan, used to keep the orphans closest to the tip
+// in memory and to prune the farthest ones first. Heights come from the
+// orphan's parent or from headers-first sync; orphans of unknown height rank
+// after all of those, ordered by block time.
+static int64_t GetOrphanPriority(const CBlock& block);
+
+// Find room for nSize bytes in the spill file, reusing ranges of erased orphans
+// before growing the file.
+static uint64_t AllocOrphanSpill(uint64_t nSize)
 {
-    if (mapOrphanBlocksByPrev.size() <= (size_t)std::max((int64_t)0, GetArg("-maxorphanblocks", DEFAULT_MAX_ORPHAN_BLOCKS)))
-        return;
+    for (map<uint64_t, uint64_t>::iterator it = mapOrphanSpillFree.begin(); it != mapOrphanSpillFree.end(); ++it)
+    {
+        if (it->second < nSize)
+            continue;
+        uint64_t nPos = it->first;
+        uint64_t nLeft = it->second - nSize;
+        mapOrphanSpillFree.erase(it);
+        if (nLeft > 0)
+            mapOrphanSpillFree[nPos + nSize] = nLeft;
+        return nPos;
+    }
+    uint64_t nPos = nOrphanSpillEnd;
+    nOrphanSpillEnd += nSize;
+    return nPos;
+}
+
+// Give back the range of an erased orphan, merged with free neighbours.
+static void FreeOrphanSpill(uint64_t nPos, uint64_t nSize)
+{
+    map<uint64_t, uint64_t>::iterator next = mapOrphanSpillFree.lower_bound(nPos);
+    if (next != mapOrphanSpillFree.end() && next->first == nPos + nSize)
+    {
+        nSize += next->second;
+        mapOrphanSpillFree.erase(next++);
+    }
+    if (next != mapOrphanSpillFree.begin())
+    {
+        map<uint64_t, uint64_t>::iterator prev = next;
+        --prev;
+        if (prev->first + prev->second == nPos)
+        {
+            nPos = prev->first;
+            nSize += prev->second;
+            mapOrphanSpillFree.erase(prev);
+        }
+    }
+    if (nPos + nSize == nOrphanSpillEnd)
+        nOrphanSpillEnd = nPos;
+    else
+        mapOrphanSpillFree[nPos] = nSize;
+}
 
-    // Pick a random orphan block.
-    int pos = insecure_rand() % mapOrphanBlocksByPrev.size();
-    std::multimap<uint256, COrphanBlock*>::iterator it = mapOrphanBlocksByPrev.begin();
-    while (pos--) it++;
+static boost::filesystem::path GetOrphanSpillPath()
+{
+    return GetDataDir() / "orphanblocks.tmp";
+}
 
-    // As long as this block has other orphans depending on it, move to one of those successors.
-    do {
-        std::multimap<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocksByPrev.find(it->second->hashBlock);
-        if (it2 == mapOrphanBlocksByPrev.end())
+void RemoveOrphanSpill()
+{
+    if (fileOrphanSpill != NULL)
+    {
+        fclose(fileOrphanSpill);
+        fileOrphanSpill = NULL;
+    }
+    try {
+        boost::filesystem::remove(GetOrphanSpillPath());
+    } catch (boost::filesystem::filesystem_error &e) {
+        LogPrintf("RemoveOrphanSpill() : %s\n", e.what());
+    }
+}
+
+// Write an in-memory orphan to the spill file and free its decoded copy.
+static bool SpillOrphanBlock(COrphanBlock* porphan)
+{
+    if (fileOrphanSpill == NULL)
+    {
+        fileOrphanSpill = fopen(GetOrphanSpillPath().string().c_str(), "w+b");
+        if (fileOrphanSpill == NULL)
+            return error("SpillOrphanBlock() : cannot open spill file");
+    }
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << porphan->block;
+    uint64_t nPos = AllocOrphanSpill(ss.size());
+    if (fseeko(fileOrphanSpill, (off_t)nPos, SEEK_SET) != 0 ||
+        fwrite(&ss[0], 1, ss.size(), fileOrphanSpill) != ss.size())
+    {
+        FreeOrphanSpill(nPos, ss.size());
+        return error("SpillOrphanBlock() : write failed");
+    }
+
+    setOrphanBlocksInMemory.erase(make_pair(porphan->nPriority, porphan));
+    nOrphanBlockBytesInMemory -= porphan->nBytes;
+    porphan->fSpilled = true;
+    porphan->nSpillPos = nPos;
+    porphan->nBytes = ss.size();
+    porphan->block.SetNull();
+    vector<CTransaction>().swap(porphan->block.vtx);
+    vector<uint256>().swap(porphan->block.vMerkleTree);
+    nOrphanBlocksSpilled++;
+    return true;
+}
+
+// Decoded form of an orphan, read back from the spill file if necessary.
+// A spilled block that doesn't hash to its key is not returned.
+static CBlock* GetOrphanBlock(COrphanBlock* porphan)
+{
+    if (!porphan->fSpilled)
+        return &porphan->block;
+
+    vector<char> vch(porphan->nBytes);
+    if (fileOrphanSpill == NULL || fseeko(fileOrphanSpill, (off_t)porphan->nSpillPos, SEEK_SET) != 0 ||
+        fread(&vch[0], 1, vch.size(), fileOrphanSpill) != vch.size())
+    {
+        error("GetOrphanBlock() : read failed for %s", porphan->hashBlock.ToString());
+        return NULL;
+    }
+    try {
+        CDataStream ss(vch, SER_DISK, CLIENT_VERSION);
+        ss >> porphan->block;
+    }
+    catch (std::exception &e) {
+        error("GetOrphanBlock() : deserialize failed for %s", porphan->hashBlock.ToString());
+        return NULL;
+    }
+    if (porphan->block.GetHash() != porphan->hashBlock)
+    {
+        error("GetOrphanBlock() : spill file holds a different block for %s", porphan->hashBlock.ToString());
+        return NULL;
+    }
+    porphan->block.BuildMerkleTree();
+    return &porphan->block;
+}
+
+// Drop an orphan from every index and free it.
+static void EraseOrphanBlock(COrphanBlock* porphan)
+{
+    for (multimap<uint256, COrphanBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(porphan->hashPrev);
+         mi != mapOrphanBlocksByPrev.end() && mi->first == porphan->hashPrev; ++mi)
+    {
+        if (mi->second == porphan)
+        {
+            mapOrphanBlocksByPrev.erase(mi);
             break;
-        it = it2;
-    } while(1);
+        }
+    }
+    mapOrphanBlocks.erase(porphan->hashBlock);
+    setStakeSeenOrphan.erase(porphan->stake);
+    setOrphanBlocksByPriority.erase(make_pair(porphan->nPriority, porphan));
+    if (porphan->fSpilled)
+    {
+        FreeOrphanSpill(porphan->nSpillPos, porphan->nBytes);
+        // Delete the spill file once nothing in it is live
+        if (--nOrphanBlocksSpilled == 0 && fileOrphanSpill != NULL)
+        {
+            RemoveOrphanSpill();
+            assert(nOrphanSpillEnd == 0 && mapOrphanSpillFree.empty());
+        }
+    }
+    else
+    {
+        setOrphanBlocksInMemory.erase(make_pair(porphan->nPriority, porphan));
+        nOrphanBlockBytesInMemory -= porphan->nBytes;
+    }
+    delete porphan;
+}
 
-    setStakeSeenOrphan.erase(it->second->stake);
-    uint256 hash = it->second->hashBlock;
-    delete it->second;
-    mapOrphanBlocksByPrev.erase(it);
-    mapOrphanBlocks.erase(hash);
+// Keep the pool within -maxorphanblocks by removing the orphan farthest from
+// the tip (walking to one without dependent orphans), then keep the in-memory
+// part within -maxorphanblocksmem by spilling the farthest orphans to disk.
+void static PruneOrphanBlocks()
+{
+    size_t nMaxOrphans = (size_t)std::max((int64_t)0, GetArg("-maxorphanblocks", DEFAULT_MAX_ORPHAN_BLOCKS));
+    while (mapOrphanBlocks.size() > nMaxOrphans)
+    {
+        COrphanBlock* porphan = setOrphanBlocksByPriority.rbegin()->second;
+
+        // As long as this block has other orphans depending on it, move to one of those successors.
+        do {
+            std::multimap<uint256, COrphanBlock*>::iterator it = mapOrphanBlocksByPrev.find(porphan->hashBlock);
+            if (it == mapOrphanBlocksByPrev.end())
+                break;
+            porphan = it->second;
+        } while(1);
+
+        EraseOrphanBlock(porphan);
+    }
+
+    uint64_t nMaxMemory = (uint64_t)std::max((int64_t)0, GetArg("-maxorphanblocksmem", DEFAULT_MAX_ORPHAN_BLOCKS_MEMORY)) << 20;
+    while (nOrphanBlockBytesInMemory > nMaxMemory && !setOrphanBlocksInMemory.empty())
+    {
+        if (!SpillOrphanBlock(setOrphanBlocksInMemory.rbegin()->second))
+        {
+            // Without a working spill file fall back to dropping the orphan
+            EraseOrphanBlock(setOrphanBlocksInMemory.rbegin()->second);
+        }
+    }
+}
+
+// Add a checked block whose parent is unknown to the orphan pool.
+static COrphanBlock* AddOrphanBlock(const uint256& hash, const CBlock& block)
+{
+    COrphanBlock* porphan = new COrphanBlock();
+    porphan->hashBlock = hash;
+    porphan->hashPrev = block.hashPrevBlock;
+    porphan->stake = block.GetProofOfStake();
+    porphan->nPriority = GetOrphanPriority(block);
+    porphan->nBytes = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    porphan->fSpilled = false;
+    porphan->nSpillPos = 0;
+    porphan->block = block;
+    if (porphan->block.vMerkleTree.empty())
+        porphan->block.BuildMerkleTree();
+
+    mapOrphanBlocks.insert(make_pair(hash, porphan));
+    mapOrphanBlocksByPrev.insert(make_pair(porphan->hashPrev, porphan));
+    if (block.IsProofOfStake())
+        setStakeSeenOrphan.insert(porphan->stake);
+    setOrphanBlocksByPriority.insert(make_pair(porphan->nPriority, porphan));
+    setOrphanBlocksInMemory.insert(make_pair(porphan->nPriority, porphan));
+    nOrphanBlockBytesInMemory += porphan->nBytes;
+
+    PruneOrphanBlocks();
+    return mapOrphanBlocks.count(hash) ? porphan : NULL;
 }
  
 int generateMTRandom(unsigned int s, int range)
@@ -1352,6 +1672,7 @@ void static InvalidChainFound(CBlockIndex* pindexNew)
  
 void CBlock::UpdateTime(const CBlockIndex* pindexPrev)
 {
+    UncacheHash();
     nTime = max(GetBlockTime(), GetAdjustedTime());
 }
  
@@ -1531,7 +1852,8 @@ int64_t CTransaction::GetValueIn(const MapPrevTx& inputs) const
 }
 
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, int nBlockHeight, int64_t nBlockTime)
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, int nBlockHeight, int64_t nBlockTime,
+    std::vector<CScriptCheck>* pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1574,6 +1896,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
         // The first loop above does all the inexpensive checks.
         // Only if ALL inputs pass do we perform expensive ECDSA signature checks.
         // Helps prevent CPU exhaustion attacks.
+        boost::shared_ptr<const CSignatureHashContext> pSigHash;
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             COutPoint prevout = vin[i].prevout;
@@ -1592,8 +1915,20 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             // still computed and checked, and any change will be caught at the next checkpoint.
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
+                if (!pSigHash)
+                    pSigHash.reset(new CSignatureHashContext(*this));
+                if (pvChecks)
+                {
+                    // Defer the signature check to the caller's check queue;
+                    // only the cheap txFrom/txTo consistency test of VerifySignature runs here
+                    if (prevout.hash != txPrev.GetHash())
+                        return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString()));
+                    pvChecks->push_back(CScriptCheck());
+                    CScriptCheck check(txPrev, *this, i, flags, nBlockHeight, nBlockTime, pSigHash);
+                    check.swap(pvChecks->back());
+                }
                 // Verify signature
-                if (!VerifySignature(txPrev, *this, i, flags, 0, nBlockHeight, nBlockTime))
+                else if (!VerifySignature(txPrev, *this, i, flags, 0, nBlockHeight, nBlockTime, pSigHash.get()))
                 {
                     if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
                         // Check whether the failure was caused by a
@@ -1602,7 +1937,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
                         // if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        if (VerifySignature(txPrev, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0, nBlockHeight, nBlockTime))
+                        if (VerifySignature(txPrev, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0, nBlockHeight, nBlockTime, pSigHash.get()))
                             return error("ConnectInputs() : %s non-mandatory VerifySignature failed", GetHash().ToString());
                     }
                     // Failures of other flags indicate a transaction that is
@@ -1650,6 +1985,66 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
     return true;
 }
 
+bool CScriptCheck::operator()() const
+{
+    const CScript& scriptSig = ptxTo->vin[nIn].scriptSig;
+    return VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, 0, nBlockHeight, nBlockTime, pSigHash.get());
+}
+
+bool CScriptCheck::ReportFailure() const
+{
+    const CScript& scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, 0, nBlockHeight, nBlockTime, pSigHash.get()))
+        return true;
+
+    // Same policy as the serial path in ConnectInputs
+    if (nFlags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
+        if (VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0, nBlockHeight, nBlockTime, pSigHash.get()))
+            return error("ConnectInputs() : %s non-mandatory VerifySignature failed", ptxTo->GetHash().ToString());
+    }
+    return ptxTo->DoS(100,error("ConnectInputs() : %s VerifySignature failed", ptxTo->GetHash().ToString()));
+}
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck() {
+    RenameThread("clam-scriptch");
+    scriptcheckqueue.Thread();
+}
+
+// Support for CLAMour petitions is read from the coinstake speech when a block
+// connects, and cached in memory and in the tx database from then on
+static void GetBlockSupport(const CBlock& block, vector<unsigned int>& vSupport)
+{
+    vSupport.clear();
+
+    if (!block.IsProofOfStake())
+        return;
+
+    if (block.vtx.size() < 2) {
+        LogPrintf("block only has %d transactions?\n", block.vtx.size());
+        return;
+    }
+
+    block.vtx[1].GetSupport(vSupport);
+}
+
+// Add or remove this block's notary transactions in the -notaryindex database
+static bool UpdateNotaryIndex(CTxDB& txdb, const CBlock& block, int nHeight, bool fConnect)
+{
+    uint256 hash;
+    bool fPrefixed;
+
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        if (tx.IsNotary(hash, fPrefixed)) {
+            if (fConnect ? !txdb.AddNotaryIndex(hash, CNotaryIndexEntry(tx.GetHash(), nHeight, fPrefixed))
+                         : !txdb.EraseNotaryIndex(hash, tx.GetHash()))
+                return false;
+        }
+
+    return true;
+}
+
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
     int64_t nStakeReward = 0;
@@ -1689,6 +2084,9 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
             return error("DisconnectBlock() : WriteBlockIndex failed");
     }
 
+    if (fNotaryIndex && !UpdateNotaryIndex(txdb, *this, pindex->nHeight, false))
+        return error("DisconnectBlock() : UpdateNotaryIndex failed");
+
     // ppcoin: clean up wallet after disconnecting coinstake
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this, false);
@@ -1725,6 +2123,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     else
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
+    // Script checks for the whole block are verified in parallel by the
+    // -par worker threads; the master thread joins in when control.Wait() is called
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
     map<uint256, CTxIndex> mapQueuedChanges;
     int64_t nFees = 0;
     int64_t nValueIn = 0;
@@ -1792,8 +2194,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (tx.IsCoinStake())
                 nStakeReward = nTxValueOut - nTxValueIn;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags, pindex->nHeight, GetBlockTime()))
+            vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags, pindex->nHeight, GetBlockTime(), nScriptCheckThreads ? &vChecks : NULL))
                 return false;
+            control.Add(vChecks);
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
@@ -1806,6 +2210,15 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             }
     }
 
+    CScriptCheck checkFailed;
+    if (!control.Wait(&checkFailed))
+    {
+        // Re-run the check that failed to report it exactly as ConnectInputs would have
+        if (!checkFailed.ReportFailure())
+            return false;
+        return error("ConnectBlock() : parallel script verification failed");
+    }
+
     if (IsProofOfWork())
     {
 	int64_t nReward = GetProofOfWorkReward(pindex->nHeight, nFees);
@@ -1859,6 +2272,15 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : WriteBlockIndex failed");
     }
 
+    if (fNotaryIndex && !UpdateNotaryIndex(txdb, *this, pindex->nHeight, true))
+        return error("ConnectBlock() : UpdateNotaryIndex failed");
+
+    // record which CLAMour petitions the block supports while it is in memory
+    GetBlockSupport(*this, pindex->vSupport);
+    pindex->fSupportChecked = true;
+    if (!txdb.WriteBlockSupport(pindex->GetBlockHash(), pindex->vSupport))
+        return error("ConnectBlock() : WriteBlockSupport failed");
+
     // Watch for transactions paying to me
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this);
@@ -1967,10 +2389,11 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     BOOST_FOREACH(CBlockIndex* pindex, vConnect)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
+    chainActive.SetTip(pindexNew);
 
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect)
-        AcceptToMemoryPool(mempool, tx, false, NULL);
+        AcceptToMemoryPool(mempool, tx, false, NULL, true);
 
     // Delete redundant memory transactions that are in the connected branch
     BOOST_FOREACH(CTransaction& tx, vDelete) {
@@ -2001,6 +2424,7 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 
     // Add to current best branch
     pindexNew->pprev->pnext = pindexNew;
+    chainActive.SetTip(pindexNew);
 
     // Delete redundant memory transactions
     BOOST_FOREACH(CTransaction& tx, vtx)
@@ -2022,6 +2446,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         if (!txdb.TxnCommit())
             return error("SetBestChain() : TxnCommit failed");
         pindexGenesisBlock = pindexNew;
+        chainActive.SetTip(pindexNew);
     }
     else if (hashPrevBlock == hashBestChain)
     {
@@ -2076,6 +2501,9 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 
     // Update best block in wallet (so we can detect restored wallets)
     bool fIsInitialDownload = IsInitialBlockDownload();
+
+    // Group the index writes of consecutive blocks while catching up
+    CTxDB::SetBatchWrites(fIsInitialDownload || fImporting);
     if ((pindexNew->nHeight % 20160) == 0 || (!fIsInitialDownload && (pindexNew->nHeight % 144) == 0))
     {
         const CBlockLocator locator(pindexNew);
@@ -2085,7 +2513,6 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
@@ -2099,6 +2526,8 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
       nBestBlockTrust.Get64(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()));
 
+    g_signals.UpdatedBlockTip(pindexBest);
+
     // Check the version of the last 100 blocks to see if we need to upgrade:
     if (!fIsInitialDownload)
     {
@@ -2237,18 +2666,36 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
 
-    // Write to disk block index
+    // Write to disk block index. A block that extends the best chain is
+    // written by ConnectBlock, in the same transaction as its tx index
+    // changes and the new best chain pointer.
     CTxDB txdb;
-    if (!txdb.TxnBegin())
-        return false;
-    txdb.WriteBlockIndex(CDiskBlockIndex(pindexNew));
-    if (!txdb.TxnCommit())
-        return false;
+    bool fExtendsBest = pindexNew->nChainTrust > nBestChainTrust && pindexGenesisBlock != NULL && hashPrevBlock == hashBestChain;
+    if (!fExtendsBest)
+    {
+        if (!txdb.TxnBegin())
+            return false;
+        txdb.WriteBlockIndex(CDiskBlockIndex(pindexNew));
+        if (!txdb.TxnCommit())
+            return false;
+    }
 
     // New best
     if (pindexNew->nChainTrust > nBestChainTrust)
         if (!SetBestChain(txdb, pindexNew))
+        {
+            // keep the rejected block in the index, as before
+            if (fExtendsBest)
+                txdb.WriteBlockIndex(CDiskBlockIndex(pindexNew));
             return false;
+        }
+
+    // Write out the batched index writes every 500 blocks during initial
+    // sync, along with the block files (see WriteToDisk). A full cache is
+    // written out earlier, but commits the block file first, so the index
+    // never points at block data that is not on disk.
+    if (pindexNew == pindexBest && pindexNew->nHeight % 500 == 0)
+        CTxDB::Flush();
 
     if (pindexNew == pindexBest)
     {
@@ -2486,60 +2933,76 @@ uint256 CBlockIndex::GetBlockTrust() const
     return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
 }
 
-std::set<std::string> CBlockIndex::GetSupport() const
+const std::vector<unsigned int>& CBlockIndex::GetSupport() const
 {
     if (fSupportChecked)
-        return setSupport;
+        return vSupport;
 
-    CBlock block;
-    block.ReadFromDisk(this, true);
+    CTxDB txdb;
+    if (!txdb.ReadBlockSupport(GetBlockHash(), vSupport)) {
+        CBlock block;
+        block.ReadFromDisk(this, true);
+        GetBlockSupport(block, vSupport);
+        txdb.WriteBlockSupport(GetBlockHash(), vSupport);
+    }
 
     fSupportChecked = true;
+    return vSupport;
+}
 
-    if (block.IsProofOfStake()) {
-        do {
-            if (block.vtx.size() < 2) {
-                LogPrintf("block only has %d transactions?\n", block.vtx.size());
-                break;
-            }
-
-            string& strSpeech = block.vtx[1].strCLAMSpeech;
-            // LogPrintf("stake speech is '%s'\n", strSpeech);
-
-            if (strSpeech.substr(0, 7) != "clamour")
-                break;
+// The main chain blocks from nSupportFirst up to pindexSupportLast, listed by
+// the CLAMour pid they support. Heights are kept in ascending order, so the
+// number of supporting blocks in any window is a difference of two positions.
+// Protected by cs_main.
+static map<unsigned int, deque<int> > mapSupportHeights;
+static int nSupportFirst = 0;
+static CBlockIndex* pindexSupportLast = NULL;
 
-            int n = 7;
-            int i;
-            char c = strSpeech[n++];
-            while (true) {
-                // support starts with a space
-                if (c != ' ')
-                    break;
+void GetSupportCounts(int nFirst, int nLast, map<string, int>& mapSupport)
+{
+    LOCK(cs_main);
 
-                // then 8 lowercase hex digits
-                for (i = 0; i < 8; i++) {
-                    c = strSpeech[n++];
-                    if ((c < '0' || c > '9') && (c < 'a' || c > 'f'))
-                        break;
-                }
+    mapSupport.clear();
+    if (nFirst > nLast || nFirst < 0 || nLast > nBestHeight)
+        return;
 
-                // break if we exited the loop early
-                if (i != 8)
-                    break;
+    // forget blocks that were disconnected since the last query
+    while (pindexSupportLast && !chainActive.Contains(pindexSupportLast)) {
+        BOOST_FOREACH(unsigned int nPid, pindexSupportLast->GetSupport()) {
+            deque<int>& vHeights = mapSupportHeights[nPid];
+            vHeights.pop_back();
+            if (vHeights.empty())
+                mapSupportHeights.erase(nPid);
+        }
+        pindexSupportLast = (pindexSupportLast->nHeight > nSupportFirst) ? pindexSupportLast->pprev : NULL;
+    }
 
-                // must be followed by space or end of string
-                c = strSpeech[n++];
-                if (c != ' ' && c != '\0')
-                    break;
+    if (!pindexSupportLast) {
+        mapSupportHeights.clear();
+        pindexSupportLast = chainActive[nLast];
+        nSupportFirst = nLast;
+        BOOST_FOREACH(unsigned int nPid, pindexSupportLast->GetSupport())
+            mapSupportHeights[nPid].push_back(nLast);
+    }
 
-                // if all that is OK, record the support, and loop to check for other petition IDs
-                setSupport.insert(strSpeech.substr(n-9, 8));
-            }
-        } while (false);
+    // extend the tally up to nLast and down to nFirst
+    while (pindexSupportLast->nHeight < nLast) {
+        pindexSupportLast = chainActive[pindexSupportLast->nHeight + 1];
+        BOOST_FOREACH(unsigned int nPid, pindexSupportLast->GetSupport())
+            mapSupportHeights[nPid].push_back(pindexSupportLast->nHeight);
+    }
+    while (nSupportFirst > nFirst) {
+        nSupportFirst--;
+        BOOST_FOREACH(unsigned int nPid, chainActive[nSupportFirst]->GetSupport())
+            mapSupportHeights[nPid].push_front(nSupportFirst);
     }
 
-    return setSupport;
+    for (map<unsigned int, deque<int> >::const_iterator it = mapSupportHeights.begin(); it != mapSupportHeights.end(); ++it) {
+        const deque<int>& vHeights = it->second;
+        int nCount = upper_bound(vHeights.begin(), vHeights.end(), nLast) - lower_bound(vHeights.begin(), vHeights.end(), nFirst);
+        if (nCount)
+            mapSupport[strprintf("%08x", it->first)] = nCount;
+    }
 }
 
 bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
@@ -2565,6 +3028,348 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
     pnode->PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
 }
 
+//
+// Headers-first initial block download
+//
+// While we are behind, the sync peer picked by StartSync only sends us
+// headers. Checked headers are kept in vSyncHeaders, up to MAX_SYNC_HEADERS
+// past the blocks we have, and the bodies of the next BLOCK_DOWNLOAD_WINDOW of
+// them are requested from all peers at once. Blocks arriving before their
+// parent wait in the orphan pool and ProcessBlock connects them in order.
+// Proof-of-stake headers can't be checked without their blocks, so at most
+// MAX_UNCHECKED_SYNC_HEADERS of them are kept past our best block.
+// Block invs and getblocks still work next to this as a fallback, for blocks
+// off the header chain and for when there is no header chain to follow.
+// All of this is guarded by cs_main.
+//
+
+struct CBlockInFlight
+{
+    int nNodeId;
+    int nHeight;
+    int64_t nTime;
+};
+
+static deque<uint256> vSyncHeaders;           // header chain past our blocks, by height
+static int nSyncHeadersHeight = 0;            // height of vSyncHeaders.front()
+static map<uint256, int> mapSyncHeaders;      // height of each entry in vSyncHeaders
+static deque<int> vSyncHeadersSource;         // peer that sent each entry in vSyncHeaders
+static int nHeadersSyncNode = -1;             // peer we ask for headers
+static int64_t nHeadersRequestTime = 0;       // time of the outstanding getheaders, 0 if none
+static int64_t nHeadersReceivedTime = 0;
+static bool fHeadersMore = false;             // last 'headers' reply was full
+static map<uint256, CBlockInFlight> mapBlocksInFlight;
+static map<int, int> mapBlocksInFlightByNode;
+static set<int> setStallingNodes;
+static uint256 hashSyncHeadersStalled;        // next block of the header chain that timed out
+static set<int> setSyncHeadersStalledNodes;   // peers it timed out on
+static int nBadHeadersNode = -1;              // sent a header chain whose blocks nobody serves
+
+bool fHeadersFirst = true;
+
+// True while we are behind and should sync headers-first, or are still
+// fetching blocks for headers we have
+static bool IsHeadersFirstSync()
+{
+    if (!fHeadersFirst || fImporting || fReindex)
+        return false;
+    return !vSyncHeaders.empty() || pindexBest == NULL ||
+           nBestHeight < Checkpoints::GetTotalBlocksEstimate() ||
+           pindexBest->GetBlockTime() < GetTime() - 8 * 60 * 60;
+}
+
+static void ClearSyncHeaders()
+{
+    vSyncHeaders.clear();
+    mapSyncHeaders.clear();
+    vSyncHeadersSource.clear();
+}
+
+// Forget headers whose blocks have been connected or stored
+static void PruneSyncHeaders()
+{
+    while (!vSyncHeaders.empty() && mapBlockIndex.count(vSyncHeaders.front()))
+    {
+        mapSyncHeaders.erase(vSyncHeaders.front());
+        vSyncHeaders.pop_front();
+        vSyncHeadersSource.pop_front();
+        nSyncHeadersHeight++;
+    }
+}
+
+static int64_t GetOrphanPriority(const CBlock& block)
+{
+    map<uint256, COrphanBlock*>::iterator mi = mapOrphanBlocks.find(block.hashPrevBlock);
+    if (mi != mapOrphanBlocks.end() && mi->second->nPriority < std::numeric_limits<int>::max())
+        return mi->second->nPriority + 1;
+    map<uint256, int>::iterator mh = mapSyncHeaders.find(block.GetHash());
+    if (mh != mapSyncHeaders.end())
+        return mh->second;
+    return (int64_t)std::numeric_limits<int>::max() + block.nTime;
+}
+
+static void PushGetHeaders(CNode* pnode)
+{
+    nHeadersSyncNode = pnode->id;
+    nHeadersRequestTime = GetTime();
+
+    // Continue from the last header we have, falling back to our best chain
+    if (vSyncHeaders.empty())
+        pnode->PushMessage("getheaders", CBlockLocator(pindexBest), uint256(0));
+    else
+        pnode->PushMessage("getheaders", CBlockLocator(pindexBest, vSyncHeaders.back()), uint256(0));
+}
+
+static int GetLastPoWHeight()
+{
+    return TestNet() ? LAST_TESTNET_POW_BLOCK : LAST_POW_BLOCK;
+}
+
+// Whether the header chain already runs as far past our best block as
+// unchecked proof-of-stake headers may, so no more should be asked for yet
+static bool IsSyncHeadersStakeLimited()
+{
+    int nLastHeight = nSyncHeadersHeight + (int)vSyncHeaders.size() - 1;
+    return !vSyncHeaders.empty() && nLastHeight > GetLastPoWHeight() &&
+           nLastHeight >= nBestHeight + MAX_UNCHECKED_SYNC_HEADERS / 2;
+}
+
+static bool CheckSyncHeader(const CBlock& header, int nHeight)
+{
+    if (header.GetBlockTime() > FutureDrift(GetAdjustedTime(), nHeight))
+        return error("CheckSyncHeader() : block %d timestamp too far in the future", nHeight);
+    if (!Checkpoints::CheckHardened(nHeight, header.GetHash()))
+        return error("CheckSyncHeader() : rejected by hardened checkpoint lock-in at %d", nHeight);
+    return true;
+}
+
+static bool AcceptSyncHeaders(CNode* pfrom, const vector<CBlock>& vHeaders)
+{
+    // Only the peer we asked, anything else is unsolicited
+    if (pfrom->id != nHeadersSyncNode)
+        return true;
+    nHeadersRequestTime = 0;
+    nHeadersReceivedTime = GetTime();
+    fHeadersMore = (vHeaders.size() >= MAX_HEADERS_RESULTS);
+
+    BOOST_FOREACH(const CBlock& header, vHeaders)
+    {
+        uint256 hash = header.GetHash();
+        if (mapBlockIndex.count(hash))
+        {
+            // We have this block, so all its ancestors too
+            ClearSyncHeaders();
+            continue;
+        }
+
+        int nHeight;
+        map<uint256, int>::iterator mi = mapSyncHeaders.find(header.hashPrevBlock);
+        if (mi != mapSyncHeaders.end())
+        {
+            // Drop our headers past the parent if the peer's chain differs
+            nHeight = mi->second + 1;
+            while (nSyncHeadersHeight + (int)vSyncHeaders.size() > nHeight)
+            {
+                mapSyncHeaders.erase(vSyncHeaders.back());
+                vSyncHeaders.pop_back();
+                vSyncHeadersSource.pop_back();
+            }
+        }
+        else
+        {
+            map<uint256, CBlockIndex*>::iterator bi = mapBlockIndex.find(header.hashPrevBlock);
+            if (bi == mapBlockIndex.end())
+            {
+                fHeadersMore = false;
+                return error("AcceptSyncHeaders() : header %s does not connect", hash.ToString());
+            }
+            nHeight = bi->second->nHeight + 1;
+            ClearSyncHeaders();
+            nSyncHeadersHeight = nHeight;
+        }
+
+        if (!CheckSyncHeader(header, nHeight))
+        {
+            fHeadersMore = false;
+            pfrom->Misbehaving(20);
+            return false;
+        }
+
+        // Up to the last proof-of-work block the work in a header can be
+        // checked. A header without it can only be proof-of-stake, which
+        // takes the block to check, so the header chain stops there and
+        // getblocks fetches the blocks instead.
+        if (nHeight <= GetLastPoWHeight() &&
+            !CheckProofOfWork(header.GetPoWHash(), header.nBits))
+        {
+            LogPrint("net", "headers-first: header %s at %d from peer=%d has no proof-of-work, fetching blocks\n",
+                     hash.ToString(), nHeight, pfrom->id);
+            fHeadersMore = false;
+            PushGetBlocks(pfrom, pindexBest, uint256(0));
+            break;
+        }
+
+        // Past the last proof-of-work block a made-up header chain would only
+        // show when its blocks fail, so it may not run far ahead of our best
+        // block. More headers are asked for as the blocks connect.
+        if (nHeight > GetLastPoWHeight() && nHeight > nBestHeight + MAX_UNCHECKED_SYNC_HEADERS)
+        {
+            fHeadersMore = true;
+            break;
+        }
+
+        vSyncHeaders.push_back(hash);
+        mapSyncHeaders[hash] = nHeight;
+        vSyncHeadersSource.push_back(pfrom->id);
+    }
+    PruneSyncHeaders();
+
+    LogPrint("net", "headers-first: %u headers from peer=%d, have headers up to %d\n",
+             vHeaders.size(), pfrom->id, nSyncHeadersHeight + (int)vSyncHeaders.size() - 1);
+
+    // Keep going while the peer has more and we have room
+    if (fHeadersMore && (int)vSyncHeaders.size() < MAX_SYNC_HEADERS && !IsSyncHeadersStakeLimited())
+        PushGetHeaders(pfrom);
+    return true;
+}
+
+static void MarkBlockReceived(const uint256& hash)
+{
+    map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.find(hash);
+    if (mi == mapBlocksInFlight.end())
+        return;
+    map<int, int>::iterator ni = mapBlocksInFlightByNode.find(mi->second.nNodeId);
+    if (ni != mapBlocksInFlightByNode.end() && --ni->second <= 0)
+        mapBlocksInFlightByNode.erase(ni);
+    mapBlocksInFlight.erase(mi);
+}
+
+// Give up on requests that took too long so other peers can serve them. The
+// more peers share our link, the longer each is given. A peer holding up the
+// next block we need is remembered as stalling. If that block times out on
+// more than one peer, the header chain may be made up: it is dropped, and the
+// peer that sent it is disconnected so another one is asked for headers.
+static void ExpireBlocksInFlight()
+{
+    static int64_t nLastExpire;
+    int64_t nNow = GetTime();
+    if (nNow == nLastExpire)
+        return;
+    nLastExpire = nNow;
+
+    int64_t nTimeout = BLOCK_DOWNLOAD_TIMEOUT;
+    if (mapBlocksInFlightByNode.size() > 1)
+        nTimeout += BLOCK_DOWNLOAD_TIMEOUT_PER_PEER * (mapBlocksInFlightByNode.size() - 1);
+
+    vector<uint256> vExpired;
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CBlockInFlight)& item, mapBlocksInFlight)
+    {
+        if (nNow - item.second.nTime <= nTimeout)
+            continue;
+        vExpired.push_back(item.first);
+        if (item.second.nHeight == nSyncHeadersHeight)
+        {
+            setStallingNodes.insert(item.second.nNodeId);
+            if (item.first != hashSyncHeadersStalled)
+            {
+                hashSyncHeadersStalled = item.first;
+                setSyncHeadersStalledNodes.clear();
+            }
+            setSyncHeadersStalledNodes.insert(item.second.nNodeId);
+        }
+    }
+    BOOST_FOREACH(const uint256& hash, vExpired)
+        MarkBlockReceived(hash);
+
+    if (setSyncHeadersStalledNodes.size() > 1 && !vSyncHeaders.empty() &&
+        vSyncHeaders.front() == hashSyncHeadersStalled)
+    {
+        nBadHeadersNode = vSyncHeadersSource.front();
+        LogPrintf("headers-first: block %s timed out on %u peers, dropping headers from peer=%d\n",
+                  hashSyncHeadersStalled.ToString(), setSyncHeadersStalledNodes.size(), nBadHeadersNode);
+        ClearSyncHeaders();
+        setStallingNodes.clear();
+        setSyncHeadersStalledNodes.clear();
+        hashSyncHeadersStalled = 0;
+        fHeadersMore = false;
+        nHeadersRequestTime = 0;
+    }
+}
+
+// Called from SendMessages for every peer while IsHeadersFirstSync()
+static void SendHeadersFirstRequests(CNode* pto)
+{
+    if (pto->id == nBadHeadersNode)
+    {
+        // A slow network looks the same as a made-up chain, so no ban
+        LogPrintf("headers-first: disconnecting peer=%d, nobody served its headers\n", pto->id);
+        nBadHeadersNode = -1;
+        if (nHeadersSyncNode == pto->id)
+            nHeadersSyncNode = -1;
+        pto->Misbehaving(10);
+        pto->fDisconnect = true;
+        return;
+    }
+    if (pto->fClient || pto->fDisconnect || !pto->fSuccessfullyConnected)
+        return;
+    int64_t nNow = GetTime();
+
+    // Headers: the sync peer is disconnected if it does not answer, StartSync
+    // then picks another one. While caught up with it, check back regularly.
+    if (pto->id == nHeadersSyncNode)
+    {
+        if (nHeadersRequestTime != 0 && nNow - nHeadersRequestTime > BLOCK_DOWNLOAD_TIMEOUT)
+        {
+            LogPrintf("headers-first: peer=%d did not send headers, disconnecting\n", pto->id);
+            nHeadersSyncNode = -1;
+            pto->fDisconnect = true;
+            return;
+        }
+        if (nHeadersRequestTime == 0 && (int)vSyncHeaders.size() < MAX_SYNC_HEADERS / 2 &&
+            !IsSyncHeadersStakeLimited() &&
+            (fHeadersMore || nNow - nHeadersReceivedTime > BLOCK_DOWNLOAD_TIMEOUT))
+            PushGetHeaders(pto);
+    }
+
+    // Blocks
+    ExpireBlocksInFlight();
+    if (setStallingNodes.erase(pto->id) && mapBlocksInFlightByNode.size() > 1)
+    {
+        LogPrintf("headers-first: peer=%d is stalling block download, disconnecting\n", pto->id);
+        pto->fDisconnect = true;
+        return;
+    }
+
+    PruneSyncHeaders();
+    int nInFlight = mapBlocksInFlightByNode.count(pto->id) ? mapBlocksInFlightByNode[pto->id] : 0;
+    vector<CInv> vGetData;
+    for (int i = 0; i < BLOCK_DOWNLOAD_WINDOW && i < (int)vSyncHeaders.size(); i++)
+    {
+        if (nInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+            break;
+        int nHeight = nSyncHeadersHeight + i;
+        if (nHeight > pto->nStartingHeight)
+            break;
+        const uint256& hash = vSyncHeaders[i];
+        if (mapBlocksInFlight.count(hash) || mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+            continue;
+
+        CBlockInFlight block;
+        block.nNodeId = pto->id;
+        block.nHeight = nHeight;
+        block.nTime = nNow;
+        mapBlocksInFlight[hash] = block;
+        nInFlight++;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+    }
+    if (!vGetData.empty())
+    {
+        mapBlocksInFlightByNode[pto->id] = nInFlight;
+        LogPrint("net", "headers-first: requesting %u blocks from peer=%d\n", vGetData.size(), pto->id);
+        pto->PushMessage("getdata", vGetData);
+    }
+}
+
 bool static ReserealizeBlockSignature(CBlock* pblock)
 {
     if (pblock->IsProofOfWork()) {
@@ -2662,23 +3467,14 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
                 if (setStakeSeenOrphan.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
                     return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for orphan block %s", pblock->GetProofOfStake().first.ToString(), pblock->GetProofOfStake().second, hash.ToString());
             }
-            PruneOrphanBlocks();
-            COrphanBlock* pblock2 = new COrphanBlock();
-            {
-                CDataStream ss(SER_DISK, CLIENT_VERSION);
-                ss << *pblock;
-                pblock2->vchBlock = std::vector<unsigned char>(ss.begin(), ss.end());
-            }
-            pblock2->hashBlock = hash;
-            pblock2->hashPrev = pblock->hashPrevBlock;
-            pblock2->stake = pblock->GetProofOfStake();
-            mapOrphanBlocks.insert(make_pair(hash, pblock2));
-            mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrev, pblock2));
-            if (pblock->IsProofOfStake())
-                setStakeSeenOrphan.insert(pblock->GetProofOfStake());
+            COrphanBlock* pblock2 = AddOrphanBlock(hash, *pblock);
+            if (pblock2 == NULL)
+                return true;
 
-            // Ask this guy to fill in what we're missing
-            PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
+            // Ask this guy to fill in what we're missing, unless headers-first
+            // sync is already fetching it
+            if (!mapSyncHeaders.count(hash))
+                PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
             // ppcoin: getblocks may not obtain the ancestor block rejected
             // earlier by duplicate-stake check so we ask for it again directly
             if (!IsInitialBlockDownload())
@@ -2697,23 +3493,19 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     for (unsigned int i = 0; i < vWorkQueue.size(); i++)
     {
         uint256 hashPrev = vWorkQueue[i];
+        vector<COrphanBlock*> vChildren;
         for (multimap<uint256, COrphanBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
              mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
              ++mi)
+            vChildren.push_back(mi->second);
+        BOOST_FOREACH(COrphanBlock* porphan, vChildren)
         {
-            CBlock block;
-            {
-                CDataStream ss(mi->second->vchBlock, SER_DISK, CLIENT_VERSION);
-                ss >> block;
-            }
-            block.BuildMerkleTree();
-            if (block.AcceptBlock())
-                vWorkQueue.push_back(mi->second->hashBlock);
-            mapOrphanBlocks.erase(mi->second->hashBlock);
-            setStakeSeenOrphan.erase(block.GetProofOfStake());
-            delete mi->second;
+            // The decoded block and its merkle tree are reused as they are
+            CBlock* pblockOrphan = GetOrphanBlock(porphan);
+            if (pblockOrphan && pblockOrphan->AcceptBlock())
+                vWorkQueue.push_back(porphan->hashBlock);
+            EraseOrphanBlock(porphan);
         }
-        mapOrphanBlocksByPrev.erase(hashPrev);
     }
 
     LogPrintf("ProcessBlock: ACCEPTED\n");
@@ -2757,6 +3549,8 @@ bool CBlock::SignBlock(CWallet& wallet, int64_t nFees)
             {
                 // make sure coinstake would meet timestamp protocol
                 //    as it would be the same as the block timestamp
+                UncacheHash();
+                vtx[0].UncacheHash();
                 vtx[0].nTime = nTime = txCoinStake.nTime;
                 nTime = max(pindexBest->GetPastTimeLimit()+1, GetMaxTransactionTime());
                 nTime = max(GetBlockTime(), PastDrift(pindexBest->GetBlockTime(), pindexBest->nHeight+1));
@@ -2852,10 +3646,42 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
     return file;
 }
 
+bool ReadRawBlockFromDisk(CDataStream& ssBlock, unsigned int nFile, unsigned int nBlockPos)
+{
+    // WriteToDisk puts the message start and the block's size right before it
+    unsigned int nHeaderSize = MESSAGE_START_SIZE + sizeof(unsigned int);
+    if (nBlockPos < nHeaderSize)
+        return error("ReadRawBlockFromDisk() : bad block position %u", nBlockPos);
+
+    CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos - nHeaderSize, "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("ReadRawBlockFromDisk() : OpenBlockFile failed");
+
+    try {
+        MessageStartChars pchMessageStart;
+        unsigned int nSize;
+        filein >> FLATDATA(pchMessageStart) >> nSize;
+        if (memcmp(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+            return error("ReadRawBlockFromDisk() : no message start before block at %u:%u", nFile, nBlockPos);
+        if (nSize > MAX_BLOCK_SIZE)
+            return error("ReadRawBlockFromDisk() : bad block size %u at %u:%u", nSize, nFile, nBlockPos);
+        ssBlock.resize(nSize);
+        filein.read(&ssBlock[0], nSize);
+    }
+    catch (std::exception &e) {
+        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+    }
+    return true;
+}
+
+// CommitBlockFile is called from the tx database cache flush, which runs
+// under cs_txdbcache and so cannot take cs_main, hence a lock of its own
+static CCriticalSection cs_nCurrentBlockFile;
 static unsigned int nCurrentBlockFile = 1;
 
 FILE* AppendBlockFile(unsigned int& nFileRet)
 {
+    LOCK(cs_nCurrentBlockFile);
     nFileRet = 0;
     while (true)
     {
@@ -2870,15 +3696,35 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
             nFileRet = nCurrentBlockFile;
             return file;
         }
+        // CommitBlockFile only looks at the current file
+        FileCommit(file);
         fclose(file);
         nCurrentBlockFile++;
     }
 }
 
+bool CommitBlockFile()
+{
+    unsigned int nFile;
+    {
+        LOCK(cs_nCurrentBlockFile);
+        nFile = nCurrentBlockFile;
+    }
+    FILE* file = OpenBlockFile(nFile, 0, "ab");
+    if (!file)
+        return error("CommitBlockFile() : OpenBlockFile failed");
+    FileCommit(file);
+    fclose(file);
+    return true;
+}
+
 bool LoadBlockIndex(bool fAllowNew, bool fReindex)
 {
     LOCK(cs_main);
 
+    // An earlier run may not have shut down cleanly
+    RemoveOrphanSpill();
+
     if (TestNet())
     {
         nStakeMinAge = 1 * 30 * 60; // test net min age is 30 minutes
@@ -3067,7 +3913,8 @@ bool LoadExternalBlockFile(FILE* fileIn)
                    __PRETTY_FUNCTION__);
         }
     }
-    LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+    int64_t nElapsed = GetTimeMillis() - nStart;
+    LogPrintf("Loaded %i blocks from external file in %dms (%.1f blocks/s)\n", nLoaded, nElapsed, nElapsed > 0 ? 1000.0 * nLoaded / nElapsed : 0.0);
     return nLoaded > 0;
 }
 
@@ -3107,6 +3954,9 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
             RenameOver(pathBootstrap, pathBootstrapOld);
         }
     }
+
+    // write out the index changes batched up during the import
+    CTxDB::Flush();
 }
 
 
@@ -3118,6 +3968,104 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 
 
 
+// Set once the background build has caught up with the chain; protected by cs_main
+static bool fNotaryIndexReady = false;
+
+void ThreadNotaryIndex()
+{
+    RenameThread("clam-notaryidx");
+
+    int nHeight;
+    {
+        LOCK(cs_main);
+        CTxDB txdb;
+        if (!txdb.ReadNotaryIndexHeight(nHeight)) {
+            // first run with -notaryindex, or it was switched off in between:
+            // drop whatever is left over and index from scratch
+            LogPrintf("ThreadNotaryIndex() : building notary index\n");
+            nHeight = NOTARY_FIRST_HEIGHT + 1;
+            if (!txdb.WipeNotaryIndex() || !txdb.WriteNotaryIndexHeight(nHeight)) {
+                error("ThreadNotaryIndex() : failed to reset notary index");
+                return;
+            }
+        }
+    }
+
+    // Blocks connected from now on are indexed by ConnectBlock, so only the
+    // part of the chain below the tip has to be read back from disk. Work in
+    // small chunks to avoid holding cs_main for long.
+    while (true)
+    {
+        boost::this_thread::interruption_point();
+
+        LOCK(cs_main);
+        CTxDB txdb;
+        if (nHeight < 0 || nHeight > nBestHeight) {
+            if (nHeight >= 0 && !txdb.WriteNotaryIndexHeight(-1)) {
+                error("ThreadNotaryIndex() : WriteNotaryIndexHeight failed");
+                return;
+            }
+            fNotaryIndexReady = true;
+            LogPrintf("ThreadNotaryIndex() : notary index is up to date\n");
+            return;
+        }
+
+        if (!txdb.TxnBegin()) {
+            error("ThreadNotaryIndex() : TxnBegin failed");
+            return;
+        }
+        int nEnd = std::min(nHeight + 100, nBestHeight + 1);
+        for (; nHeight < nEnd; nHeight++) {
+            CBlock block;
+            if (!block.ReadFromDisk(chainActive[nHeight]) || !UpdateNotaryIndex(txdb, block, nHeight, true)) {
+                txdb.TxnAbort();
+                error("ThreadNotaryIndex() : failed to index block at height %d", nHeight);
+                return;
+            }
+        }
+        if (!txdb.WriteNotaryIndexHeight(nHeight) || !txdb.TxnCommit()) {
+            error("ThreadNotaryIndex() : failed to commit notary index");
+            return;
+        }
+    }
+}
+
+struct CompareNotaryEntryHeight
+{
+    bool operator()(const CNotaryIndexEntry& a, const CNotaryIndexEntry& b) const
+    {
+        return a.nHeight > b.nHeight;
+    }
+};
+
+bool GetNotaryTransactions(const uint256& hash, bool fPrefixed, vector<CNotaryIndexEntry>& vEntries)
+{
+    vEntries.clear();
+
+    LOCK(cs_main);
+    if (!fNotaryIndex || !fNotaryIndexReady)
+        return false;
+
+    vector<CNotaryIndexEntry> vAll;
+    CTxDB txdb("r");
+    txdb.ReadNotaryIndex(hash, vAll);
+    BOOST_FOREACH(const CNotaryIndexEntry& entry, vAll)
+        if (entry.fPrefixed == fPrefixed && entry.nHeight > NOTARY_FIRST_HEIGHT)
+            vEntries.push_back(entry);
+
+    // same order as walking the chain back from the tip
+    std::stable_sort(vEntries.begin(), vEntries.end(), CompareNotaryEntryHeight());
+    return true;
+}
+
+
+
+
+
+
+
+
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // CAlert
@@ -3213,14 +4161,55 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 
 
 
+// "block" messages recently sent to peers, made from the blocks as stored on
+// disk, so that peers syncing from us at the same time don't each make us read,
+// serialize and checksum them again. Most recent first.
+typedef list<pair<uint256, CSendBuffer> > RawBlockList;
+static CCriticalSection cs_rawBlockCache;
+static RawBlockList lRawBlockCache;
+static map<uint256, RawBlockList::iterator> mapRawBlockCache;
+static size_t nRawBlockCacheSize = 0;
+static const size_t MAX_RAW_BLOCK_CACHE_SIZE = 8 * MAX_BLOCK_SIZE;
+
+static CSendBuffer GetBlockMessage(const uint256& hash, unsigned int nFile, unsigned int nBlockPos)
+{
+    {
+        LOCK(cs_rawBlockCache);
+        map<uint256, RawBlockList::iterator>::iterator mi = mapRawBlockCache.find(hash);
+        if (mi != mapRawBlockCache.end())
+        {
+            lRawBlockCache.splice(lRawBlockCache.begin(), lRawBlockCache, mi->second);
+            return mi->second->second;
+        }
+    }
+
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    if (!ReadRawBlockFromDisk(ssBlock, nFile, nBlockPos))
+        return CSendBuffer();
+    CSendBuffer pmsgBlock = MakeMessageBuffer("block", ssBlock);
+
+    LOCK(cs_rawBlockCache);
+    if (!mapRawBlockCache.count(hash))
+    {
+        lRawBlockCache.push_front(make_pair(hash, pmsgBlock));
+        mapRawBlockCache[hash] = lRawBlockCache.begin();
+        nRawBlockCacheSize += pmsgBlock->size();
+        while (nRawBlockCacheSize > MAX_RAW_BLOCK_CACHE_SIZE && lRawBlockCache.size() > 1)
+        {
+            nRawBlockCacheSize -= lRawBlockCache.back().second->size();
+            mapRawBlockCache.erase(lRawBlockCache.back().first);
+            lRawBlockCache.pop_back();
+        }
+    }
+    return pmsgBlock;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -3233,15 +4222,29 @@ void static ProcessGetData(CNode* pfrom)
 
             if (inv.type == MSG_BLOCK)
             {
-                // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                // Send block from disk, exactly as it is stored there; cs_main
+                // is only needed to find it
+                bool fFound = false;
+                unsigned int nFile, nBlockPos;
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    LOCK(cs_main);
+                    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        fFound = true;
+                        nFile = mi->second->nFile;
+                        nBlockPos = mi->second->nBlockPos;
+                    }
+                }
+                CSendBuffer pmsgBlock;
+                if (fFound)
+                    pmsgBlock = GetBlockMessage(inv.hash, nFile, nBlockPos);
+                if (pmsgBlock)
+                {
+                    pfrom->PushMessageBuffer(pmsgBlock);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
+                    LOCK(cs_main);
                     if (inv.hash == pfrom->hashContinue)
                     {
                         // Default behavior of PoS coins is to send last PoW block here which client
@@ -3266,9 +4269,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSendBuffer>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushMessageBuffer((*mi).second);
                         pushed = true;
                     }
                 }
@@ -3420,8 +4423,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
              pfrom->nVersion >= NOBLKS_VERSION_END) &&
              (nAskedForBlocks < 1 || vNodes.size() <= 1))
         {
-            nAskedForBlocks++;
-            PushGetBlocks(pfrom, pindexBest, uint256(0));
+            LOCK(cs_main);
+            if (!IsHeadersFirstSync())
+            {
+                nAskedForBlocks++;
+                PushGetBlocks(pfrom, pindexBest, uint256(0));
+            }
         }
 
         // Relay alerts
@@ -3448,8 +4455,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     // to new node if waited longer than MAX_TIME_SINCE_BEST_BLOCK.
     int64 TimeSinceBestBlock = GetTime() - nTimeBestReceived;
     if (TimeSinceBestBlock > MAX_TIME_SINCE_BEST_BLOCK) {
-        //LogPrintf("INFO: Waiting %d sec which is too long. Sending GetBlocks(0)\n", TimeSinceBestBlock);
-        PushGetBlocks(pfrom, pindexBest, uint256(0));
+        LOCK(cs_main);
+        if (!IsHeadersFirstSync() || vSyncHeaders.empty()) {
+            //LogPrintf("INFO: Waiting %d sec which is too long. Sending GetBlocks(0)\n", TimeSinceBestBlock);
+            PushGetBlocks(pfrom, pindexBest, uint256(0));
+        }
     }
 
         // ppcoin: ask for pending sync-checkpoint if any
@@ -3580,7 +4590,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             bool fAlreadyHave = AlreadyHave(txdb, inv);
             LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
 
-            if (!fAlreadyHave) {
+            if (inv.type == MSG_BLOCK && (mapSyncHeaders.count(inv.hash) || mapBlocksInFlight.count(inv.hash))) {
+                // Fetched along the header chain
+            } else if (!fAlreadyHave) {
                 if (!fImporting)
                     pfrom->AskFor(inv);
             } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
@@ -3737,6 +4749,21 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %"PRIszu"", vHeaders.size());
+        }
+
+        LOCK(cs_main);
+        return AcceptSyncHeaders(pfrom, vHeaders);
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -3818,13 +4845,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         LOCK(cs_main);
 
+        MarkBlockReceived(hashBlock);
         if (ProcessBlock(pfrom, &block)) {
             mapAlreadyAskedFor.erase(inv);
         } else {
+            // An invalid block means the header chain leading to it is no good
+            if (block.nDoS && mapSyncHeaders.count(hashBlock))
+                ClearSyncHeaders();
         // Be more aggressive with blockchain download. Send getblocks() message after
         // an error related to new block download
             int64 TimeSinceBestBlock = GetTime() - nTimeBestReceived;
-            if (TimeSinceBestBlock > MAX_TIME_SINCE_BEST_BLOCK) {
+            if (TimeSinceBestBlock > MAX_TIME_SINCE_BEST_BLOCK && (!IsHeadersFirstSync() || vSyncHeaders.empty())) {
                 //LogPrintf("INFO: Waiting %d sec which is too long. Sending GetBlocks(0)\n", TimeSinceBestBlock);
                 PushGetBlocks(pfrom, pindexBest, uint256(0));
             }
@@ -3989,8 +5020,19 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     return true;
 }
 
+// Messages that only touch the sending peer and structures with their own
+// locks, so message workers may handle them next to the main message handler.
+// Everything else stays on the main thread: inv bookkeeping needs cs_main for
+// mapBlockIndex and mapAlreadyAskedFor, and addr and alert relay into other
+// peers' queues, which have no locks of their own.
+static bool IsConcurrentMessage(const string& strCommand)
+{
+    return strCommand == "ping" || strCommand == "pong" ||
+           strCommand == "verack" || strCommand == "getdata";
+}
+
 // requires LOCK(cs_vRecvMsg)
-bool ProcessMessages(CNode* pfrom)
+bool ProcessMessages(CNode* pfrom, bool fConcurrentOnly)
 {
     //if (fDebug)
     //    LogPrintf("ProcessMessages(%zu messages)\n", pfrom->vRecvMsg.size());
@@ -4029,6 +5071,10 @@ bool ProcessMessages(CNode* pfrom)
         if (!msg.complete())
             break;
 
+        // leave the rest to the main message handler, in order
+        if (fConcurrentOnly && !IsConcurrentMessage(msg.hdr.GetCommand()))
+            break;
+
         // at this point, any failure means we can delete the current message
         it++;
 
@@ -4053,7 +5099,7 @@ bool ProcessMessages(CNode* pfrom)
 
         // Checksum
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
+        const uint256& hash = msg.hashData;
         unsigned int nChecksum = 0;
         memcpy(&nChecksum, &hash, sizeof(nChecksum));
         if (nChecksum != hdr.nChecksum)
@@ -4150,9 +5196,16 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Start block sync
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
-            PushGetBlocks(pto, pindexBest, uint256(0));
+            if (IsHeadersFirstSync())
+                PushGetHeaders(pto);
+            else
+                PushGetBlocks(pto, pindexBest, uint256(0));
         }
 
+        // Headers-first sync: more headers, and block bodies from every peer
+        if (IsHeadersFirstSync())
+            SendHeadersFirstRequests(pto);
+
         // Resend wallet transactions that haven't gotten in a block yet
         ResendWalletTransactions();
  
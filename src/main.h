@@ -19,6 +19,8 @@
 
 #include <list>
 
+#include <boost/shared_ptr.hpp>
+
 class CBlock;
 class CBlockIndex;
 class CInv;
@@ -44,6 +46,29 @@ static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
 /** Default for -maxorphanblocks, maximum number of orphan blocks kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 750;
+/** Default for -maxorphanblocksmem, megabytes of orphan blocks kept in memory before spilling to disk */
+static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS_MEMORY = 32;
+/** Maximum number of headers in a 'headers' message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Maximum number of headers kept ahead of the blocks we have during headers-first sync */
+static const int MAX_SYNC_HEADERS = 10 * MAX_HEADERS_RESULTS;
+/** Size of the window of blocks past the first missing one that headers-first sync
+ *  fetches in parallel. Blocks arriving early wait in the orphan pool, so this
+ *  stays below DEFAULT_MAX_ORPHAN_BLOCKS. */
+static const int BLOCK_DOWNLOAD_WINDOW = 500;
+/** Maximum number of proof-of-stake headers, which can't be checked without their
+ *  blocks, taken ahead of our best block during headers-first sync */
+static const int MAX_UNCHECKED_SYNC_HEADERS = BLOCK_DOWNLOAD_WINDOW;
+/** Number of blocks requested from a single peer at the same time */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Seconds after which a block or header request is given up on and made elsewhere */
+static const int BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** Seconds added to a block request's timeout for every other peer we are downloading blocks from */
+static const int BLOCK_DOWNLOAD_TIMEOUT_PER_PEER = 30;
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** -par default (number of script-checking threads, 0 = auto) */
+static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
@@ -66,6 +91,9 @@ static const uint256 hashGenesisBlockTestNet("0x00001924120e93f445dd4adb9d90e002
 static const uint256 hashHighBlock ("0xdb61f591d7fb40afa08476d6492e81a06edddf332d7027968ac130db95c07cb7");
 static const int HIGH_BLOCK_INDEX = 275000;
 
+/** Notary searches only look at blocks above this height */
+static const int NOTARY_FIRST_HEIGHT = 362500;
+
 
 inline bool IsProtocolV2(int nHeight) { return TestNet() || nHeight > 203500; }
 
@@ -101,6 +129,7 @@ extern const std::string strMessageMagic;
 extern int64_t nTimeBestReceived;
 extern bool fImporting;
 extern bool fReindex;
+extern int nScriptCheckThreads;
 struct COrphanBlock;
 extern std::map<uint256, COrphanBlock*> mapOrphanBlocks;
 extern bool fHaveGUI;
@@ -111,13 +140,17 @@ extern unsigned int nDerivationMethodIndex;
 
 extern bool fMinimizeCoinAge;
 extern bool fCreditStakesToAccounts;
+extern bool fNotaryIndex;
+extern bool fHeadersFirst;
 
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 52428800;
 
 class CReserveKey;
+class CScriptCheck;
 class CTxDB;
 class CTxIndex;
+class CNotaryIndexEntry;
 class CWalletInterface;
 
 /** Register a wallet to receive updates from core */
@@ -144,12 +177,26 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
+/** Commit the block file being appended to, which may hold blocks WriteToDisk left uncommitted */
+bool CommitBlockFile();
+/** Read a block's serialized bytes as stored at nFile:nBlockPos, without deserializing it */
+bool ReadRawBlockFromDisk(CDataStream& ssBlock, unsigned int nFile, unsigned int nBlockPos);
 bool LoadBlockIndex(bool fAllowNew=true, bool fReindex=false);
+/** Close and delete the orphan block spill file, giving up any orphans spilled to it */
+void RemoveOrphanSpill();
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
-bool ProcessMessages(CNode* pfrom);
+bool ProcessMessages(CNode* pfrom, bool fConcurrentOnly);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
+/** Count the blocks from nFirst to nLast in the main chain supporting each CLAMour pid */
+void GetSupportCounts(int nFirst, int nLast, std::map<std::string, int>& mapSupport);
+/** Build the -notaryindex database in the background */
+void ThreadNotaryIndex();
+/** Look up notary transactions in the -notaryindex database, newest first; false if the index isn't usable yet */
+bool GetNotaryTransactions(const uint256& hash, bool fPrefixed, std::vector<CNotaryIndexEntry>& vEntries);
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
@@ -166,9 +213,10 @@ const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfSta
 void ThreadStakeMiner(CWallet *pwallet);
 
 
-/** (try to) add transaction to memory pool **/
+/** (try to) add transaction to memory pool; fBypassLimits skips the package
+ *  limits, for transactions returning from a disconnected block **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs);
+                        bool* pfMissingInputs, bool fBypassLimits = false);
 
 
 
@@ -250,7 +298,14 @@ public:
     std::vector<CTxOut> vout;
     unsigned int nLockTime;
     std::string strCLAMSpeech;
+
+    // memory only: GetHash() result, computed when the transaction is read
+    // from the network or disk (fHashCached) and never from const GetHash(),
+    // so shared transactions are not written to. Transactions assembled in
+    // memory are rehashed on every call; code that changes a transaction
+    // which may have been read (or copied from one) calls UncacheHash() first.
     mutable uint256 hash;
+    mutable bool fHashCached;
 
     // Denial-of-service detection:
     mutable int nDoS;
@@ -273,6 +328,11 @@ public:
         {
           READWRITE(strCLAMSpeech);
         }
+        if (fRead)
+        {
+            const_cast<CTransaction*>(this)->hash = SerializeHash(*this);
+            const_cast<CTransaction*>(this)->fHashCached = true;
+        }
     )
 
     void SetNull()
@@ -286,6 +346,7 @@ public:
         nDoS = 0;  // Denial-of-service prevention
         strCLAMSpeech.clear();
         hash = 0;
+        fHashCached = false;
     }
 
     bool IsNull() const
@@ -295,9 +356,18 @@ public:
 
     uint256 GetHash() const
     {
+        if (fHashCached)
+            return hash;
         return SerializeHash(*this);
     }
 
+    // Stop using the hash computed at deserialization, for a copy that is
+    // about to be modified
+    void UncacheHash()
+    {
+        fHashCached = false;
+    }
+
     bool IsCoinBase() const
     {
         return (vin.size() == 1 && vin[0].prevout.IsNull() && vout.size() >= 1);
@@ -310,6 +380,8 @@ public:
     }
 
     bool IsCreateClamour(std::string& strHash, std::string& strURL) const;
+    bool IsNotary(uint256& hash, bool& fPrefixed) const;
+    void GetSupport(std::vector<unsigned int>& vSupport) const;
 
     /** Amount of bitcoins spent by this transaction.
         @return sum of all outputs (note: does not include fees)
@@ -424,11 +496,13 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
+        @param[out] pvChecks	if not NULL, script checks are appended here instead of being run
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS, int nBlockHeight = 0, int64_t nBlockTime = 0);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS, int nBlockHeight = 0, int64_t nBlockTime = 0,
+                       std::vector<CScriptCheck>* pvChecks = NULL);
     bool CheckTransaction() const;
     bool GetCoinAge(CTxDB& txdb, uint64_t& nCoinAge) const;  // ppcoin: get transaction coin age
 
@@ -480,6 +554,48 @@ bool IsFinalLockTime(unsigned int nLockTime, int nBlockHeight = 0, int64_t nBloc
 bool IsFinalTx(const CTransaction &tx, int nBlockHeight = 0, int64_t nBlockTime = 0);
 
 
+/** Closure representing one script verification.
+ *  Note that this stores a pointer to the spending transaction, which must
+ *  outlive the check.
+ */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction* ptxTo;
+    // Shared by the checks of all inputs of ptxTo
+    boost::shared_ptr<const CSignatureHashContext> pSigHash;
+    unsigned int nIn;
+    unsigned int nFlags;
+    int nBlockHeight;
+    int64_t nBlockTime;
+
+public:
+    CScriptCheck() : ptxTo(NULL), nIn(0), nFlags(0), nBlockHeight(0), nBlockTime(0) {}
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nBlockHeightIn, int64_t nBlockTimeIn,
+                 const boost::shared_ptr<const CSignatureHashContext>& pSigHashIn) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), pSigHash(pSigHashIn), nIn(nInIn), nFlags(nFlagsIn), nBlockHeight(nBlockHeightIn), nBlockTime(nBlockTimeIn) {}
+
+    bool operator()() const;
+
+    /** Re-run a failed check and report it the way ConnectInputs does,
+        including the non-mandatory flag retry and DoS scoring */
+    bool ReportFailure() const;
+
+    void swap(CScriptCheck& check)
+    {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        pSigHash.swap(check.pSigHash);
+        std::swap(nIn, check.nIn);
+        std::swap(nFlags, check.nFlags);
+        std::swap(nBlockHeight, check.nBlockHeight);
+        std::swap(nBlockTime, check.nBlockTime);
+    }
+};
+
+
 /** A transaction with a merkle branch linking it to the block chain. */
 class CMerkleTx : public CTransaction
 {
@@ -594,6 +710,45 @@ public:
 
 
 
+/** A transaction whose CLAMspeech notarizes a hash, as stored in the
+ * -notaryindex database under that hash.
+ */
+class CNotaryIndexEntry
+{
+public:
+    uint256 hashTx;
+    int nHeight;
+    bool fPrefixed; // speech was "notary <hash>" rather than the bare hash
+
+    CNotaryIndexEntry()
+    {
+        SetNull();
+    }
+
+    CNotaryIndexEntry(const uint256& hashTxIn, int nHeightIn, bool fPrefixedIn)
+    {
+        hashTx = hashTxIn;
+        nHeight = nHeightIn;
+        fPrefixed = fPrefixedIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashTx);
+        READWRITE(nHeight);
+        READWRITE(fPrefixed);
+    )
+
+    void SetNull()
+    {
+        hashTx = 0;
+        nHeight = -1;
+        fPrefixed = false;
+    }
+};
+
+
+
 
 
 /** Nodes collect new transactions into a block, hash them into a hash tree,
@@ -627,6 +782,14 @@ public:
     // memory only
     mutable std::vector<uint256> vMerkleTree;
 
+    // memory only: GetHash() result, computed when the block or its header is
+    // read from the network or disk (fHashCached) and never from const
+    // GetHash(), so blocks shared between threads are not written to. Blocks
+    // assembled in memory are rehashed on every call; code that changes the
+    // header of a block which may have been read calls UncacheHash() first.
+    mutable uint256 hashCached;
+    mutable bool fHashCached;
+
     // Denial-of-service detection:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
@@ -657,6 +820,11 @@ public:
             const_cast<CBlock*>(this)->vtx.clear();
             const_cast<CBlock*>(this)->vchBlockSig.clear();
         }
+        if (fRead)
+        {
+            const_cast<CBlock*>(this)->hashCached = ComputeHash();
+            const_cast<CBlock*>(this)->fHashCached = true;
+        }
     )
 
     void SetNull()
@@ -670,6 +838,7 @@ public:
         vtx.clear();
         vchBlockSig.clear();
         vMerkleTree.clear();
+        UncacheHash();
         nDoS = 0;
     }
 
@@ -678,16 +847,31 @@ public:
         return (nBits == 0);
     }
 
+    // Stop using the hash computed at deserialization, for a header that is
+    // about to be changed
+    void UncacheHash()
+    {
+        fHashCached = false;
+    }
+
+    uint256 ComputeHash() const
+    {
+        if (nVersion <= 6)
+            return scrypt_blockhash(CVOIDBEGIN(nVersion));
+        return Hash(BEGIN(nVersion), END(nNonce));
+    }
+
     uint256 GetHash() const
     {
-        if (nVersion > 6)
-            return Hash(BEGIN(nVersion), END(nNonce));
-        else
-            return GetPoWHash();
+        if (fHashCached)
+            return hashCached;
+        return ComputeHash();
     }
 
     uint256 GetPoWHash() const
     {
+        if (fHashCached && nVersion <= 6)
+            return hashCached;
         return scrypt_blockhash(CVOIDBEGIN(nVersion));
     }
 
@@ -958,7 +1142,7 @@ public:
     unsigned int nNonce;
 
     mutable bool fSupportChecked; // did we check the speech of the staking transaction for 'clamour' support yet?
-    mutable std::set<std::string> setSupport; // CLAMour pid strings supported by this block
+    mutable std::vector<unsigned int> vSupport; // CLAMour pids supported by this block, sorted, as numbers
 
     CBlockIndex()
     {
@@ -1050,10 +1234,7 @@ public:
 
     uint256 GetBlockTrust() const;
 
-    bool IsInMainChain() const
-    {
-        return (pnext || this == pindexBest);
-    }
+    bool IsInMainChain() const;
 
     bool CheckIndex() const
     {
@@ -1132,7 +1313,7 @@ public:
             nFlags |= BLOCK_STAKE_MODIFIER;
     }
 
-    std::set<std::string> GetSupport() const;
+    const std::vector<unsigned int>& GetSupport() const;
 
     std::string ToString() const
     {
@@ -1248,6 +1429,47 @@ public:
 
 
 
+/** The blocks of the active chain, indexed by height, for constant time
+ * lookup by height and membership test. Kept in step with the pnext links.
+ */
+class CChain
+{
+private:
+    std::vector<CBlockIndex*> vChain;
+
+public:
+    /** Returns the index entry at the given height, or NULL if out of range */
+    CBlockIndex* operator[](int nHeight) const
+    {
+        if (nHeight < 0 || nHeight >= (int)vChain.size())
+            return NULL;
+        return vChain[nHeight];
+    }
+
+    /** Returns the tip, or NULL if the chain is empty */
+    CBlockIndex* Tip() const
+    {
+        return vChain.empty() ? NULL : vChain.back();
+    }
+
+    /** Height of the tip, -1 if the chain is empty */
+    int Height() const
+    {
+        return (int)vChain.size() - 1;
+    }
+
+    bool Contains(const CBlockIndex* pindex) const
+    {
+        return (*this)[pindex->nHeight] == pindex;
+    }
+
+    /** Make pindex the tip, rewriting only the entries above the fork point */
+    void SetTip(CBlockIndex* pindex);
+};
+
+extern CChain chainActive;
+
+
 /** Describes a place in the block chain to another node such that if the
  * other node doesn't have the same branch, it can find a recent common trunk.
  * The further back it is, the further before the fork it may be.
@@ -1267,6 +1489,13 @@ public:
         Set(pindex);
     }
 
+    // Locator of a chain extending pindex, hashTip being its newest block
+    CBlockLocator(const CBlockIndex* pindex, const uint256& hashTip)
+    {
+        Set(pindex);
+        vHave.insert(vHave.begin(), hashTip);
+    }
+
     explicit CBlockLocator(uint256 hashBlock)
     {
         std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
@@ -1390,6 +1619,7 @@ protected:
     virtual void StakeTransaction(const CScript& script, int64_t nStakeReward, bool fConnect) =0;
     virtual void EraseFromWallet(const uint256 &hash) =0;
     virtual void SetBestChain(const CBlockLocator &locator) =0;
+    virtual void UpdatedBlockTip(const CBlockIndex *pindex) =0;
     virtual void UpdatedTransaction(const uint256 &hash) =0;
     virtual void Inventory(const uint256 &hash) =0;
     virtual void ResendWalletTransactions(bool fForce) =0;
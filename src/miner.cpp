@@ -73,6 +73,36 @@ public:
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
+CBlockTemplateTiming lastBlockTemplateTiming;
+
+// Undo log for the outputs ConnectInputs marks as spent in the block's test
+// pool, so a rejected transaction can be rolled back without copying the pool
+class CTestPoolUndo
+{
+    vector<pair<uint256, CTxIndex> > vSaved;
+    vector<uint256> vAdded;
+
+public:
+    CTestPoolUndo(const map<uint256, CTxIndex>& mapTestPool, const CTransaction& tx)
+    {
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            map<uint256, CTxIndex>::const_iterator mi = mapTestPool.find(txin.prevout.hash);
+            if (mi == mapTestPool.end())
+                vAdded.push_back(txin.prevout.hash);
+            else
+                vSaved.push_back(*mi);
+        }
+    }
+
+    void Undo(map<uint256, CTxIndex>& mapTestPool) const
+    {
+        BOOST_FOREACH(const uint256& hash, vAdded)
+            mapTestPool.erase(hash);
+        for (vector<pair<uint256, CTxIndex> >::const_iterator it = vSaved.begin(); it != vSaved.end(); ++it)
+            mapTestPool[it->first] = it->second;
+    }
+};
  
 // We want to sort transactions by priority and fee, so:
 typedef boost::tuple<double, double, CTransaction*> TxPriority;
@@ -169,6 +199,7 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
     {
         LOCK2(cs_main, mempool.cs);
         CTxDB txdb("r");
+        int64_t nTimeStart = GetTimeMicros();
 
         // Priority order to process transactions
         list<COrphan> vOrphan; // list memory doesn't move
@@ -177,15 +208,14 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
         // This vector will be sorted into a priority queue:
         vector<TxPriority> vecPriority;
         vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        for (CTxMemPool::score_iterator mi = mempool.score_begin(); mi != mempool.score_end(); ++mi)
         {
-            CTransaction& tx = (*mi).second;
+            CTransaction& tx = mempool.mapTx[mi->second];
             if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
                 continue;
 
             COrphan* porphan = NULL;
             double dPriority = 0;
-            int64_t nTotalIn = 0;
             bool fMissingInputs = false;
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
             {
@@ -216,11 +246,9 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
                     }
                     mapDependers[txin.prevout.hash].push_back(porphan);
                     porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
                     continue;
                 }
                 int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
 
                 int nConf = txindex.GetDepthInMainChain();
                 dPriority += (double)nValueIn * nConf;
@@ -233,8 +261,10 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
 
             // This is a more accurate fee-per-kilobyte than is used by the client code, because the
             // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
+            // incentive to create smaller transactions. The pool keeps it up to date for us, as
+            // the better of the transaction's own rate and that of it with everything spending it,
+            // so a parent is picked early for a child paying well.
+            double dFeePerKb = mi->first;
 
             if (porphan)
             {
@@ -242,9 +272,11 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
                 porphan->dFeePerKb = dFeePerKb;
             }
             else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
+                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &tx));
         }
 
+        int64_t nTimePrioritized = GetTimeMicros();
+
         // Collect transactions into block
         map<uint256, CTxIndex> mapTestPool;
         uint64_t nBlockSize = 1000;
@@ -298,10 +330,9 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
 
             // Connecting shouldn't fail due to dependency on other memory pool transactions
             // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
             MapPrevTx mapInputs;
             bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
+            if (!tx.FetchInputs(txdb, mapTestPool, false, true, mapInputs, fInvalid))
                 continue;
 
             int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
@@ -315,10 +346,13 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
             // Note that flags: we don't want to set mempool/IsStandard()
             // policy here, but we still have to ensure that the block we
             // create only contains transactions that are valid in new blocks.
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
+            CTestPoolUndo undo(mapTestPool, tx);
+            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPool, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
+            {
+                undo.Undo(mapTestPool);
                 continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
+            }
+            mapTestPool[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
 
             // Added
             pblock->vtx.push_back(tx);
@@ -355,6 +389,12 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
 
+        int64_t nTimeAssembled = GetTimeMicros();
+        lastBlockTemplateTiming.nPrioritize = nTimePrioritized - nTimeStart;
+        lastBlockTemplateTiming.nAssemble = nTimeAssembled - nTimePrioritized;
+        lastBlockTemplateTiming.nTotal = nTimeAssembled - nTimeStart;
+        lastBlockTemplateTiming.nCandidates = mempool.mapTx.size();
+
         if (fDebug && GetBoolArg("-printpriority", false))
             LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
 
@@ -389,6 +429,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     ++nExtraNonce;
 
     unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
+    pblock->vtx[0].UncacheHash();
     pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
 
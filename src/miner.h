@@ -9,6 +9,18 @@
 #include "main.h"
 #include "wallet.h"
 
+/** Where the time of the last CreateNewBlock call went, in microseconds */
+struct CBlockTemplateTiming
+{
+    int64_t nPrioritize;        // reading inputs and ordering the memory pool
+    int64_t nAssemble;          // checking and adding transactions to the block
+    int64_t nTotal;
+    unsigned int nCandidates;   // memory pool transactions considered
+
+    CBlockTemplateTiming() : nPrioritize(0), nAssemble(0), nTotal(0), nCandidates(0) {}
+};
+extern CBlockTemplateTiming lastBlockTemplateTiming;
+
 /* Generate a new block, without valid proof-of-work */
 CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake=false, int64_t* pFees = 0);
 
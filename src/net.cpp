@@ -16,6 +16,13 @@
 
 #ifdef WIN32
 #include <string.h>
+#else
+#include <sys/uio.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define USE_EPOLL
 #endif
 
 #ifdef USE_UPNP
@@ -61,7 +68,9 @@ CAddrMan addrman;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+int nLastNodeId = 0;
+CCriticalSection cs_nLastNodeId;
+map<CInv, CSendBuffer> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64_t> mapAlreadyAskedFor;
@@ -77,6 +86,41 @@ CCriticalSection cs_vAddedNodes;
 
 static CSemaphore *semOutbound = NULL;
 
+// Socket readiness backend, see ThreadSocketHandler
+static bool fSocketEventsEpoll = false;
+#ifdef USE_EPOLL
+static int hEpoll = -1;
+#endif
+
+// Lets the socket thread wake the message handler and workers as soon as a
+// message is complete. Each thread sleeps only if no wakeup happened since it
+// last looked at its peers.
+static boost::condition_variable condMsgProc;
+static boost::mutex mutexMsgProc;
+static uint64_t nMsgProcWakeups = 0;
+
+static void WakeMessageHandler()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+        nMsgProcWakeups++;
+    }
+    condMsgProc.notify_all();
+}
+
+static uint64_t GetMessageHandlerWakeups()
+{
+    boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+    return nMsgProcWakeups;
+}
+
+static void WaitMessageHandlerWakeup(uint64_t nWakeupsSeen)
+{
+    boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+    if (nMsgProcWakeups == nWakeupsSeen)
+        condMsgProc.timed_wait(lock, boost::posix_time::milliseconds(100));
+}
+
 // Signals for message handling
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
@@ -535,6 +579,7 @@ void CNode::copyStats(CNodeStats &stats)
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
+    bool fComplete = false;
     while (nBytes > 0) {
 
         // get current incomplete message, or create a new one
@@ -557,13 +602,111 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         pch += handled;
         nBytes -= handled;
 
-        if (msg.complete())
+        if (msg.complete()) {
             msg.nTime = GetTimeMicros();
+            fComplete = true;
+        }
     }
 
+    if (fComplete)
+        WakeMessageHandler();
+
     return true;
 }
 
+// requires LOCK(cs_vRecvMsg)
+char* CNode::GetRecvDataBuffer(unsigned int nMinBytes, unsigned int& nBytes)
+{
+    if (vRecvMsg.empty() || !vRecvMsg.back().in_data || vRecvMsg.back().complete())
+        return NULL;
+    CNetMessage& msg = vRecvMsg.back();
+    if (msg.hdr.nMessageSize - msg.nDataPos < nMinBytes)
+        return NULL;
+    return msg.GetDataBuffer(nBytes);
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::RecvDataWritten(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.DataWritten(nBytes);
+    if (msg.complete()) {
+        msg.nTime = GetTimeMicros();
+        WakeMessageHandler();
+    }
+}
+
+// Payload buffers of received messages are recycled rather than freed: this
+// saves an allocation per message and zero_after_free_allocator's memset of the
+// whole buffer. Only a few buffers of up to a block's size are kept.
+static const unsigned int MAX_RECV_BUFFER_POOL = 16;
+static CCriticalSection cs_vRecvBufferPool;
+static vector<CSerializeData> vRecvBufferPool;
+
+static void AcquireRecvBuffer(CDataStream& stream)
+{
+    LOCK(cs_vRecvBufferPool);
+    if (!vRecvBufferPool.empty())
+    {
+        stream.swap(vRecvBufferPool.back());
+        vRecvBufferPool.pop_back();
+    }
+}
+
+static void ReleaseRecvBuffer(CDataStream& stream)
+{
+    CSerializeData vch;
+    stream.swap(vch);
+    if (vch.capacity() == 0 || vch.capacity() > MAX_BLOCK_SIZE)
+        return;
+    vch.clear();
+
+    LOCK(cs_vRecvBufferPool);
+    if (vRecvBufferPool.size() < MAX_RECV_BUFFER_POOL)
+    {
+        vRecvBufferPool.push_back(CSerializeData());
+        vRecvBufferPool.back().swap(vch);
+    }
+}
+
+CNetMessage::~CNetMessage()
+{
+    ReleaseRecvBuffer(vRecv);
+}
+
+// Deserializes from a fixed buffer in place, for headers that must not cost an allocation
+class CHeaderReader
+{
+private:
+    const char* pch;
+    const char* pend;
+    int nType;
+    int nVersion;
+
+public:
+    CHeaderReader(const char* pbegin, const char* pendIn, int nTypeIn, int nVersionIn) :
+        pch(pbegin), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    CHeaderReader& read(char* pchOut, size_t nSize)
+    {
+        if (nSize > (size_t)(pend - pch))
+            throw std::ios_base::failure("CHeaderReader::read() : end of data");
+        memcpy(pchOut, pch, nSize);
+        pch += nSize;
+        return *this;
+    }
+
+    int GetType() const { return nType; }
+    int GetVersion() const { return nVersion; }
+
+    template<typename T>
+    CHeaderReader& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj, nType, nVersion);
+        return *this;
+    }
+};
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -579,7 +722,7 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 
     // deserialize to CMessageHeader
     try {
-        hdrbuf >> hdr;
+        CHeaderReader(hdrbuf, hdrbuf + sizeof(hdrbuf), vRecv.GetType(), vRecv.GetVersion()) >> hdr;
     }
     catch (std::exception &e) {
         return -1;
@@ -591,22 +734,42 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 
     // switch state to reading message data
     in_data = true;
+    if (hdr.nMessageSize > 0)
+        AcquireRecvBuffer(vRecv);
+    else
+        hashData = hasher.GetHash();
 
     return nCopy;
 }
 
-int CNetMessage::readData(const char *pch, unsigned int nBytes)
+char* CNetMessage::GetDataBuffer(unsigned int& nBytes)
 {
-    unsigned int nRemaining = hdr.nMessageSize - nDataPos;
-    unsigned int nCopy = std::min(nRemaining, nBytes);
+    nBytes = std::min(nBytes, hdr.nMessageSize - nDataPos);
 
-    if (vRecv.size() < nDataPos + nCopy) {
+    if (vRecv.size() < nDataPos + nBytes) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nBytes + 256 * 1024));
     }
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
-    nDataPos += nCopy;
+    return &vRecv[nDataPos];
+}
+
+void CNetMessage::DataWritten(unsigned int nBytes)
+{
+    hasher.write(&vRecv[nDataPos], nBytes);
+    nDataPos += nBytes;
+
+    if (complete())
+        hashData = hasher.GetHash();
+}
+
+int CNetMessage::readData(const char *pch, unsigned int nBytes)
+{
+    unsigned int nCopy = nBytes;
+    char* pchDest = GetDataBuffer(nCopy);
+
+    memcpy(pchDest, pch, nCopy);
+    DataWritten(nCopy);
 
     return nCopy;
 }
@@ -619,26 +782,78 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+// Frame a payload as a complete message, ready to be queued on any number of nodes
+CSendBuffer MakeMessageBuffer(const char* pszCommand, const CDataStream& ssPayload)
+{
+    CMessageHeader hdr(pszCommand, ssPayload.size());
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(CMessageHeader::HEADER_SIZE + ssPayload.size());
+    ss << hdr;
+    ss << ssPayload;
+
+    boost::shared_ptr<CSerializeData> pdata(new CSerializeData());
+    ss.GetAndClear(*pdata);
+    return pdata;
+}
+
+// Most queued messages handed to the kernel in one sendmsg() call
+static const int MAX_SEND_IOV = 64;
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
-
-    while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+    while (!pnode->vSendMsg.empty()) {
+        // Gather the queued messages, starting where the last send stopped
+        size_t nOffset = pnode->nSendOffset;
+        size_t nTotal = 0;
+#ifdef WIN32
+        const CSerializeData &data = *pnode->vSendMsg.front();
+        assert(data.size() > nOffset);
+        nTotal = data.size() - nOffset;
+        int nBytes = send(pnode->hSocket, &data[nOffset], nTotal, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        struct iovec iov[MAX_SEND_IOV];
+        int nIov = 0;
+        for (std::deque<CSendBuffer>::iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nIov < MAX_SEND_IOV; it++) {
+            const CSerializeData &data = **it;
+            assert(data.size() > nOffset);
+            iov[nIov].iov_base = (void*)&data[nOffset];
+            iov[nIov].iov_len = data.size() - nOffset;
+            nTotal += iov[nIov].iov_len;
+            nIov++;
+            nOffset = 0;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+
+            // Drop the messages that went out completely
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                const CSerializeData &data = *pnode->vSendMsg.front();
+                size_t nRemaining = data.size() - pnode->nSendOffset;
+                if (nSent < nRemaining) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nRemaining;
                 pnode->nSendOffset = 0;
                 pnode->nSendSize -= data.size();
-                it++;
-            } else {
-                // could not send full message; stop sending more
+                pnode->vSendMsg.pop_front();
+            }
+
+            if ((size_t)nBytes < nTotal) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -656,19 +871,182 @@ void SocketSendData(CNode *pnode)
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->vSendMsg.empty()) {
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
 static list<CNode*> vNodesDisconnected;
 
+#ifdef USE_EPOLL
+// Nodes registered with the epoll set, keyed by socket. Listen sockets map to NULL.
+// Only touched by ThreadSocketHandler, entries are removed before a node is deleted.
+static map<SOCKET, CNode*> mapSocketEvents;
+
+static bool SocketEventsEpollInit()
+{
+    hEpoll = epoll_create(1024);
+    if (hEpoll == -1)
+    {
+        LogPrintf("epoll_create failed: %s\n", strerror(errno));
+        return false;
+    }
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+    {
+        // Listen sockets stay level-triggered, we accept one connection per pass
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = hListenSocket;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) == -1)
+        {
+            LogPrintf("epoll_ctl failed for listen socket: %s\n", strerror(errno));
+            close(hEpoll);
+            hEpoll = -1;
+            return false;
+        }
+        mapSocketEvents[hListenSocket] = NULL;
+    }
+    return true;
+}
+
+static void SocketEventsEpollAdd(CNode* pnode)
+{
+    SOCKET hSocket = pnode->hSocket;
+    if (hSocket == INVALID_SOCKET)
+        return;
+
+    // Edge-triggered: readiness is remembered in fRecvReady/fSendReady until
+    // a read or write on the socket would block.
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.fd = hSocket;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &event) == -1 &&
+        (errno != EEXIST || epoll_ctl(hEpoll, EPOLL_CTL_MOD, hSocket, &event) == -1))
+    {
+        LogPrintf("epoll_ctl failed for %s: %s\n", pnode->addrName, strerror(errno));
+        pnode->CloseSocketDisconnect();
+        return;
+    }
+    pnode->hSocketEvents = hSocket;
+    mapSocketEvents[hSocket] = pnode;
+}
+
+static void SocketEventsEpollRemove(CNode* pnode)
+{
+    if (pnode->hSocketEvents == INVALID_SOCKET)
+        return;
+    // The socket itself left the epoll set when it was closed, and its number
+    // may already belong to a newer node.
+    map<SOCKET, CNode*>::iterator mi = mapSocketEvents.find(pnode->hSocketEvents);
+    if (mi != mapSocketEvents.end() && mi->second == pnode)
+        mapSocketEvents.erase(mi);
+    pnode->hSocketEvents = INVALID_SOCKET;
+}
+
+static void SocketEventsEpollWait(int nTimeout, bool& fListenReady)
+{
+    struct epoll_event events[256];
+    int nEvents = epoll_wait(hEpoll, events, 256, nTimeout);
+    if (nEvents == -1)
+    {
+        if (errno != EINTR)
+        {
+            LogPrintf("socket epoll_wait error %s\n", strerror(errno));
+            MilliSleep(nTimeout);
+        }
+        return;
+    }
+
+    for (int i = 0; i < nEvents; i++)
+    {
+        map<SOCKET, CNode*>::iterator mi = mapSocketEvents.find(events[i].data.fd);
+        if (mi == mapSocketEvents.end())
+            continue;
+        CNode* pnode = mi->second;
+        if (pnode == NULL)
+        {
+            fListenReady = true;
+            continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            pnode->fRecvReady = true;
+        if (events[i].events & EPOLLOUT)
+            pnode->fSendReady = true;
+    }
+}
+#endif
+
+// Read once from pnode's socket, the caller holds cs_vRecvMsg. Returns false
+// once the socket has nothing more to give (would block, closed or failed).
+static bool SocketRecvData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    unsigned int nMax = sizeof(pchBuf);
+
+    // The bulk of larger messages is received straight into their buffer,
+    // anything else is copied out of pchBuf
+    char* pchData = pnode->GetRecvDataBuffer(0x1000, nMax);
+    int nBytes = recv(pnode->hSocket, pchData ? pchData : pchBuf, nMax, MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (pchData)
+            pnode->RecvDataWritten(nBytes);
+        else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return pnode->hSocket != INVALID_SOCKET;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %d\n", nErr);
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+// Whether there is room to queue more received data, the caller holds cs_vRecvMsg.
+// If not, there is certainly one message ready for the message handler.
+static bool CanReceiveMore(CNode* pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+           pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
 
+#ifdef USE_EPOLL
+    if (GetArg("-socketevents", "epoll") == "epoll")
+    {
+        if (SocketEventsEpollInit())
+            fSocketEventsEpoll = true;
+        else
+            LogPrintf("epoll unavailable, falling back to select()\n");
+    }
+#endif
+    LogPrintf("Using %s for socket events\n", fSocketEventsEpoll ? "epoll" : "select");
+
+    // Whether some node still had readiness left over after the last pass
+    bool fPendingEvents = false;
+
     while (true)
     {
         //
@@ -691,6 +1069,10 @@ void ThreadSocketHandler()
 
                     // close socket and cleanup
                     pnode->CloseSocketDisconnect();
+#ifdef USE_EPOLL
+                    if (fSocketEventsEpoll)
+                        SocketEventsEpollRemove(pnode);
+#endif
 
                     // hold in disconnected pool until all refs are released
                     if (pnode->fNetworkNode || pnode->fInbound)
@@ -738,82 +1120,106 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
+        bool fListenReady = false;
         fd_set fdsetRecv;
         fd_set fdsetSend;
         fd_set fdsetError;
         FD_ZERO(&fdsetRecv);
         FD_ZERO(&fdsetSend);
         FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
 
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
+#ifdef USE_EPOLL
+        if (fSocketEventsEpoll)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
             {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                    if (pnode->hSocketEvents == INVALID_SOCKET && !pnode->fDisconnect)
+                        SocketEventsEpollAdd(pnode);
+            }
+
+            // Only readiness the kernel has not reported yet is waited for, so an
+            // idle node costs nothing here. Sends queued by the message handler
+            // are written optimistically and only need us once the socket fills up.
+            SocketEventsEpollWait(fPendingEvents ? 50 : 500, fListenReady);
+            boost::this_thread::interruption_point();
+        }
+        else
+#endif
+        {
+            struct timeval timeout;
+            timeout.tv_sec  = 0;
+            timeout.tv_usec = 50000; // frequency to poll pnode->vSend
 
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
+            SOCKET hSocketMax = 0;
+            bool have_fds = false;
+
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+                FD_SET(hListenSocket, &fdsetRecv);
+                hSocketMax = max(hSocketMax, hListenSocket);
+                have_fds = true;
+            }
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
+                    if (pnode->hSocket == INVALID_SOCKET)
                         continue;
+                    FD_SET(pnode->hSocket, &fdsetError);
+                    hSocketMax = max(hSocketMax, pnode->hSocket);
+                    have_fds = true;
+
+                    // Implement the following logic:
+                    // * If there is data to send, select() for sending data. As this only
+                    //   happens when optimistic write failed, we choose to first drain the
+                    //   write buffer in this case before receiving more. This avoids
+                    //   needlessly queueing received data, if the remote peer is not themselves
+                    //   receiving data. This means properly utilizing TCP flow control signalling.
+                    // * Otherwise, if there is no (complete) message in the receive buffer,
+                    //   or there is space left in the buffer, select() for receiving data.
+                    // * (if neither of the above applies, there is certainly one message
+                    //   in the receiver buffer ready to be processed).
+                    // Together, that means that at least one of the following is always possible,
+                    // so we don't deadlock:
+                    // * We send some data.
+                    // * We wait for data to be received (and disconnect after timeout).
+                    // * We process a message in the buffer (message handler thread).
+                    {
+                        TRY_LOCK(pnode->cs_vSend, lockSend);
+                        if (lockSend && !pnode->vSendMsg.empty()) {
+                            FD_SET(pnode->hSocket, &fdsetSend);
+                            continue;
+                        }
+                    }
+                    {
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv && CanReceiveMore(pnode))
+                            FD_SET(pnode->hSocket, &fdsetRecv);
                     }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
-        }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
+            int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                                 &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+            boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
+            if (nSelect == SOCKET_ERROR)
             {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                if (have_fds)
+                {
+                    int nErr = WSAGetLastError();
+                    LogPrintf("socket select error %d\n", nErr);
+                    for (unsigned int i = 0; i <= hSocketMax; i++)
+                        FD_SET(i, &fdsetRecv);
+                }
+                FD_ZERO(&fdsetSend);
+                FD_ZERO(&fdsetError);
+                MilliSleep(timeout.tv_usec/1000);
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+                if (FD_ISSET(hListenSocket, &fdsetRecv))
+                    fListenReady = true;
         }
 
 
@@ -821,7 +1227,7 @@ void ThreadSocketHandler()
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        if (fListenReady && hListenSocket != INVALID_SOCKET && (fSocketEventsEpoll || FD_ISSET(hListenSocket, &fdsetRecv)))
         {
             struct sockaddr_storage sockaddr;
             socklen_t len = sizeof(sockaddr);
@@ -850,6 +1256,13 @@ void ThreadSocketHandler()
             {
                 closesocket(hSocket);
             }
+#ifndef WIN32
+            else if (!fSocketEventsEpoll && hSocket >= (SOCKET)FD_SETSIZE)
+            {
+                LogPrintf("connection from %s dropped (socket %d beyond FD_SETSIZE, use -socketevents=epoll)\n", addr.ToString(), hSocket);
+                closesocket(hSocket);
+            }
+#endif
             else if (CNode::IsBanned(addr))
             {
                 LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
@@ -878,51 +1291,44 @@ void ThreadSocketHandler()
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->AddRef();
         }
+        fPendingEvents = false;
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             boost::this_thread::interruption_point();
 
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            if (!fSocketEventsEpoll)
+            {
+                // select() is level-triggered, readiness only lasts for this pass
+                pnode->fRecvReady = FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError);
+                pnode->fSendReady = FD_ISSET(pnode->hSocket, &fdsetSend);
+            }
+
             //
             // Receive
             //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (pnode->fRecvReady)
             {
+                // Same rules as for select() above: drain the send queue first and
+                // leave complete messages to the message handler when flooded.
+                bool fSendQueued = false;
+                if (fSocketEventsEpoll)
+                {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    fSendQueued = !lockSend || !pnode->vSendMsg.empty();
+                }
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                if (lockRecv && !fSendQueued)
                 {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
+                    // With edge-triggered events we have to read until the socket
+                    // would block, but a busy peer must not starve the others.
+                    int nReads = fSocketEventsEpoll ? 4 : 1;
+                    bool fMore = true;
+                    while (fMore && nReads-- > 0 && CanReceiveMore(pnode))
+                        fMore = SocketRecvData(pnode);
+                    if (!fMore)
+                        pnode->fRecvReady = false;
                 }
             }
 
@@ -931,13 +1337,19 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (pnode->fSendReady)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
+                if (lockSend && !pnode->vSendMsg.empty())
+                {
                     SocketSendData(pnode);
+                    // Whatever is left did not fit, wait for the next EPOLLOUT edge
+                    if (!pnode->vSendMsg.empty())
+                        pnode->fSendReady = false;
+                }
             }
-
+            if (pnode->fRecvReady || (pnode->fSendReady && pnode->nSendSize > 0))
+                fPendingEvents = true;
             //
             // Inactivity checking
             //
@@ -1415,6 +1827,7 @@ void ThreadMessageHandler()
     while (true)
     {
         bool fHaveSyncNode = false;
+        uint64_t nWakeupsSeen = GetMessageHandlerWakeups();
 
         vector<CNode*> vNodesCopy;
         {
@@ -1445,9 +1858,15 @@ void ThreadMessageHandler()
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                if (!lockRecv)
+                {
+                    // A message worker has the node; come back to it rather
+                    // than sleep on whatever it leaves behind
+                    fSleep = false;
+                }
+                else
                 {
-                    if (!g_signals.ProcessMessages(pnode))
+                    if (!g_signals.ProcessMessages(pnode, false))
                         pnode->CloseSocketDisconnect();
 
                     if (pnode->nSendSize < SendBufferSize())
@@ -1457,15 +1876,73 @@ void ThreadMessageHandler()
                             fSleep = false;
                         }
                     }
+                    boost::this_thread::interruption_point();
+
+                    // Send messages, still holding cs_vRecvMsg so no message
+                    // worker touches this node's relay state meanwhile
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
+                        g_signals.SendMessages(pnode, pnode == pnodeTrickle);
                 }
             }
             boost::this_thread::interruption_point();
+        }
+
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
+
+        if (fSleep)
+            WaitMessageHandlerWakeup(nWakeupsSeen);
+    }
+}
+
+// Handles the messages ProcessMessages accepts concurrently (pings, getdata
+// served from relay memory or disk, ...) whenever one is next in a peer's
+// queue, so they are not stuck behind validation work holding cs_main in
+// ThreadMessageHandler. cs_vRecvMsg keeps each peer on one thread at a time
+// and its messages in order.
+void ThreadMessageWorker()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        uint64_t nWakeupsSeen = GetMessageHandlerWakeups();
+
+        vector<CNode*> vNodesCopy;
+        {
+            LOCK(cs_vNodes);
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
+        }
+
+        bool fSleep = true;
+
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            if (pnode->fDisconnect)
+                continue;
 
-            // Send messages
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv)
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle);
+                size_t nRecvMsg = pnode->vRecvMsg.size();
+                size_t nRecvGetData = pnode->vRecvGetData.size();
+                if (!g_signals.ProcessMessages(pnode, true))
+                    pnode->CloseSocketDisconnect();
+
+                // Keep going while we make progress, and wake the main handler
+                // for whatever we had to leave, as it may have found the node
+                // locked and gone to sleep
+                if (pnode->vRecvMsg.size() != nRecvMsg || pnode->vRecvGetData.size() != nRecvGetData)
+                {
+                    fSleep = false;
+                    if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())
+                        WakeMessageHandler();
+                }
             }
             boost::this_thread::interruption_point();
         }
@@ -1477,7 +1954,7 @@ void ThreadMessageHandler()
         }
 
         if (fSleep)
-            MilliSleep(100);
+            WaitMessageHandlerWakeup(nWakeupsSeen);
     }
 }
 
@@ -1682,6 +2159,11 @@ void StartNode(boost::thread_group& threadGroup)
     // Process messages
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
+    // Process peer-local messages in parallel
+    int nMessageWorkers = GetArg("-msgthreads", DEFAULT_MESSAGE_WORKERS);
+    for (int i = 0; i < nMessageWorkers; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgwork", &ThreadMessageWorker));
+
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
 }
@@ -1715,6 +2197,14 @@ public:
                 if (closesocket(hListenSocket) == SOCKET_ERROR)
                     LogPrintf("closesocket(hListenSocket) failed with error %d\n", WSAGetLastError());
 
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
+        {
+            close(hEpoll);
+            hEpoll = -1;
+        }
+#endif
+
 #ifdef WIN32
         // Shutdown Windows Sockets
         WSACleanup();
@@ -1743,8 +2233,10 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved,
+        // ready to be sent to every peer asking for it
+        if (!mapRelay.count(inv))
+            mapRelay.insert(std::make_pair(inv, MakeMessageBuffer("tx", ss)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
 
@@ -8,6 +8,7 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 
@@ -30,6 +31,8 @@ extern int nBestHeight;
 static const int PING_INTERVAL = 2 * 60;
 /** Time after which to disconnect, after waiting for a ping response (or inactivity). */
 static const int TIMEOUT_INTERVAL = 20 * 60;
+/** Default number of threads handling peer-local messages next to ThreadMessageHandler. */
+static const int DEFAULT_MESSAGE_WORKERS = 2;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
@@ -48,10 +51,16 @@ void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
 
+/** A complete message as sent on the wire. Never modified once queued, so the
+ *  same buffer can be sent to any number of peers. */
+typedef boost::shared_ptr<const CSerializeData> CSendBuffer;
+/** Serialize and checksum a message once, for PushMessageBuffer() */
+CSendBuffer MakeMessageBuffer(const char* pszCommand, const CDataStream& ssPayload);
+
 // Signals for message handling
 struct CNodeSignals
 {
-    boost::signals2::signal<bool (CNode*)> ProcessMessages;
+    boost::signals2::signal<bool (CNode*, bool)> ProcessMessages;
     boost::signals2::signal<bool (CNode*, bool)> SendMessages;
 };
 
@@ -97,7 +106,9 @@ extern CAddrMan addrman;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern int nLastNodeId;
+extern CCriticalSection cs_nLastNodeId;
+extern std::map<CInv, CSendBuffer> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern std::map<CInv, int64_t> mapAlreadyAskedFor;
@@ -137,23 +148,26 @@ class CNetMessage {
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
-    CDataStream hdrbuf;             // partially received header
+    char hdrbuf[24];                // partially received header
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
-    CDataStream vRecv;              // received message data
+    CDataStream vRecv;              // received message data, in a buffer from the receive pool
     unsigned int nDataPos;
+    CHashWriter hasher;             // checksum of the data so far
+    uint256 hashData;               // checksum hash, once complete
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
-        hdrbuf.resize(24);
+    CNetMessage(int nTypeIn, int nVersionIn) : vRecv(nTypeIn, nVersionIn), hasher(nTypeIn, nVersionIn) {
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
     }
 
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -163,14 +177,18 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
-};
 
+    // Room for up to nBytes more data, so it can be received in place.
+    // nBytes is lowered to what the message still expects.
+    char* GetDataBuffer(unsigned int& nBytes);
+    // Account for nBytes written to the GetDataBuffer() area
+    void DataWritten(unsigned int nBytes);
+};
 
 
 
@@ -182,11 +200,14 @@ public:
     // socket
     uint64_t nServices;
     SOCKET hSocket;
+    SOCKET hSocketEvents; // socket registered with epoll, if any
+    bool fRecvReady; // socket readiness not yet consumed by ThreadSocketHandler
+    bool fSendReady;
     CDataStream ssSend;
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSendBuffer> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -216,6 +237,7 @@ public:
     CSemaphoreGrant grantOutbound;
     CCriticalSection cs_filter;
     int nRefCount;
+    int id; // unique for the lifetime of the process, unlike the CNode*
 protected:
 
     // Denial-of-service detection/prevention
@@ -258,6 +280,9 @@ public:
     {
         nServices = 0;
         hSocket = hSocketIn;
+        hSocketEvents = INVALID_SOCKET;
+        fRecvReady = false;
+        fSendReady = false;
         nRecvVersion = INIT_PROTO_VERSION;
         nLastSend = 0;
         nLastRecv = 0;
@@ -295,6 +320,11 @@ public:
         nPingUsecTime = 0;
         fPingQueued = false;
 
+        {
+            LOCK(cs_nLastNodeId);
+            id = nLastNodeId++;
+        }
+
         // Be shy and don't send version until we hear
         if (hSocket != INVALID_SOCKET && !fInbound)
             PushVersion();
@@ -340,6 +370,12 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // requires LOCK(cs_vRecvMsg)
+    // Message data recv()'d straight into the buffer of the current message,
+    // returns NULL if it is not expecting at least nMinBytes more.
+    char* GetRecvDataBuffer(unsigned int nMinBytes, unsigned int& nBytes);
+    void RecvDataWritten(unsigned int nBytes);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -459,15 +495,30 @@ public:
 
         LogPrint("net", "(%d bytes)\n", nSize);
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        boost::shared_ptr<CSerializeData> pdata(new CSerializeData());
+        ssSend.GetAndClear(*pdata);
+        QueueSendBuffer(pdata);
+
+        LEAVE_CRITICAL_SECTION(cs_vSend);
+    }
+
+    // requires LOCK(cs_vSend)
+    void QueueSendBuffer(const CSendBuffer& pbuffer)
+    {
+        vSendMsg.push_back(pbuffer);
+        nSendSize += pbuffer->size();
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1)
             SocketSendData(this);
+    }
 
-        LEAVE_CRITICAL_SECTION(cs_vSend);
+    // Send a message made by MakeMessageBuffer(), without copying it
+    void PushMessageBuffer(const CSendBuffer& pbuffer)
+    {
+        LOCK(cs_vSend);
+        LogPrint("net", "sending: shared message (%d bytes)\n", pbuffer->size());
+        QueueSendBuffer(pbuffer);
     }
 
     void PushVersion();
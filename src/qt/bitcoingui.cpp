@@ -1147,15 +1147,7 @@ void BitcoinGUI::updateWeight()
     if (!pwalletMain)
         return;
 
-    TRY_LOCK(cs_main, lockMain);
-    if (!lockMain)
-        return;
-
-    TRY_LOCK(pwalletMain->cs_wallet, lockWallet);
-    if (!lockWallet)
-        return;
-
-  pwalletMain->GetStakeWeight(nWeight);
+    pwalletMain->GetStakeWeight(nWeight);
 }
 
 //void BitcoinGUI::detectNewVersion()
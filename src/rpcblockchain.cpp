@@ -256,13 +256,61 @@ UniValue getdifficulty(const UniValue& params, bool fHelp)
     return obj;
 }
 
+UniValue getsigcacheinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns an object containing signature cache statistics.");
+
+    CSignatureCacheStats stats;
+    GetSignatureCacheStats(stats);
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("bytes",         (int64_t)stats.nBytes));
+    obj.push_back(Pair("capacity",      (int64_t)stats.nCapacity));
+    obj.push_back(Pair("entries",       (int64_t)stats.nEntries));
+    obj.push_back(Pair("hits",          (int64_t)stats.nHits));
+    obj.push_back(Pair("misses",        (int64_t)stats.nMisses));
+    obj.push_back(Pair("evictions",     (int64_t)stats.nEvictions));
+    return obj;
+}
+
 
 UniValue getrawmempool(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "getrawmempool\n"
-            "Returns all transaction ids in memory pool.");
+            "getrawmempool [verbose=false]\n"
+            "Returns all transaction ids in memory pool.\n"
+            "With verbose, returns an object describing each transaction instead, highest fee rate first.");
+
+    bool fVerbose = false;
+    if (params.size() > 0)
+        fVerbose = params[0].get_bool();
+
+    if (fVerbose)
+    {
+        LOCK(mempool.cs);
+        UniValue o(UniValue::VOBJ);
+        for (CTxMemPool::feerate_iterator it = mempool.feerate_begin(); it != mempool.feerate_end(); ++it)
+        {
+            const uint256& hash = it->second;
+            const CTxMemPoolEntry& e = mempool.mapInfo[hash];
+            UniValue info(UniValue::VOBJ);
+            info.push_back(Pair("size", (int)e.nTxSize));
+            info.push_back(Pair("fee", ValueFromAmount(e.nFee)));
+            info.push_back(Pair("feerate", ValueFromAmount((int64_t)e.GetFeeRate())));
+            info.push_back(Pair("time", e.nTime));
+            info.push_back(Pair("height", e.nHeight));
+            UniValue depends(UniValue::VARR);
+            BOOST_FOREACH(const uint256& hashParent, e.setParents)
+                depends.push_back(hashParent.ToString());
+            info.push_back(Pair("depends", depends));
+            o.push_back(Pair(hash.ToString(), info));
+        }
+        return o;
+    }
 
     vector<uint256> vtxid;
     mempool.queryHashes(vtxid);
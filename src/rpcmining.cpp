@@ -58,7 +58,8 @@ UniValue getmininginfo(const UniValue& params, bool fHelp)
     if (fHelp || params.size() != 0)
         throw runtime_error(
             "getmininginfo\n"
-            "Returns an object containing mining-related information.");
+            "Returns an object containing mining-related information.\n"
+            "templatetime shows how many milliseconds building the last block template took.");
 
     uint64_t nWeight = 0;
     if (pwalletMain)
@@ -82,6 +83,18 @@ UniValue getmininginfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("errors",        GetWarnings("statusbar")));
     obj.push_back(Pair("pooledtx",      (uint64_t)mempool.size()));
 
+    CBlockTemplateTiming timing;
+    {
+        LOCK(cs_main);
+        timing = lastBlockTemplateTiming;
+    }
+    UniValue templatetime(UniValue::VOBJ);
+    templatetime.push_back(Pair("prioritize", timing.nPrioritize * 0.001));
+    templatetime.push_back(Pair("assemble",   timing.nAssemble * 0.001));
+    templatetime.push_back(Pair("total",      timing.nTotal * 0.001));
+    templatetime.push_back(Pair("candidates", (uint64_t)timing.nCandidates));
+    obj.push_back(Pair("templatetime", templatetime));
+
     weight.push_back(Pair("minimum",    (double)nWeight/COIN));
     weight.push_back(Pair("maximum",    (uint64_t)0));
     weight.push_back(Pair("combined",  (double)nWeight/COIN));
@@ -99,15 +112,11 @@ UniValue getstakinginfo(const UniValue& params, bool fHelp)
             "getstakinginfo\n"
             "Returns an object containing staking-related information.");
 
-    uint64_t nWeight = 0;
-    pwalletMain->GetStakeWeight(nWeight);
+    CStakeStats stats = pwalletMain->GetStakeStats();
+    uint64_t nWeight = stats.nWeight;
 
     bool staking = nLastCoinStakeSearchInterval && nWeight;
-    uint64_t nExpectedTime;
-
-    if (staking)
-        pwalletMain->GetExpectedStakeTime(nExpectedTime);
-
+    uint64_t nExpectedTime = stats.nExpectedTime;
 
     UniValue obj(UniValue::VOBJ);
     obj.push_back(Pair("enabled", GetBoolArg("-staking", true)));
@@ -122,6 +131,8 @@ UniValue getstakinginfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("search-interval", (int)nLastCoinStakeSearchInterval));
 
     obj.push_back(Pair("weight", (double)nWeight/COIN));
+    obj.push_back(Pair("matureweight", (double)stats.nMature/COIN));
+    obj.push_back(Pair("immatureweight", (double)stats.nImmature/COIN));
     obj.push_back(Pair("netstakeweight", GetPoSKernelPS()/COIN));
 
     obj.push_back(Pair("expectedtime", staking ? int(nExpectedTime) : -1));
@@ -246,6 +257,8 @@ UniValue getworkex(const UniValue& params, bool fHelp)
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
 
+        // vtx[0] may have been read from an earlier coinbase argument
+        pblock->vtx[0].UncacheHash();
         if(coinbase.size() == 0)
             pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
         else
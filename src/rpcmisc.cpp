@@ -590,14 +590,7 @@ UniValue getsupport(const UniValue& params, bool fHelp)
     if (nWindow > nBlock + 1)
         throw runtime_error("Window starts before block 0.");
 
-    for (int i = nBlock + 1 - nWindow; i <= nBlock; i++) {
-        CBlockIndex* pblockindex = FindBlockByHeight(i);
-        set<string> sup = pblockindex->GetSupport();
-        BOOST_FOREACH(const string &s, sup) {
-            // LogPrintf("%d supports %s\n", i, s);
-            mapSupport[s]++;
-        }
-    }
+    GetSupportCounts(nBlock + 1 - nWindow, nBlock, mapSupport);
 
     UniValue ret(UniValue::VOBJ);
     UniValue counts(UniValue::VOBJ);
@@ -208,7 +208,7 @@ UniValue stop(const UniValue& params, bool fHelp)
         throw runtime_error(
             "stop\n"
             "Stop Clam  server.");
-    // Shutdown will take long enough that the response should get back
+    // The RPC worker writes the reply before shutdown joins it
     StartShutdown();
     return "Clam server stopping";
 }
@@ -225,6 +225,7 @@ static const CRPCCommand vRPCCommands[] =
   //  ------------------------  -----------------------  ---------- ---------- ---------
     { "help",                   &help,                   true,      true,      false },
     { "stop",                   &stop,                   true,      true,      false },
+    { "getrpcinfo",             &getrpcinfo,             true,      true,      false },
     { "getbestblockhash",       &getbestblockhash,       true,      false,     false },
     { "getblockcount",          &getblockcount,          true,      false,     false },
     { "getconnectioncount",     &getconnectioncount,     true,      false,     false },
@@ -234,6 +235,7 @@ static const CRPCCommand vRPCCommands[] =
     { "ping",                   &ping,                   true,      false,     false },
     { "getnettotals",           &getnettotals,           true,      true,      false },
     { "getdifficulty",          &getdifficulty,          true,      false,     false },
+    { "getsigcacheinfo",        &getsigcacheinfo,        true,      true,      false },
     { "getinfo",                &getinfo,                true,      false,     false },
     { "getrawmempool",          &getrawmempool,          true,      false,     false },
     { "getblock",               &getblock,               false,     false,     false },
@@ -386,14 +388,84 @@ bool ClientAllowed(const boost::asio::ip::address& address)
     return false;
 }
 
+class JSONRequest
+{
+public:
+    UniValue id;
+    std::string strMethod;
+    UniValue params;
+
+    JSONRequest() { id = NullUniValue; }
+    void parse(const UniValue& valRequest);
+};
+
+void JSONRequest::parse(const UniValue& valRequest)
+{
+    // Parse request
+    if (!valRequest.isObject())
+        throw JSONRPCError(RPC_INVALID_REQUEST, "Invalid Request object");
+    const UniValue& request = valRequest.get_obj();
+
+    // Parse id now so errors from here on will have the id
+    id = find_value(request, "id");
+
+    // Parse method
+    UniValue valMethod = find_value(request, "method");
+    if (valMethod.isNull())
+        throw JSONRPCError(RPC_INVALID_REQUEST, "Missing method");
+    if (!valMethod.isStr())
+        throw JSONRPCError(RPC_INVALID_REQUEST, "Method must be a string");
+    strMethod = valMethod.get_str();
+    if (strMethod != "getblocktemplate")
+        LogPrint("rpc", "ThreadRPCServer method=%s\n", SanitizeString(strMethod));
+
+    // Parse params
+    UniValue valParams = find_value(request, "params");
+    if (valParams.isArray())
+        params = valParams.get_array();
+    else if (valParams.isNull())
+        params = UniValue(UniValue::VARR);
+    else
+        throw JSONRPCError(RPC_INVALID_REQUEST, "Params must be an array");
+}
+
+
+//
+// Connections are served asynchronously on the RPC io_service: reading a
+// request and writing its reply never block a thread, so idle keep-alive
+// connections cost nothing. Complete requests are handed to a bounded queue
+// drained by -rpcthreads workers, and a request that finds the queue full is
+// answered at once with 503 so clients back off instead of piling up.
+//
+
 class AcceptedConnection
 {
 public:
+    typedef boost::function<void (const boost::system::error_code&, size_t)> IOHandler;
+
+    // Bound the buffer so a request without an end cannot grow it forever
+    AcceptedConnection() : buf(MAX_SIZE + 0x10000), nProto(0), fKeepAlive(false), nTimeQueued(0) {}
     virtual ~AcceptedConnection() {}
 
-    virtual std::iostream& stream() = 0;
     virtual std::string peer_address_to_string() const = 0;
     virtual void close() = 0;
+
+    virtual void async_handshake(const boost::function<void (const boost::system::error_code&)>& handler) = 0;
+    virtual void async_read_until(const std::string& strDelim, const IOHandler& handler) = 0;
+    virtual void async_read(size_t nBytes, const IOHandler& handler) = 0;
+    virtual void async_write(const std::string& str, const IOHandler& handler) = 0;
+    virtual void write(const std::string& str) = 0;
+
+    // Data read but not consumed yet
+    asio::streambuf buf;
+    // Request being read or executed
+    int nProto;
+    string strURI;
+    map<string, string> mapHeaders;
+    string strRequest;
+    string strReply;
+    bool fKeepAlive;
+    int64_t nTimeQueued;
 };
 
 template <typename Protocol>
@@ -403,16 +475,10 @@ public:
     AcceptedConnectionImpl(
             asio::io_service& io_service,
             ssl::context &context,
-            bool fUseSSL) :
+            bool fUseSSLIn) :
         sslStream(io_service, context),
-        _d(sslStream, fUseSSL),
-        _stream(_d)
-    {
-    }
-
-    virtual std::iostream& stream()
+        fUseSSL(fUseSSLIn)
     {
-        return _stream;
     }
 
     virtual std::string peer_address_to_string() const
@@ -422,25 +488,341 @@ public:
 
     virtual void close()
     {
-        _stream.close();
+        boost::system::error_code ec;
+        sslStream.lowest_layer().close(ec);
+    }
+
+    virtual void async_handshake(const boost::function<void (const boost::system::error_code&)>& handler)
+    {
+        if (fUseSSL)
+            sslStream.async_handshake(ssl::stream_base::server, handler);
+        else
+            handler(boost::system::error_code());
+    }
+
+    virtual void async_read_until(const std::string& strDelim, const IOHandler& handler)
+    {
+        if (fUseSSL)
+            asio::async_read_until(sslStream, buf, strDelim, handler);
+        else
+            asio::async_read_until(sslStream.next_layer(), buf, strDelim, handler);
+    }
+
+    virtual void async_read(size_t nBytes, const IOHandler& handler)
+    {
+        if (fUseSSL)
+            asio::async_read(sslStream, buf, asio::transfer_exactly(nBytes), handler);
+        else
+            asio::async_read(sslStream.next_layer(), buf, asio::transfer_exactly(nBytes), handler);
+    }
+
+    // str must stay alive and unchanged until the handler runs
+    virtual void async_write(const std::string& str, const IOHandler& handler)
+    {
+        if (fUseSSL)
+            asio::async_write(sslStream, asio::buffer(str), handler);
+        else
+            asio::async_write(sslStream.next_layer(), asio::buffer(str), handler);
+    }
+
+    // Blocking write that does not need the io_service to be running
+    virtual void write(const std::string& str)
+    {
+        boost::system::error_code ec;
+        if (fUseSSL)
+            asio::write(sslStream, asio::buffer(str), ec);
+        else
+            asio::write(sslStream.next_layer(), asio::buffer(str), ec);
     }
 
     typename Protocol::endpoint peer;
     asio::ssl::stream<typename Protocol::socket> sslStream;
 
 private:
-    SSLIOStreamDevice<Protocol> _d;
-    iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
+    bool fUseSSL;
 };
 
-void ServiceConnection(AcceptedConnection *conn);
+typedef boost::shared_ptr<AcceptedConnection> AcceptedConnectionPtr;
+
+/** Per-method RPC statistics, reported by getrpcinfo */
+struct CRPCMethodStats
+{
+    uint64_t nCalls;
+    uint64_t nErrors;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+    int64_t nTotalWaitMicros;
+    int64_t nMaxWaitMicros;
+
+    CRPCMethodStats() : nCalls(0), nErrors(0), nTotalMicros(0), nMaxMicros(0), nTotalWaitMicros(0), nMaxWaitMicros(0) {}
+};
+
+static CCriticalSection cs_rpcStats;
+static map<string, CRPCMethodStats> mapRPCMethodStats;
+
+static boost::mutex mutexRPCQueue;
+static boost::condition_variable condRPCQueue;
+static deque<AcceptedConnectionPtr> rpcQueue;
+static size_t nRPCQueueMaxDepth = DEFAULT_RPC_QUEUE_DEPTH;
+static size_t nRPCQueuePeak = 0;
+static uint64_t nRPCQueueRejected = 0;
+static int nRPCWorkers = 0;
+static int nRPCWorkersBusy = 0;
+static bool fRPCQueueRunning = false;
+
+static void RecordRPCCall(const string& strMethod, int64_t nMicros, bool fError)
+{
+    LOCK(cs_rpcStats);
+    CRPCMethodStats& stats = mapRPCMethodStats[strMethod];
+    stats.nCalls++;
+    if (fError)
+        stats.nErrors++;
+    stats.nTotalMicros += nMicros;
+    stats.nMaxMicros = std::max(stats.nMaxMicros, nMicros);
+}
+
+static void RecordRPCQueueWait(const string& strMethod, int64_t nMicros)
+{
+    LOCK(cs_rpcStats);
+    CRPCMethodStats& stats = mapRPCMethodStats[strMethod];
+    stats.nTotalWaitMicros += nMicros;
+    stats.nMaxWaitMicros = std::max(stats.nMaxWaitMicros, nMicros);
+}
+
+static string ErrorReplyString(const UniValue& objError, const UniValue& id)
+{
+    std::ostringstream ss;
+    ErrorReply(ss, objError, id);
+    return ss.str();
+}
+
+static void RPCReadRequest(AcceptedConnectionPtr conn);
+
+static void RPCWriteHandler(AcceptedConnectionPtr conn, const boost::system::error_code& error, size_t)
+{
+    if (!error && conn->fKeepAlive)
+        RPCReadRequest(conn);
+    else
+        conn->close();
+}
+
+/** Send strReply, then read the next request if the connection is kept alive. */
+static void RPCSendReply(AcceptedConnectionPtr conn, const string& strReply, bool fKeepAlive)
+{
+    conn->strReply = strReply;
+    conn->fKeepAlive = fKeepAlive;
+    conn->async_write(conn->strReply, boost::bind(&RPCWriteHandler, conn, _1, _2));
+}
+
+static void RPCSendDelayedReply(AcceptedConnectionPtr conn, boost::shared_ptr<deadline_timer> timer, const string& strReply)
+{
+    RPCSendReply(conn, strReply, false);
+}
+
+/** Reply to a request that asked for shutdown (stop, encryptwallet). The
+ *  io_service is stopped as soon as shutdown starts, so an async write could
+ *  be dropped; write the reply before the worker returns, as the
+ *  synchronous server did, and close the connection. */
+static void RPCSendShutdownReply(AcceptedConnectionPtr conn, const string& strReply)
+{
+    conn->write(strReply);
+    conn->close();
+}
+
+static UniValue JSONRPCExecOne(const UniValue& req, int64_t nWaitMicros);
+static string JSONRPCExecBatch(const UniValue& vReq, int64_t nWaitMicros);
+
+/** Execute the request read into conn and send the reply. Runs on a worker. */
+static void RPCExecuteRequest(AcceptedConnectionPtr conn)
+{
+    int64_t nWaitMicros = GetTimeMicros() - conn->nTimeQueued;
+    JSONRequest jreq;
+    try
+    {
+        // Parse request
+        UniValue valRequest;
+        if (!valRequest.read(conn->strRequest))
+            throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+
+        string strReply;
+
+        // singleton request
+        if (valRequest.isObject()) {
+            jreq.parse(valRequest);
+            RecordRPCQueueWait(jreq.strMethod, nWaitMicros);
+
+            UniValue result = tableRPC.execute(jreq.strMethod, jreq.params);
+
+            // Send reply
+            strReply = JSONRPCReply(result, NullUniValue, jreq.id);
+
+        // array of requests
+        } else if (valRequest.isArray())
+            strReply = JSONRPCExecBatch(valRequest.get_array(), nWaitMicros);
+        else
+            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+
+        if (ShutdownRequested())
+            RPCSendShutdownReply(conn, HTTPReply(HTTP_OK, strReply, false));
+        else
+            RPCSendReply(conn, HTTPReply(HTTP_OK, strReply, conn->fKeepAlive), conn->fKeepAlive);
+    }
+    catch (UniValue& objError)
+    {
+        RPCSendReply(conn, ErrorReplyString(objError, jreq.id), false);
+    }
+    catch (std::exception& e)
+    {
+        RPCSendReply(conn, ErrorReplyString(JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id), false);
+    }
+}
+
+static void ThreadRPCWorker()
+{
+    RenameThread("clam-rpcworker");
+    while (true)
+    {
+        AcceptedConnectionPtr conn;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexRPCQueue);
+            while (fRPCQueueRunning && rpcQueue.empty())
+                condRPCQueue.wait(lock);
+            if (!fRPCQueueRunning)
+                return;
+            conn = rpcQueue.front();
+            rpcQueue.pop_front();
+            nRPCWorkersBusy++;
+        }
+        RPCExecuteRequest(conn);
+        conn.reset();
+        {
+            boost::unique_lock<boost::mutex> lock(mutexRPCQueue);
+            nRPCWorkersBusy--;
+        }
+    }
+}
+
+/** Queue a complete request for the workers; false if the queue is full. */
+static bool RPCQueueRequest(AcceptedConnectionPtr conn)
+{
+    boost::unique_lock<boost::mutex> lock(mutexRPCQueue);
+    if (!fRPCQueueRunning || rpcQueue.size() >= nRPCQueueMaxDepth)
+    {
+        nRPCQueueRejected++;
+        return false;
+    }
+    conn->nTimeQueued = GetTimeMicros();
+    rpcQueue.push_back(conn);
+    nRPCQueuePeak = std::max(nRPCQueuePeak, rpcQueue.size());
+    condRPCQueue.notify_one();
+    return true;
+}
+
+static void RPCReadBody(AcceptedConnectionPtr conn, size_t nLen, const boost::system::error_code& error, size_t)
+{
+    if (error)
+    {
+        conn->close();
+        return;
+    }
+
+    conn->strRequest.resize(nLen);
+    if (nLen > 0)
+        conn->buf.sgetn(&conn->strRequest[0], nLen);
+
+    string sConHdr = conn->mapHeaders["connection"];
+    if (sConHdr == "close")
+        conn->fKeepAlive = false;
+    else
+        conn->fKeepAlive = (sConHdr == "keep-alive" || conn->nProto >= 1);
+
+    if (conn->strURI != "/")
+    {
+        RPCSendReply(conn, HTTPReply(HTTP_NOT_FOUND, "", false), false);
+        return;
+    }
+
+    // Check authorization
+    if (conn->mapHeaders.count("authorization") == 0)
+    {
+        RPCSendReply(conn, HTTPReply(HTTP_UNAUTHORIZED, "", false), false);
+        return;
+    }
+    if (!HTTPAuthorized(conn->mapHeaders))
+    {
+        LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string());
+        /* Deter brute-forcing short passwords.
+           If this results in a DoS the user really
+           shouldn't have their RPC port exposed. */
+        if (mapArgs["-rpcpassword"].size() < 20)
+        {
+            // Delay the reply without holding up the io_service
+            boost::shared_ptr<deadline_timer> timer(new deadline_timer(*rpc_io_service));
+            timer->expires_from_now(posix_time::milliseconds(250));
+            timer->async_wait(boost::bind(&RPCSendDelayedReply, conn, timer, HTTPReply(HTTP_UNAUTHORIZED, "", false)));
+            return;
+        }
+        RPCSendReply(conn, HTTPReply(HTTP_UNAUTHORIZED, "", false), false);
+        return;
+    }
+
+    if (!RPCQueueRequest(conn))
+    {
+        LogPrint("rpc", "ThreadRPCServer work queue full, rejecting request from %s\n", conn->peer_address_to_string());
+        RPCSendReply(conn, HTTPReply(HTTP_SERVICE_UNAVAILABLE, "Work queue depth exceeded", conn->fKeepAlive), conn->fKeepAlive);
+    }
+}
+
+static void RPCReadHeaders(AcceptedConnectionPtr conn, const boost::system::error_code& error, size_t)
+{
+    if (error)
+    {
+        conn->close();
+        return;
+    }
+
+    // Request line and headers, up to and including the empty line
+    std::istream stream(&conn->buf);
+    string strMethod;
+    conn->mapHeaders.clear();
+    if (!ReadHTTPRequestLine(stream, conn->nProto, strMethod, conn->strURI))
+    {
+        conn->close();
+        return;
+    }
+    int nLen = ReadHTTPHeaders(stream, conn->mapHeaders);
+    if (nLen < 0 || nLen > (int)MAX_SIZE)
+    {
+        RPCSendReply(conn, HTTPReply(HTTP_INTERNAL_SERVER_ERROR, "", false), false);
+        return;
+    }
+
+    // Part of the body may already have been read along with the headers
+    if (conn->buf.size() >= (size_t)nLen)
+        RPCReadBody(conn, nLen, error, 0);
+    else
+        conn->async_read(nLen - conn->buf.size(), boost::bind(&RPCReadBody, conn, nLen, _1, _2));
+}
+
+static void RPCReadRequest(AcceptedConnectionPtr conn)
+{
+    conn->async_read_until("\r\n\r\n", boost::bind(&RPCReadHeaders, conn, _1, _2));
+}
+
+static void RPCHandshakeHandler(AcceptedConnectionPtr conn, const boost::system::error_code& error)
+{
+    if (error)
+        conn->close();
+    else
+        RPCReadRequest(conn);
+}
 
 // Forward declaration required for RPCListen
 template <typename Protocol, typename SocketAcceptorService>
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
                              ssl::context& context,
                              bool fUseSSL,
-                             AcceptedConnection* conn,
+                             boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn,
                              const boost::system::error_code& error);
 
 /**
@@ -452,7 +834,7 @@ static void RPCListen(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketA
                    const bool fUseSSL)
 {
     // Accept connection
-    AcceptedConnectionImpl<Protocol>* conn = new AcceptedConnectionImpl<Protocol>(acceptor->get_io_service(), context, fUseSSL);
+    boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn(new AcceptedConnectionImpl<Protocol>(*rpc_io_service, context, fUseSSL));
 
     acceptor->async_accept(
             conn->sslStream.lowest_layer(),
@@ -473,36 +855,72 @@ template <typename Protocol, typename SocketAcceptorService>
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
                              ssl::context& context,
                              const bool fUseSSL,
-                             AcceptedConnection* conn,
+                             boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn,
                              const boost::system::error_code& error)
 {
     // Immediately start accepting new connections, except when we're cancelled or our socket is closed.
     if (error != asio::error::operation_aborted && acceptor->is_open())
         RPCListen(acceptor, context, fUseSSL);
 
-    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn);
-
     // TODO: Actually handle errors
     if (error)
-    {
-        delete conn;
-    }
+        return;
 
     // Restrict callers by IP.  It is important to
-    // do this before starting client thread, to filter out
+    // do this before reading the request, to filter out
     // certain DoS and misbehaving clients.
-    else if (tcp_conn && !ClientAllowed(tcp_conn->peer.address()))
+    if (!ClientAllowed(conn->peer.address()))
     {
         // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
         if (!fUseSSL)
-            conn->stream() << HTTPReply(HTTP_FORBIDDEN, "", false) << std::flush;
-        delete conn;
+            RPCSendReply(conn, HTTPReply(HTTP_FORBIDDEN, "", false), false);
+        else
+            conn->close();
+        return;
     }
-    else {
-        ServiceConnection(conn);
-        conn->close();
-        delete conn;
+
+    conn->async_handshake(boost::bind(&RPCHandshakeHandler, AcceptedConnectionPtr(conn), _1));
+}
+
+UniValue getrpcinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrpcinfo\n"
+            "Returns an object containing RPC work queue and per-method call statistics.");
+
+    UniValue queue(UniValue::VOBJ);
+    {
+        boost::unique_lock<boost::mutex> lock(mutexRPCQueue);
+        queue.push_back(Pair("depth",       (int64_t)rpcQueue.size()));
+        queue.push_back(Pair("maxdepth",    (int64_t)nRPCQueueMaxDepth));
+        queue.push_back(Pair("peakdepth",   (int64_t)nRPCQueuePeak));
+        queue.push_back(Pair("rejected",    (int64_t)nRPCQueueRejected));
+        queue.push_back(Pair("workers",     nRPCWorkers));
+        queue.push_back(Pair("busyworkers", nRPCWorkersBusy));
     }
+
+    UniValue methods(UniValue::VOBJ);
+    {
+        LOCK(cs_rpcStats);
+        for (map<string, CRPCMethodStats>::const_iterator it = mapRPCMethodStats.begin(); it != mapRPCMethodStats.end(); ++it)
+        {
+            const CRPCMethodStats& stats = it->second;
+            UniValue obj(UniValue::VOBJ);
+            obj.push_back(Pair("calls",     (int64_t)stats.nCalls));
+            obj.push_back(Pair("errors",    (int64_t)stats.nErrors));
+            obj.push_back(Pair("avgms",     stats.nCalls ? (double)stats.nTotalMicros / stats.nCalls / 1000 : 0.0));
+            obj.push_back(Pair("maxms",     (double)stats.nMaxMicros / 1000));
+            obj.push_back(Pair("avgwaitms", stats.nCalls ? (double)stats.nTotalWaitMicros / stats.nCalls / 1000 : 0.0));
+            obj.push_back(Pair("maxwaitms", (double)stats.nMaxWaitMicros / 1000));
+            methods.push_back(Pair(it->first, obj));
+        }
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("queue", queue));
+    ret.push_back(Pair("methods", methods));
+    return ret;
 }
 
 void StartRPCThreads()
@@ -620,8 +1038,16 @@ void StartRPCThreads()
     }
 
     rpc_worker_group = new boost::thread_group();
-    for (int i = 0; i < GetArg("-rpcthreads", 4); i++)
-        rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
+    {
+        boost::unique_lock<boost::mutex> lock(mutexRPCQueue);
+        fRPCQueueRunning = true;
+        nRPCQueueMaxDepth = std::max((int64_t)1, GetArg("-rpcworkqueue", DEFAULT_RPC_QUEUE_DEPTH));
+        nRPCWorkers = std::max((int64_t)1, GetArg("-rpcthreads", DEFAULT_RPC_THREADS));
+    }
+    // One thread drives all connection I/O and timers, the workers execute calls
+    rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
+    for (int i = 0; i < nRPCWorkers; i++)
+        rpc_worker_group->create_thread(&ThreadRPCWorker);
 }
 
 void StopRPCThreads()
@@ -630,8 +1056,14 @@ void StopRPCThreads()
 
     deadlineTimers.clear();
     rpc_io_service->stop();
+    {
+        boost::unique_lock<boost::mutex> lock(mutexRPCQueue);
+        fRPCQueueRunning = false;
+        condRPCQueue.notify_all();
+    }
     if (rpc_worker_group != NULL)
         rpc_worker_group->join_all();
+    rpcQueue.clear();
     delete rpc_worker_group; rpc_worker_group = NULL;
     delete rpc_ssl_context; rpc_ssl_context = NULL;
     delete rpc_io_service; rpc_io_service = NULL;
@@ -656,55 +1088,14 @@ void RPCRunLater(const std::string& name, boost::function<void(void)> func, int6
     deadlineTimers[name]->async_wait(boost::bind(RPCRunHandler, _1, func));
 }
 
-class JSONRequest
-{
-public:
-    UniValue id;
-    std::string strMethod;
-    UniValue params;
-
-    JSONRequest() { id = NullUniValue; }
-    void parse(const UniValue& valRequest);
-};
-
-void JSONRequest::parse(const UniValue& valRequest)
-{
-    // Parse request
-    if (!valRequest.isObject())
-        throw JSONRPCError(RPC_INVALID_REQUEST, "Invalid Request object");
-    const UniValue& request = valRequest.get_obj();
-
-    // Parse id now so errors from here on will have the id
-    id = find_value(request, "id");
-
-    // Parse method
-    UniValue valMethod = find_value(request, "method");
-    if (valMethod.isNull())
-        throw JSONRPCError(RPC_INVALID_REQUEST, "Missing method");
-    if (!valMethod.isStr())
-        throw JSONRPCError(RPC_INVALID_REQUEST, "Method must be a string");
-    strMethod = valMethod.get_str();
-    if (strMethod != "getblocktemplate")
-        LogPrint("rpc", "ThreadRPCServer method=%s\n", SanitizeString(strMethod));
-
-    // Parse params
-    UniValue valParams = find_value(request, "params");
-    if (valParams.isArray())
-        params = valParams.get_array();
-    else if (valParams.isNull())
-        params = UniValue(UniValue::VARR);
-    else
-        throw JSONRPCError(RPC_INVALID_REQUEST, "Params must be an array");
-}
-
-
-static UniValue JSONRPCExecOne(const UniValue& req)
+static UniValue JSONRPCExecOne(const UniValue& req, int64_t nWaitMicros)
 {
     UniValue rpc_result(UniValue::VOBJ);
 
     JSONRequest jreq;
     try {
         jreq.parse(req);
+        RecordRPCQueueWait(jreq.strMethod, nWaitMicros);
 
         UniValue result = tableRPC.execute(jreq.strMethod, jreq.params);
         rpc_result = JSONRPCReplyObj(result, NullUniValue, jreq.id);
@@ -722,97 +1113,15 @@ static UniValue JSONRPCExecOne(const UniValue& req)
     return rpc_result;
 }
 
-static string JSONRPCExecBatch(const UniValue&  vReq)
+static string JSONRPCExecBatch(const UniValue& vReq, int64_t nWaitMicros)
 {
     UniValue ret(UniValue::VARR);
     for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+        ret.push_back(JSONRPCExecOne(vReq[reqIdx], nWaitMicros));
 
     return ret.write() + "\n";
 }
 
-void ServiceConnection(AcceptedConnection *conn)
-{
-    bool fRun = true;
-    while (fRun)
-    {
-        int nProto = 0;
-        map<string, string> mapHeaders;
-        string strRequest, strMethod, strURI;
-
-        // Read HTTP request line
-        if (!ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI))
-            break;
-
-        // Read HTTP message headers and body
-        ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto);
-
-        if (strURI != "/") {
-            conn->stream() << HTTPReply(HTTP_NOT_FOUND, "", false) << std::flush;
-            break;
-        }
-
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
-        {
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (!HTTPAuthorized(mapHeaders))
-        {
-            LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string());
-            /* Deter brute-forcing short passwords.
-               If this results in a DoS the user really
-               shouldn't have their RPC port exposed. */
-            if (mapArgs["-rpcpassword"].size() < 20)
-                MilliSleep(250);
-
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
-
-        JSONRequest jreq;
-        try
-        {
-            // Parse request
-            UniValue valRequest;
-            if (!valRequest.read(strRequest))
-                throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
-
-            string strReply;
-
-            // singleton request
-            if (valRequest.isObject()) {
-                jreq.parse(valRequest);
-
-                UniValue result = tableRPC.execute(jreq.strMethod, jreq.params);
-
-                // Send reply
-                strReply = JSONRPCReply(result, NullUniValue, jreq.id);
-
-            // array of requests
-            } else if (valRequest.isArray())
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
-                throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
-
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
-        }
-        catch (UniValue& objError)
-        {
-            ErrorReply(conn->stream(), objError, jreq.id);
-            break;
-        }
-        catch (std::exception& e)
-        {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
-        }
-    }
-}
-
 UniValue CRPCTable::execute(const std::string &strMethod, const UniValue &params) const
 {
     // Find method
@@ -830,6 +1139,7 @@ UniValue CRPCTable::execute(const std::string &strMethod, const UniValue &params
         !pcmd->okSafeMode)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
 
+    int64_t nTimeStart = GetTimeMicros();
     try
     {
         // Execute
@@ -852,12 +1162,19 @@ UniValue CRPCTable::execute(const std::string &strMethod, const UniValue &params
             }
 #endif // !ENABLE_WALLET
         }
+        RecordRPCCall(strMethod, GetTimeMicros() - nTimeStart, false);
         return result;
     }
     catch (std::exception& e)
     {
+        RecordRPCCall(strMethod, GetTimeMicros() - nTimeStart, true);
         throw JSONRPCError(RPC_MISC_ERROR, e.what());
     }
+    catch (...)
+    {
+        RecordRPCCall(strMethod, GetTimeMicros() - nTimeStart, true);
+        throw;
+    }
 }
 
 const CRPCTable tableRPC;
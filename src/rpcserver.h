@@ -18,6 +18,11 @@
 
 class CBlockIndex;
 
+/** Default number of threads executing RPC calls (-rpcthreads) */
+static const int DEFAULT_RPC_THREADS = 4;
+/** Default number of complete requests waiting for an RPC thread (-rpcworkqueue) */
+static const int DEFAULT_RPC_QUEUE_DEPTH = 16;
+
 void StartRPCThreads();
 void StopRPCThreads();
 
@@ -101,6 +106,8 @@ extern uint256 ParseHashO(const UniValue& o, std::string strKey);
 extern std::vector<unsigned char> ParseHexV(const UniValue& v, std::string strName);
 extern std::vector<unsigned char> ParseHexO(const UniValue& o, std::string strKey);
 
+extern UniValue getrpcinfo(const UniValue& params, bool fHelp); // in rpcserver.cpp
+
 extern UniValue getconnectioncount(const UniValue& params, bool fHelp); // in rpcnet.cpp
 extern UniValue getpeerinfo(const UniValue& params, bool fHelp);
 extern UniValue ping(const UniValue& params, bool fHelp);
@@ -182,6 +189,7 @@ extern UniValue sendrawtransaction(const UniValue& params, bool fHelp);
 extern UniValue getbestblockhash(const UniValue& params, bool fHelp); // in rpcblockchain.cpp
 extern UniValue getblockcount(const UniValue& params, bool fHelp); // in rpcblockchain.cpp
 extern UniValue getdifficulty(const UniValue& params, bool fHelp);
+extern UniValue getsigcacheinfo(const UniValue& params, bool fHelp);
 extern UniValue settxfee(const UniValue& params, bool fHelp);
 extern UniValue getrawmempool(const UniValue& params, bool fHelp);
 extern UniValue getblockhash(const UniValue& params, bool fHelp);
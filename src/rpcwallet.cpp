@@ -1249,7 +1249,7 @@ UniValue listbalances(const UniValue& params, bool fHelp)
 
     map<string, int64_t> mapAddressBalances;
     vector<COutput> vecOutputs;
-    pwalletMain->AvailableCoins(vecOutputs, false, NULL, fMature);
+    pwalletMain->AvailableCoinsByDepth(vecOutputs, nMinDepth, nMaxDepth, fMature);
 
     BOOST_FOREACH(const COutput& out, vecOutputs) {
         if (out.nDepth < nMinDepth || out.nDepth > nMaxDepth)
@@ -1419,7 +1419,7 @@ UniValue getnotarytransaction(const UniValue& params, bool fHelp)
         throw runtime_error(
             "getnotarytransaction <notaryid> [multipleResults]\n"
             "Get detailed information about <notaryid>\n"
-            "\nSearching can take a while\n");
+            "\nSearching can take a while unless -notaryindex is enabled\n");
 
 
     uint256 hash;
@@ -1435,7 +1435,28 @@ UniValue getnotarytransaction(const UniValue& params, bool fHelp)
 
     UniValue notaryinfo(UniValue::VARR);
     bool notaryFound = false;
-    int blockstogoback = pindexBest->nHeight - 362500;
+
+    vector<CNotaryIndexEntry> vEntries;
+    if (GetNotaryTransactions(hash, false, vEntries)) {
+        BOOST_FOREACH(const CNotaryIndexEntry& notary, vEntries)
+        {
+            // without multipleResults only the most recent block's matches are returned
+            if (!multipleresults && notary.nHeight != vEntries[0].nHeight)
+                break;
+
+            UniValue entry(UniValue::VOBJ);
+            entry.push_back(Pair("notaryid", hash.GetHex()));
+            entry.push_back(Pair("txid", notary.hashTx.GetHex()));
+            notaryinfo.push_back(entry);
+        }
+
+        if (notaryinfo.empty())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Notary transaction not found");
+
+        return notaryinfo;
+    }
+
+    int blockstogoback = pindexBest->nHeight - NOTARY_FIRST_HEIGHT;
     
     const CBlockIndex* pindexFirst = pindexBest;
     for (int i = 0; pindexFirst && i < blockstogoback; i++)
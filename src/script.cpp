@@ -4,8 +4,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
 
 using namespace std;
 using namespace boost;
@@ -20,7 +20,8 @@ using namespace boost;
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags,
+              const CSignatureHashContext* pSigHash = NULL);
 
 static const valtype vchFalse(0);
 static const valtype vchZero(0);
@@ -323,7 +324,8 @@ static bool IsCanonicalSignature(const valtype &vchSig) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, int nBlockHeight, int64_t nBlockTime)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, int nBlockHeight, int64_t nBlockTime,
+                const CSignatureHashContext* pSigHash)
 {
     CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
@@ -1011,7 +1013,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     scriptCode.FindAndDelete(CScript(vchSig));
 
                     bool fSuccess = IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey) &&
-                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pSigHash);
 
                     popstack(stack);
                     popstack(stack);
@@ -1072,7 +1074,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                         // Check signature
                         bool fOk = IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey) &&
-                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pSigHash);
 
                         if (fOk)
                         {
@@ -1230,66 +1232,267 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 }
 
 
+template<typename T>
+static void AppendSerialized(std::vector<unsigned char>& vch, const T& obj, int nVersion)
+{
+    CDataStream ss(SER_GETHASH, nVersion);
+    ss << obj;
+    vch.insert(vch.end(), ss.begin(), ss.end());
+}
+
+static void HashBytes(CHashWriter& ss, const std::vector<unsigned char>& vch, size_t nBegin, size_t nSize)
+{
+    if (nSize > 0)
+        ss.write((const char*)&vch[nBegin], nSize);
+}
+
+CSignatureHashContext::CSignatureHashContext(const CTransaction& txToIn) : txTo(txToIn)
+{
+    const int nVersion = txTo.nVersion;
+
+    vchInputs.reserve(txTo.vin.size() * nBlankInputSize);
+    vchInputsNoSequence.reserve(txTo.vin.size() * nBlankInputSize);
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin)
+    {
+        AppendSerialized(vchInputs, CTxIn(txin.prevout, CScript(), txin.nSequence), nVersion);
+        AppendSerialized(vchInputsNoSequence, CTxIn(txin.prevout, CScript(), 0), nVersion);
+    }
+    assert(vchInputs.size() == txTo.vin.size() * nBlankInputSize);
+
+    CHashWriter ss(SER_GETHASH, nVersion);
+    ss << txTo.nVersion << txTo.nTime;
+    WriteCompactSize(ss, txTo.vin.size());
+    vMidstate.reserve(txTo.vin.size());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        vMidstate.push_back(ss);
+        HashBytes(ss, vchInputs, i * nBlankInputSize, nBlankInputSize);
+    }
+
+    AppendSerialized(vchOutputs, txTo.vout, nVersion);
+    AppendSerialized(vchNullOutput, CTxOut(), nVersion);
+
+    AppendSerialized(vchTrailer, txTo.nLockTime, nVersion);
+    if (txTo.nVersion > CTransaction::LEGACY_VERSION_1)
+        AppendSerialized(vchTrailer, txTo.strCLAMSpeech, nVersion);
+}
+
+uint256 CSignatureHashContext::SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const
+{
+    if (nIn >= txTo.vin.size())
+    {
+        LogPrintf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
+        return 1;
+    }
+
+    // Same blanking rules as ::SignatureHash(), which remains the reference
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    const bool fNone = (nHashType & 0x1f) == SIGHASH_NONE;
+    const bool fSingle = (nHashType & 0x1f) == SIGHASH_SINGLE;
+    const bool fAnyoneCanPay = nHashType & SIGHASH_ANYONECANPAY;
+    if (fSingle && nIn >= txTo.vout.size())
+    {
+        LogPrintf("ERROR: SignatureHash() : nOut=%d out of range\n", nIn);
+        return 1;
+    }
+
+    // Other inputs keep their nSequence only under SIGHASH_ALL
+    const std::vector<unsigned char>& vchBlank = (fNone || fSingle) ? vchInputsNoSequence : vchInputs;
+    const unsigned int nInputs = txTo.vin.size();
+
+    CHashWriter ss(SER_GETHASH, txTo.nVersion);
+    if (fAnyoneCanPay)
+    {
+        ss << txTo.nVersion << txTo.nTime;
+        WriteCompactSize(ss, 1);
+    }
+    else if (!fNone && !fSingle)
+    {
+        ss = vMidstate[nIn];
+    }
+    else
+    {
+        ss << txTo.nVersion << txTo.nTime;
+        WriteCompactSize(ss, nInputs);
+        HashBytes(ss, vchBlank, 0, nIn * nBlankInputSize);
+    }
+
+    const CTxIn& txin = txTo.vin[nIn];
+    ss << txin.prevout << scriptCode << txin.nSequence;
+
+    if (!fAnyoneCanPay)
+        HashBytes(ss, vchBlank, (nIn + 1) * nBlankInputSize, (nInputs - nIn - 1) * nBlankInputSize);
+
+    if (fNone)
+    {
+        WriteCompactSize(ss, 0);
+    }
+    else if (fSingle)
+    {
+        WriteCompactSize(ss, nIn + 1);
+        for (unsigned int i = 0; i < nIn; i++)
+            HashBytes(ss, vchNullOutput, 0, vchNullOutput.size());
+        ss << txTo.vout[nIn];
+    }
+    else
+    {
+        HashBytes(ss, vchOutputs, 0, vchOutputs.size());
+    }
+
+    HashBytes(ss, vchTrailer, 0, vchTrailer.size());
+    ss << nHashType;
+    return ss.GetHash();
+}
+
+
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
+//
+// Entries are salted hashes of (signature hash, signature, public key), so a
+// lookup compares 32 bytes and never allocates. The table is one fixed block
+// of memory split into shards with their own lock. A key maps to a bucket of
+// a few slots in its shard; inserting into a full bucket overwrites one of
+// them, so both insert and eviction are O(1). The salt is random, so an
+// attacker cannot aim valid signatures at particular buckets to flush ours.
 
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    static const unsigned int nShards = 16;
+    static const unsigned int nBucketSize = 4;
+
+    struct CShard
+    {
+        boost::mutex cs;
+        std::vector<uint256> vSlots;
+        unsigned int nEntries;
+        unsigned int nNextEvict;
+        uint64_t nHits;
+        uint64_t nMisses;
+        uint64_t nEvictions;
+
+        CShard() : nEntries(0), nNextEvict(0), nHits(0), nMisses(0), nEvictions(0) {}
+    };
+
+    uint256 salt;
+    unsigned int nBuckets; // per shard
+    CShard shards[nShards];
+
+    uint256 GetKey(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+    {
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << salt << hash << vchSig << pubKey;
+        return ss.GetHash();
+    }
+
+    CShard& GetShard(const uint256& key)
+    {
+        return shards[key.Get64(0) % nShards];
+    }
+
+    // Index of the first slot of key's bucket in its shard
+    unsigned int GetBucket(const uint256& key) const
+    {
+        return (key.Get64(1) % nBuckets) * nBucketSize;
+    }
 
 public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    CSignatureCache() : salt(GetRandHash()), nBuckets(0)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        // -maxsigcachesize has always counted entries; -maxsigcachemb, if
+        // given, sizes the cache in megabytes of 32-byte entries instead.
+        // 0 or less disables the cache.
+        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE);
+        if (mapArgs.count("-maxsigcachemb"))
+        {
+            int64_t nMegabytes = std::min(GetArg("-maxsigcachemb", 0), MAX_SIG_CACHE_MB);
+            nMaxCacheSize = nMegabytes * ((1 << 20) / (int64_t)sizeof(uint256));
+        }
+        if (nMaxCacheSize <= 0)
+            return;
+        nBuckets = std::max((int64_t)1, nMaxCacheSize / (int64_t)(nBucketSize * nShards));
+        for (unsigned int i = 0; i < nShards; i++)
+            shards[i].vSlots.resize(nBuckets * nBucketSize);
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+    bool Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    {
+        if (nBuckets == 0)
+            return false;
+        uint256 key = GetKey(hash, vchSig, pubKey);
+        CShard& shard = GetShard(key);
+        unsigned int nBucket = GetBucket(key);
+
+        boost::unique_lock<boost::mutex> lock(shard.cs);
+        for (unsigned int i = nBucket; i < nBucket + nBucketSize; i++)
+        {
+            if (shard.vSlots[i] == key)
+            {
+                shard.nHits++;
+                return true;
+            }
+        }
+        shard.nMisses++;
         return false;
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+        if (nBuckets == 0)
+            return;
+        uint256 key = GetKey(hash, vchSig, pubKey);
+        CShard& shard = GetShard(key);
+        unsigned int nBucket = GetBucket(key);
+
+        boost::unique_lock<boost::mutex> lock(shard.cs);
+        for (unsigned int i = nBucket; i < nBucket + nBucketSize; i++)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            if (shard.vSlots[i] == key)
+                return;
+            if (shard.vSlots[i] == 0)
+            {
+                shard.vSlots[i] = key;
+                shard.nEntries++;
+                return;
+            }
         }
+        shard.vSlots[nBucket + shard.nNextEvict++ % nBucketSize] = key;
+        shard.nEvictions++;
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+    void GetStats(CSignatureCacheStats& stats)
+    {
+        stats = CSignatureCacheStats();
+        stats.nCapacity = (uint64_t)nBuckets * nBucketSize * nShards;
+        stats.nBytes = stats.nCapacity * sizeof(uint256);
+        for (unsigned int i = 0; i < nShards; i++)
+        {
+            boost::unique_lock<boost::mutex> lock(shards[i].cs);
+            stats.nEntries += shards[i].nEntries;
+            stats.nHits += shards[i].nHits;
+            stats.nMisses += shards[i].nMisses;
+            stats.nEvictions += shards[i].nEvictions;
+        }
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+static CSignatureCache& GetSignatureCache()
 {
     static CSignatureCache signatureCache;
+    return signatureCache;
+}
+
+void GetSignatureCacheStats(CSignatureCacheStats& stats)
+{
+    GetSignatureCache().GetStats(stats);
+}
+
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashContext* pSigHash)
+{
+    CSignatureCache& signatureCache = GetSignatureCache();
 
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
@@ -1304,7 +1507,9 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    assert(!pSigHash || &pSigHash->GetTransaction() == &txTo);
+    uint256 sighash = pSigHash ? pSigHash->SignatureHash(scriptCode, nIn, nHashType)
+                               : SignatureHash(scriptCode, txTo, nIn, nHashType);
 
     if (signatureCache.Get(sighash, vchSig, pubkey))
         return true;
@@ -1736,15 +1941,15 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType, int nBlockHeight, int64_t nBlockTime)
+                  unsigned int flags, int nHashType, int nBlockHeight, int64_t nBlockTime, const CSignatureHashContext* pSigHash)
 {
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, nBlockHeight, nBlockTime))
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, nBlockHeight, nBlockTime, pSigHash))
         return false;
 
     stackCopy = stack;
 
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, nBlockHeight, nBlockTime))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, nBlockHeight, nBlockTime, pSigHash))
         return false;
     if (stack.empty())
         return false;
@@ -1762,7 +1967,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, nBlockHeight, nBlockTime))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, nBlockHeight, nBlockTime, pSigHash))
             return false;
         if (stackCopy.empty())
             return false;
@@ -1773,14 +1978,17 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
 }
 
 
-bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType,
+                   const CSignatureHashContext* pSigHash)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
-    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
+    assert(!pSigHash || &pSigHash->GetTransaction() == &txTo);
+    uint256 hash = pSigHash ? pSigHash->SignatureHash(fromPubKey, nIn, nHashType)
+                            : SignatureHash(fromPubKey, txTo, nIn, nHashType);
 
     txnouttype whichType;
     if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
@@ -1794,7 +2002,8 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         CScript subscript = txin.scriptSig;
 
         // Recompute txn hash using subscript in place of scriptPubKey:
-        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
+        uint256 hash2 = pSigHash ? pSigHash->SignatureHash(subscript, nIn, nHashType)
+                                 : SignatureHash(subscript, txTo, nIn, nHashType);
 
         txnouttype subType;
         bool fSolved =
@@ -1805,10 +2014,11 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     }
 
     // Test solution
-    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, STANDARD_SCRIPT_VERIFY_FLAGS, 0, 0, 0);
+    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, STANDARD_SCRIPT_VERIFY_FLAGS, 0, 0, 0, pSigHash);
 }
 
-bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType,
+                   const CSignatureHashContext* pSigHash)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
@@ -1816,10 +2026,11 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
     assert(txin.prevout.hash == txFrom.GetHash());
     const CTxOut& txout = txFrom.vout[txin.prevout.n];
 
-    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
+    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType, pSigHash);
 }
 
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, int nBlockHeight, int64_t nBlockTime)
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, int nBlockHeight, int64_t nBlockTime,
+                     const CSignatureHashContext* pSigHash)
 {
     assert(nIn < txTo.vin.size());
     const CTxIn& txin = txTo.vin[nIn];
@@ -1830,7 +2041,7 @@ bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsig
     if (txin.prevout.hash != txFrom.GetHash())
         return false;
 
-    return VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, flags, nHashType, nBlockHeight, nBlockTime);
+    return VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, flags, nHashType, nBlockHeight, nBlockTime, pSigHash);
 }
 
 static CScript PushAll(const vector<valtype>& values)
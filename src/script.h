@@ -16,6 +16,7 @@
 
 #include "keystore.h"
 #include "bignum.h"
+#include "hash.h"
 #include "util.h"
 
 typedef std::vector<unsigned char> valtype;
@@ -24,6 +25,10 @@ class CTransaction;
 
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
 static const unsigned int MAX_OP_RETURN_RELAY = 40;      // bytes
+/** Default for -maxsigcachesize, the number of verified signatures to cache (32 bytes each) */
+static const int64_t DEFAULT_MAX_SIG_CACHE_SIZE = 250000;
+/** Largest -maxsigcachemb, the signature cache size in megabytes, accepted */
+static const int64_t MAX_SIG_CACHE_MB = 16384;
 
 /** Signature hash types/flags */
 enum
@@ -688,7 +693,71 @@ public:
 };
 
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, int nBlockHeight, int64_t nBlockTime);
+/** Signature hashing state shared by all inputs of one transaction.
+ *
+ * SignatureHash() copies and reserializes the whole transaction for every
+ * input it hashes, which is quadratic in the number of inputs. This context
+ * serializes the parts of the preimage that do not depend on the input being
+ * signed (the blanked inputs, the outputs and the trailing lock time and
+ * speech) once, and keeps the SHA256 midstate after each blanked input, so
+ * that each SignatureHash() call only hashes its own input and the rest of
+ * the transaction. The hashes are identical to SignatureHash().
+ *
+ * scriptSigs are not part of the context, so it stays valid while they are
+ * filled in by signing. Anything else in the transaction must not change
+ * while the context is in use.
+ */
+class CSignatureHashContext
+{
+private:
+    // Size of a serialized input with an empty scriptSig:
+    // prevout, scriptSig length and nSequence
+    static const unsigned int nBlankInputSize = 36 + 1 + 4;
+
+    const CTransaction& txTo;
+
+    // Serialized inputs with empty scriptSigs, one every nBlankInputSize bytes:
+    // with their own nSequence (SIGHASH_ALL) and with nSequence 0 (NONE/SINGLE)
+    std::vector<unsigned char> vchInputs;
+    std::vector<unsigned char> vchInputsNoSequence;
+
+    // Hash state after nVersion, nTime, the input count and the first i
+    // blanked inputs of a SIGHASH_ALL preimage
+    std::vector<CHashWriter> vMidstate;
+
+    // Serialized output vector, and one output blanked for SIGHASH_SINGLE
+    std::vector<unsigned char> vchOutputs;
+    std::vector<unsigned char> vchNullOutput;
+
+    // Serialized nLockTime and strCLAMSpeech
+    std::vector<unsigned char> vchTrailer;
+
+public:
+    explicit CSignatureHashContext(const CTransaction& txToIn);
+
+    const CTransaction& GetTransaction() const { return txTo; }
+
+    uint256 SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const;
+};
+
+/** Signature cache statistics, see GetSignatureCacheStats() */
+struct CSignatureCacheStats
+{
+    uint64_t nBytes;
+    uint64_t nCapacity;
+    uint64_t nEntries;
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nEvictions;
+
+    CSignatureCacheStats() : nBytes(0), nCapacity(0), nEntries(0), nHits(0), nMisses(0), nEvictions(0) {}
+};
+
+void GetSignatureCacheStats(CSignatureCacheStats& stats);
+
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, int nBlockHeight, int64_t nBlockTime,
+                const CSignatureHashContext* pSigHash = NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey, txnouttype& whichType);
@@ -697,11 +766,14 @@ bool IsMine(const CKeyStore& keystore, const CTxDestination &dest);
 void ExtractAffectedKeys(const CKeyStore &keystore, const CScript& scriptPubKey, std::vector<CKeyID> &vKeys);
 bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet);
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
-bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
+bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL,
+                   const CSignatureHashContext* pSigHash = NULL);
+bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL,
+                   const CSignatureHashContext* pSigHash = NULL);
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                   unsigned int flags, int nHashType, int nBlockHeight, int64_t nBlockTime);
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, int nBlockHeight, int64_t nBlockTime);
+                   unsigned int flags, int nHashType, int nBlockHeight, int64_t nBlockTime, const CSignatureHashContext* pSigHash = NULL);
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, int nBlockHeight, int64_t nBlockTime,
+                     const CSignatureHashContext* pSigHash = NULL);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
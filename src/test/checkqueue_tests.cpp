@@ -0,0 +1,87 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "checkqueue.h"
+
+using namespace std;
+
+// A check that counts how often it ran and returns a preset result
+class CCountingCheck
+{
+public:
+    static boost::mutex cs;
+    static int nRun;
+    bool fResult;
+
+    CCountingCheck(bool fResultIn = true) : fResult(fResultIn) {}
+
+    bool operator()()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        nRun++;
+        return fResult;
+    }
+
+    void swap(CCountingCheck& check) { std::swap(fResult, check.fResult); }
+};
+
+boost::mutex CCountingCheck::cs;
+int CCountingCheck::nRun = 0;
+
+static void RunQueue(CCheckQueue<CCountingCheck>* pqueue)
+{
+    pqueue->Thread();
+}
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+BOOST_AUTO_TEST_CASE(checkqueue_results)
+{
+    CCheckQueue<CCountingCheck> queue(16);
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(boost::bind(&RunQueue, &queue));
+
+    // every check succeeds: all of them run and the batch passes
+    {
+        CCountingCheck::nRun = 0;
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        for (int i = 0; i < 10; i++)
+        {
+            vector<CCountingCheck> vChecks(100);
+            control.Add(vChecks);
+        }
+        BOOST_CHECK(control.Wait());
+        BOOST_CHECK_EQUAL(CCountingCheck::nRun, 1000);
+    }
+
+    // one failing check fails the whole batch and is handed back
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        vector<CCountingCheck> vChecks(100);
+        vChecks[42] = CCountingCheck(false);
+        control.Add(vChecks);
+        CCountingCheck checkFailed;
+        BOOST_CHECK(!control.Wait(&checkFailed));
+        BOOST_CHECK(!checkFailed.fResult);
+    }
+
+    // the queue resets itself for the next batch
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        vector<CCountingCheck> vChecks(5);
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+
+    // without a queue, control is a no-op
+    {
+        CCheckQueueControl<CCountingCheck> control(NULL);
+        BOOST_CHECK(control.Wait());
+    }
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
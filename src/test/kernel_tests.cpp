@@ -0,0 +1,108 @@
+// Copyright (c) 2014 The Clam developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bignum.h"
+#include "kernel.h"
+#include "util.h"
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+// The first kernel from nCoin on, found the way CreateCoinStake used to:
+// coin by coin, each from nTimeTx back over the search interval, keeping only
+// timestamps that pass CheckCoinStakeTimestamp
+static bool FindKernelReference(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeTx, unsigned int nSearchInterval,
+                                const vector<CTransaction>& vTxPrev, const vector<unsigned int>& vTimeBlockFrom,
+                                unsigned int& nCoin, unsigned int& nTimeTxRet, uint256& hashProofOfStakeRet)
+{
+    for (; nCoin < vTxPrev.size(); nCoin++)
+    {
+        CBlock blockFrom;
+        blockFrom.nTime = vTimeBlockFrom[nCoin];
+        for (unsigned int n = 0; n < nSearchInterval; n++)
+        {
+            if (!CheckCoinStakeTimestamp(pindexPrev->nHeight + 1, nTimeTx - n, nTimeTx - n))
+                continue;
+            uint256 targetProofOfStake;
+            if (CheckStakeKernelHash(pindexPrev, nBits, blockFrom, 0, vTxPrev[nCoin], COutPoint(vTxPrev[nCoin].GetHash(), 0),
+                                     nTimeTx - n, hashProofOfStakeRet, targetProofOfStake))
+            {
+                nTimeTxRet = nTimeTx - n;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+BOOST_AUTO_TEST_CASE(kernel_search_matches_reference)
+{
+    CBlockIndex* pindexBestSaved = pindexBest;
+
+    uint256 hashPrev = GetRandHash();
+    CBlockIndex indexPrev;
+    indexPrev.phashBlock = &hashPrev;
+    indexPrev.nHeight = 300000;
+    indexPrev.nStakeModifier = GetRand(std::numeric_limits<uint64_t>::max());
+    pindexBest = &indexPrev;
+
+    // Easy enough that a few dozen kernels turn up among the coins
+    unsigned int nBits = (CBigNum(1) << 216).GetCompact();
+    unsigned int nTimeTx = 1400000000 + 7;
+    unsigned int nSearchInterval = 60;
+
+    vector<CTransaction> vTxPrev(3000);
+    vector<unsigned int> vTimeBlockFrom(vTxPrev.size());
+    for (unsigned int i = 0; i < vTxPrev.size(); i++)
+    {
+        CTransaction& tx = vTxPrev[i];
+        tx.nTime = nTimeTx - 10 * 24 * 60 * 60 - GetRand(1000);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = (1 + GetRand(1000)) * COIN;
+        tx.vout[0].scriptPubKey = CScript() << i;
+        // Some coins only reach the minimum age inside the search interval
+        if (i % 10 == 0)
+            vTimeBlockFrom[i] = nTimeTx - nStakeMinAge - GetRand(nSearchInterval);
+        else
+            vTimeBlockFrom[i] = tx.nTime;
+    }
+
+    for (int nThreads = 1; nThreads <= 4; nThreads += 3)
+    {
+        mapArgs["-stakethreads"] = strprintf("%d", nThreads);
+
+        CStakeKernelSearch search(&indexPrev, nBits, nTimeTx, nSearchInterval);
+        for (unsigned int i = 0; i < vTxPrev.size(); i++)
+            search.AddCoin(vTxPrev[i], COutPoint(vTxPrev[i].GetHash(), 0), vTimeBlockFrom[i], 0, NULL);
+
+        unsigned int nFound = 0;
+        unsigned int nCoin = 0, nCoinRef = 0;
+        while (true)
+        {
+            unsigned int nTime = 0, nTimeRef = 0;
+            uint256 hash, hashRef;
+            bool fFound = search.Find(nCoin, nTime, hash);
+            bool fFoundRef = FindKernelReference(&indexPrev, nBits, nTimeTx, nSearchInterval, vTxPrev, vTimeBlockFrom, nCoinRef, nTimeRef, hashRef);
+            BOOST_CHECK_EQUAL(fFound, fFoundRef);
+            if (!fFound || !fFoundRef)
+                break;
+            BOOST_CHECK_EQUAL(nCoin, nCoinRef);
+            BOOST_CHECK_EQUAL(nTime, nTimeRef);
+            BOOST_CHECK(hash == hashRef);
+            BOOST_CHECK_EQUAL(nTime & STAKE_TIMESTAMP_MASK, 0);
+            nFound++;
+            nCoin++;
+            nCoinRef++;
+        }
+        BOOST_CHECK(nFound > 0);
+    }
+
+    mapArgs.erase("-stakethreads");
+    pindexBest = pindexBestSaved;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
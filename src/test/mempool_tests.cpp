@@ -0,0 +1,253 @@
+// Copyright (c) 2011-2014 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "txmempool.h"
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+// A transaction spending output n of hashPrev, with a distinct output value
+static CTransaction MakeTx(const uint256& hashPrev, unsigned int n, int64_t nValue, unsigned int nOutputs = 1)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, n);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++)
+    {
+        tx.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[i].nValue = nValue;
+    }
+    return tx;
+}
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+BOOST_AUTO_TEST_CASE(mempool_package_accounting)
+{
+    CTxMemPool pool;
+
+    CTransaction txParent = MakeTx(GetRandHash(), 0, 10 * COIN, 2);
+    CTransaction txChild1 = MakeTx(txParent.GetHash(), 0, 1 * COIN);
+    CTransaction txChild2 = MakeTx(txParent.GetHash(), 1, 2 * COIN);
+    CTransaction txGrandChild = MakeTx(txChild1.GetHash(), 0, 3 * COIN);
+
+    BOOST_CHECK(pool.addUnchecked(txParent.GetHash(), txParent, 1000));
+    BOOST_CHECK(pool.addUnchecked(txChild1.GetHash(), txChild1, 2000));
+    BOOST_CHECK(pool.addUnchecked(txChild2.GetHash(), txChild2, 3000));
+    BOOST_CHECK(pool.addUnchecked(txGrandChild.GetHash(), txGrandChild, 4000));
+
+    const CTxMemPoolEntry& parent = pool.mapInfo[txParent.GetHash()];
+    BOOST_CHECK_EQUAL(parent.setChildren.size(), 2);
+    BOOST_CHECK_EQUAL(parent.nFeesWithDescendants, 10000);
+    BOOST_CHECK_EQUAL(pool.mapInfo[txChild1.GetHash()].nFeesWithDescendants, 6000);
+    BOOST_CHECK_EQUAL(pool.mapInfo[txGrandChild.GetHash()].setParents.count(txChild1.GetHash()), 1);
+
+    // Removing a child takes its own descendants with it and updates the parent's package
+    pool.remove(txChild1, true);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    BOOST_CHECK_EQUAL(pool.mapInfo[txParent.GetHash()].nFeesWithDescendants, 4000);
+    BOOST_CHECK_EQUAL(pool.mapInfo[txParent.GetHash()].setChildren.size(), 1);
+
+    // Mining the parent leaves the child without in-pool parents
+    pool.remove(txParent);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK(pool.mapInfo[txChild2.GetHash()].setParents.empty());
+
+    pool.clear();
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_package_removal_in_middle)
+{
+    CTxMemPool pool;
+
+    CTransaction txParent = MakeTx(GetRandHash(), 0, COIN);
+    CTransaction txChild = MakeTx(txParent.GetHash(), 0, COIN);
+    CTransaction txGrandChild = MakeTx(txChild.GetHash(), 0, COIN);
+
+    pool.addUnchecked(txParent.GetHash(), txParent, 1000);
+    pool.addUnchecked(txChild.GetHash(), txChild, 2000);
+    pool.addUnchecked(txGrandChild.GetHash(), txGrandChild, 4000);
+    BOOST_CHECK_EQUAL(pool.mapInfo[txParent.GetHash()].nFeesWithDescendants, 7000);
+
+    // The grandchild no longer hangs off the parent once the child is gone
+    pool.remove(txChild);
+    const CTxMemPoolEntry& parent = pool.mapInfo[txParent.GetHash()];
+    BOOST_CHECK_EQUAL(parent.nFeesWithDescendants, 1000);
+    BOOST_CHECK_EQUAL(parent.nSizeWithDescendants, parent.nTxSize);
+    BOOST_CHECK_EQUAL(pool.mapInfo[txGrandChild.GetHash()].nFeesWithDescendants, 4000);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_package_returning_tx)
+{
+    CTxMemPool pool;
+
+    // A is spent by B and D, and D also spends B: a diamond
+    CTransaction txA = MakeTx(GetRandHash(), 0, COIN, 2);
+    CTransaction txB = MakeTx(txA.GetHash(), 1, COIN);
+    CTransaction txD = MakeTx(txA.GetHash(), 0, COIN);
+    txD.vin.resize(2);
+    txD.vin[1].prevout = COutPoint(txB.GetHash(), 0);
+    txD.vin[1].scriptSig = CScript() << OP_11;
+
+    // B comes back from a disconnected block after D is already in the pool
+    pool.addUnchecked(txA.GetHash(), txA, 1000);
+    pool.addUnchecked(txD.GetHash(), txD, 4000);
+    BOOST_CHECK_EQUAL(pool.mapInfo[txA.GetHash()].nFeesWithDescendants, 5000);
+    pool.addUnchecked(txB.GetHash(), txB, 2000);
+
+    const CTxMemPoolEntry& entryA = pool.mapInfo[txA.GetHash()];
+    const CTxMemPoolEntry& entryB = pool.mapInfo[txB.GetHash()];
+    const CTxMemPoolEntry& entryD = pool.mapInfo[txD.GetHash()];
+    BOOST_CHECK_EQUAL(entryB.nFeesWithDescendants, 6000);
+    BOOST_CHECK_EQUAL(entryD.setParents.size(), 2);
+
+    // A counts D only once
+    BOOST_CHECK_EQUAL(entryA.nFeesWithDescendants, 7000);
+    BOOST_CHECK_EQUAL(entryA.nSizeWithDescendants, entryA.nTxSize + entryB.nTxSize + entryD.nTxSize);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_package_limits)
+{
+    CTxMemPool pool;
+    string strError;
+
+    // A chain of five transactions, each spending the one before
+    vector<CTransaction> vChain;
+    uint256 hashPrev = GetRandHash();
+    for (int i = 0; i < 5; i++)
+    {
+        vChain.push_back(MakeTx(hashPrev, 0, COIN));
+        hashPrev = vChain.back().GetHash();
+        pool.addUnchecked(hashPrev, vChain.back(), 1000);
+    }
+    BOOST_CHECK_EQUAL(pool.mapInfo[vChain[0].GetHash()].nCountWithDescendants, 5);
+    BOOST_CHECK_EQUAL(pool.mapInfo[vChain[4].GetHash()].nCountWithDescendants, 1);
+
+    CTransaction txNext = MakeTx(hashPrev, 0, COIN);
+    unsigned int nSize = ::GetSerializeSize(txNext, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(pool.CheckPackageLimits(txNext, nSize, 6, 100000, 6, 100000, strError));
+    BOOST_CHECK(!pool.CheckPackageLimits(txNext, nSize, 5, 100000, 6, 100000, strError));
+    BOOST_CHECK(!pool.CheckPackageLimits(txNext, nSize, 6, 100000, 5, 100000, strError));
+    BOOST_CHECK(!pool.CheckPackageLimits(txNext, nSize, 6, 5 * nSize, 6, 100000, strError));
+    BOOST_CHECK(!pool.CheckPackageLimits(txNext, nSize, 6, 100000, 6, 5 * nSize, strError));
+
+    // Unrelated transactions are not held back by the chain
+    CTransaction txOther = MakeTx(GetRandHash(), 0, COIN);
+    BOOST_CHECK(pool.CheckPackageLimits(txOther, nSize, 1, nSize, 1, nSize, strError));
+
+    // Removing the tip gives the chain room again
+    pool.remove(vChain[4]);
+    BOOST_CHECK_EQUAL(pool.mapInfo[vChain[0].GetHash()].nCountWithDescendants, 4);
+    CTransaction txReplacement = MakeTx(vChain[3].GetHash(), 0, 2 * COIN);
+    BOOST_CHECK(pool.CheckPackageLimits(txReplacement, nSize, 5, 100000, 5, 100000, strError));
+}
+
+BOOST_AUTO_TEST_CASE(mempool_feerate_order)
+{
+    CTxMemPool pool;
+
+    for (int i = 0; i < 10; i++)
+    {
+        CTransaction tx = MakeTx(GetRandHash(), 0, COIN);
+        pool.addUnchecked(tx.GetHash(), tx, (i * 7 % 10 + 1) * 1000);
+    }
+
+    double dLast = 1e300;
+    int nCount = 0;
+    for (CTxMemPool::feerate_iterator it = pool.feerate_begin(); it != pool.feerate_end(); ++it, ++nCount)
+    {
+        BOOST_CHECK(it->first <= dLast);
+        BOOST_CHECK_EQUAL(it->first, pool.mapInfo[it->second].GetFeeRate());
+        dLast = it->first;
+    }
+    BOOST_CHECK_EQUAL(nCount, 10);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_score_order)
+{
+    CTxMemPool pool;
+
+    CTransaction txParent = MakeTx(GetRandHash(), 0, COIN);
+    CTransaction txChild = MakeTx(txParent.GetHash(), 0, COIN);
+    CTransaction txOther = MakeTx(GetRandHash(), 0, COIN);
+    pool.addUnchecked(txParent.GetHash(), txParent, 1000);
+    pool.addUnchecked(txChild.GetHash(), txChild, 20000);
+    pool.addUnchecked(txOther.GetHash(), txOther, 5000);
+
+    // The parent's package pays more than the other transaction, though it doesn't itself
+    vector<uint256> vOrder;
+    for (CTxMemPool::score_iterator it = pool.score_begin(); it != pool.score_end(); ++it)
+        vOrder.push_back(it->second);
+    BOOST_CHECK_EQUAL(vOrder.size(), 3);
+    BOOST_CHECK(vOrder[0] == txChild.GetHash());
+    BOOST_CHECK(vOrder[1] == txParent.GetHash());
+    BOOST_CHECK(vOrder[2] == txOther.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim_to_size)
+{
+    CTxMemPool pool;
+
+    CTransaction txLow = MakeTx(GetRandHash(), 0, COIN);
+    CTransaction txLowChild = MakeTx(txLow.GetHash(), 0, COIN);
+    CTransaction txHigh = MakeTx(GetRandHash(), 0, COIN);
+
+    pool.addUnchecked(txLow.GetHash(), txLow, 1000);
+    pool.addUnchecked(txLowChild.GetHash(), txLowChild, 2000);
+    pool.addUnchecked(txHigh.GetHash(), txHigh, 50000);
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+
+    // Room for little more than one transaction: the cheap package goes first
+    pool.SetMaxUsage(pool.DynamicMemoryUsage() / 2);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK(pool.exists(txHigh.GetHash()));
+    BOOST_CHECK_EQUAL(pool.GetEvictedCount(), 2);
+    BOOST_CHECK(pool.mapNextTx.count(txLow.vin[0].prevout) == 0);
+
+    // A transaction paying less than what is left is turned away
+    CTransaction txCheap = MakeTx(GetRandHash(), 0, COIN);
+    BOOST_CHECK(!pool.addUnchecked(txCheap.GetHash(), txCheap, 100));
+    BOOST_CHECK(pool.exists(txHigh.GetHash()));
+
+    // One paying more pushes the old one out
+    CTransaction txBetter = MakeTx(GetRandHash(), 0, COIN);
+    BOOST_CHECK(pool.addUnchecked(txBetter.GetHash(), txBetter, 100000));
+    BOOST_CHECK(!pool.exists(txHigh.GetHash()));
+}
+
+BOOST_AUTO_TEST_CASE(mempool_min_fee_rate)
+{
+    CTxMemPool pool;
+    SetMockTime(1400000000);
+    BOOST_CHECK_EQUAL(pool.GetMinFeeRate(), 0);
+
+    CTransaction txLow = MakeTx(GetRandHash(), 0, COIN);
+    CTransaction txHigh = MakeTx(GetRandHash(), 0, COIN);
+    pool.addUnchecked(txLow.GetHash(), txLow, 20000);
+    pool.addUnchecked(txHigh.GetHash(), txHigh, 500000);
+    double dEvictedRate = pool.mapInfo[txLow.GetHash()].GetScore();
+
+    // Evicting raises the floor past what was evicted
+    pool.SetMaxUsage(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(!pool.exists(txLow.GetHash()));
+    double dRate = pool.GetMinFeeRate();
+    BOOST_CHECK_EQUAL(dRate, dEvictedRate + MIN_RELAY_TX_FEE);
+
+    // and it halves with every half-life while the pool stays full
+    SetMockTime(1400000000 + MEMPOOL_MIN_FEE_HALFLIFE);
+    BOOST_CHECK(fabs(pool.GetMinFeeRate() - dRate / 2) < 1e-6);
+
+    // until it drops back to nothing
+    SetMockTime(1400000000 + 20 * MEMPOOL_MIN_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFeeRate(), 0);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
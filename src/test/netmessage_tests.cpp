@@ -0,0 +1,111 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "net.h"
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+// Wire format of a message carrying vchPayload
+static vector<char> MakeMessage(const char* pszCommand, const vector<char>& vchPayload)
+{
+    CMessageHeader hdr(pszCommand, vchPayload.size());
+    uint256 hash = Hash(vchPayload.begin(), vchPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    vector<char> vch(ss.begin(), ss.end());
+    vch.insert(vch.end(), vchPayload.begin(), vchPayload.end());
+    return vch;
+}
+
+BOOST_AUTO_TEST_SUITE(netmessage_tests)
+
+BOOST_AUTO_TEST_CASE(netmessage_incremental_checksum)
+{
+    vector<char> vchPayload(100000);
+    for (unsigned int i = 0; i < vchPayload.size(); i++)
+        vchPayload[i] = (char)(i * 7);
+    vector<char> vchEmpty;
+
+    vector<char> vchWire = MakeMessage("block", vchPayload);
+    vector<char> vchVerack = MakeMessage("verack", vchEmpty);
+    vchWire.insert(vchWire.end(), vchVerack.begin(), vchVerack.end());
+
+    // Feed the stream in odd-sized pieces, as recv() would
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    LOCK(node.cs_vRecvMsg);
+    for (unsigned int nPos = 0; nPos < vchWire.size(); nPos += 997)
+        BOOST_CHECK(node.ReceiveMsgBytes(&vchWire[nPos], min((size_t)997, vchWire.size() - nPos)));
+
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 2U);
+    const CNetMessage& msg = node.vRecvMsg[0];
+    BOOST_CHECK(msg.complete());
+    BOOST_CHECK(msg.hashData == Hash(vchPayload.begin(), vchPayload.end()));
+    BOOST_CHECK(vector<char>(msg.vRecv.begin(), msg.vRecv.end()) == vchPayload);
+
+    BOOST_CHECK(node.vRecvMsg[1].complete());
+    BOOST_CHECK(node.vRecvMsg[1].hashData == Hash(vchEmpty.begin(), vchEmpty.end()));
+    node.vRecvMsg.clear();
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_receive_in_place)
+{
+    vector<char> vchPayload(50000, 'x');
+    vector<char> vchWire = MakeMessage("block", vchPayload);
+
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    LOCK(node.cs_vRecvMsg);
+    unsigned int nBytes = 0x10000;
+    BOOST_CHECK(node.GetRecvDataBuffer(0, nBytes) == NULL);
+
+    // After the header, the payload can be written straight into the message
+    BOOST_CHECK(node.ReceiveMsgBytes(&vchWire[0], 24));
+    nBytes = 0x10000;
+    BOOST_CHECK(node.GetRecvDataBuffer(vchPayload.size() + 1, nBytes) == NULL);
+    char* pch = node.GetRecvDataBuffer(0x1000, nBytes);
+    BOOST_REQUIRE(pch != NULL);
+    BOOST_CHECK_EQUAL(nBytes, vchPayload.size());
+    memcpy(pch, &vchPayload[0], nBytes);
+    node.RecvDataWritten(nBytes);
+
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+    BOOST_CHECK(node.vRecvMsg[0].complete());
+    BOOST_CHECK(node.vRecvMsg[0].hashData == Hash(vchPayload.begin(), vchPayload.end()));
+    node.vRecvMsg.clear();
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(netmessage_shared_send)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    // A shared buffer goes out exactly like the same message pushed normally
+    uint64_t nonce = 0x0123456789abcdefULL;
+    CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+    ssPayload << nonce;
+    CSendBuffer pbuffer = MakeMessageBuffer("ping", ssPayload);
+
+    CNode node(fds[0], CAddress(), "", true);
+    node.PushMessage("ping", nonce);
+    node.PushMessageBuffer(pbuffer);
+    node.PushMessageBuffer(pbuffer);
+    BOOST_CHECK(node.vSendMsg.empty());
+    BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+
+    char pchBuf[256];
+    ssize_t nBytes = recv(fds[1], pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    BOOST_REQUIRE_EQUAL(nBytes, (ssize_t)(3 * pbuffer->size()));
+    for (int i = 0; i < 3; i++)
+        BOOST_CHECK(memcmp(pchBuf + i * pbuffer->size(), &(*pbuffer)[0], pbuffer->size()) == 0);
+
+    close(fds[1]);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
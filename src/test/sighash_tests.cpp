@@ -0,0 +1,82 @@
+// Copyright (c) 2013 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "random.h"
+#include "script.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+static void RandomScript(CScript &script) {
+    static const opcodetype oplist[] = {OP_FALSE, OP_1, OP_2, OP_3, OP_CHECKSIG, OP_IF, OP_VERIF, OP_RETURN, OP_CODESEPARATOR};
+    script = CScript();
+    int ops = (insecure_rand() % 10);
+    for (int i=0; i<ops; i++)
+        script << oplist[insecure_rand() % (sizeof(oplist)/sizeof(oplist[0]))];
+}
+
+static void RandomTransaction(CTransaction &tx, bool fSingle) {
+    tx.nVersion = (insecure_rand() % 2) ? CTransaction::CURRENT_VERSION : CTransaction::LEGACY_VERSION_1;
+    tx.nTime = insecure_rand();
+    tx.vin.clear();
+    tx.vout.clear();
+    tx.nLockTime = (insecure_rand() % 2) ? insecure_rand() : 0;
+    tx.strCLAMSpeech = (insecure_rand() % 2) ? "speech" : "";
+    int ins = (insecure_rand() % 4) + 1;
+    int outs = fSingle ? ins : (insecure_rand() % 4) + 1;
+    for (int in = 0; in < ins; in++) {
+        tx.vin.push_back(CTxIn());
+        CTxIn &txin = tx.vin.back();
+        txin.prevout.hash = GetRandHash();
+        txin.prevout.n = insecure_rand() % 4;
+        RandomScript(txin.scriptSig);
+        txin.nSequence = (insecure_rand() % 2) ? insecure_rand() : (unsigned int)-1;
+    }
+    for (int out = 0; out < outs; out++) {
+        tx.vout.push_back(CTxOut());
+        CTxOut &txout = tx.vout.back();
+        txout.nValue = insecure_rand() % 100000000;
+        RandomScript(txout.scriptPubKey);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(sighash_tests)
+
+BOOST_AUTO_TEST_CASE(sighash_context_matches_reference)
+{
+    seed_insecure_rand(false);
+
+    for (int i=0; i<20000; i++) {
+        int nHashType = insecure_rand();
+        CTransaction txTo;
+        RandomTransaction(txTo, (nHashType & 0x1f) == SIGHASH_SINGLE);
+        CScript scriptCode;
+        RandomScript(scriptCode);
+        int nIn = insecure_rand() % (txTo.vin.size() + 1);
+
+        CSignatureHashContext sighash(txTo);
+        BOOST_CHECK(sighash.SignatureHash(scriptCode, nIn, nHashType) == SignatureHash(scriptCode, txTo, nIn, nHashType));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sighash_context_ignores_scriptsigs)
+{
+    seed_insecure_rand(false);
+
+    CTransaction txTo;
+    RandomTransaction(txTo, false);
+    CSignatureHashContext sighash(txTo);
+    for (unsigned int nIn = 0; nIn < txTo.vin.size(); nIn++) {
+        RandomScript(txTo.vin[nIn].scriptSig);
+        CScript scriptCode;
+        RandomScript(scriptCode);
+        BOOST_CHECK(sighash.SignatureHash(scriptCode, nIn, SIGHASH_ALL) == SignatureHash(scriptCode, txTo, nIn, SIGHASH_ALL));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
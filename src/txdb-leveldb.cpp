@@ -3,6 +3,7 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file license.txt or http://www.opensource.org/licenses/mit-license.php.
 
+#include <algorithm>
 #include <map>
 
 #include <boost/version.hpp>
@@ -28,14 +29,167 @@ leveldb::DB *txdb; // global pointer for LevelDB object instance
 
 extern map<string, CClamour*> mapClamour;
 
+// Write-back cache in front of LevelDB. Committed batches and direct writes
+// are merged in here and reach the database later in one large atomic batch,
+// so records written by recent blocks (mostly tx index entries that get spent
+// again shortly afterwards) are served from memory. Since only whole committed
+// batches enter the cache and it is always flushed as a whole, what is on disk
+// is always a consistent earlier state of the chain.
+struct CTxDBCacheEntry
+{
+    std::string strValue;
+    bool fErased;
+    bool fDirty;
+    uint64_t nLastUse;      // nTxDBCacheClock at the last read or write
+};
+
+static CCriticalSection cs_txdbcache;
+static map<string, CTxDBCacheEntry> mapTxDBCache;
+static size_t nTxDBCacheUsage = 0;        // approximate bytes held by mapTxDBCache
+static size_t nTxDBCacheDirty = 0;        // entries not yet written to LevelDB
+static size_t nTxDBCacheMax = 0;          // size limit in bytes, 0 = cache disabled
+static uint64_t nTxDBCacheClock = 0;      // ticks on every cache access, for LRU eviction
+static unsigned int nTxDBCacheFlushes = 0;
+static int64_t nTxDBCacheLastFlush = 0;
+static int64_t nTxDBFlushInterval = 60;
+static bool fTxDBBatchWrites = false;     // initial sync: only flush when full or asked to
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
     int nCacheSizeMB = GetArg("-dbcache", 25);
-    options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
+    // a quarter goes to LevelDB's block cache, the rest to our write-back cache
+    options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576 / 4);
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    nTxDBCacheMax = std::max(0, nCacheSizeMB) * (size_t)1048576 / 4 * 3;
+    nTxDBFlushInterval = GetArg("-dbflushinterval", 60);
+    nTxDBCacheLastFlush = GetTime();
     return options;
 }
 
+static size_t CacheEntryUsage(const string& strKey, const CTxDBCacheEntry& entry)
+{
+    // key and value data plus a rough estimate of the map node overhead
+    return strKey.size() + entry.strValue.size() + 96;
+}
+
+// Caller must hold cs_txdbcache
+static void CacheStore(const string& strKey, const string& strValue, bool fErased, bool fDirty)
+{
+    map<string, CTxDBCacheEntry>::iterator mi = mapTxDBCache.find(strKey);
+    if (mi == mapTxDBCache.end())
+        mi = mapTxDBCache.insert(make_pair(strKey, CTxDBCacheEntry())).first;
+    else
+    {
+        nTxDBCacheUsage -= CacheEntryUsage(mi->first, mi->second);
+        if (mi->second.fDirty)
+            nTxDBCacheDirty--;
+    }
+    CTxDBCacheEntry& entry = mi->second;
+    entry.strValue = fErased ? string() : strValue;
+    entry.fErased = fErased;
+    entry.fDirty = fDirty;
+    entry.nLastUse = ++nTxDBCacheClock;
+    nTxDBCacheUsage += CacheEntryUsage(mi->first, entry);
+    if (fDirty)
+        nTxDBCacheDirty++;
+}
+
+static bool CompareLastUse(const pair<uint64_t, map<string, CTxDBCacheEntry>::iterator>& a,
+                           const pair<uint64_t, map<string, CTxDBCacheEntry>::iterator>& b)
+{
+    return a.first < b.first;
+}
+
+// Drop the least recently used clean entries until the cache is down to half
+// its limit, so the hot part of the working set survives a flush.
+// Caller must hold cs_txdbcache
+static void EvictCache()
+{
+    size_t nLowWater = nTxDBCacheMax / 2;
+    if (nTxDBCacheUsage <= nLowWater)
+        return;
+
+    vector<pair<uint64_t, map<string, CTxDBCacheEntry>::iterator> > vClean;
+    vClean.reserve(mapTxDBCache.size() - nTxDBCacheDirty);
+    for (map<string, CTxDBCacheEntry>::iterator mi = mapTxDBCache.begin(); mi != mapTxDBCache.end(); ++mi)
+        if (!mi->second.fDirty)
+            vClean.push_back(make_pair(mi->second.nLastUse, mi));
+    sort(vClean.begin(), vClean.end(), CompareLastUse);
+
+    size_t nEvicted = 0;
+    for (unsigned int i = 0; i < vClean.size() && nTxDBCacheUsage > nLowWater; i++)
+    {
+        nTxDBCacheUsage -= CacheEntryUsage(vClean[i].second->first, vClean[i].second->second);
+        mapTxDBCache.erase(vClean[i].second);
+        nEvicted++;
+    }
+    LogPrint("db", "EvictCache() : evicted %u entries, %u bytes cached\n", nEvicted, nTxDBCacheUsage);
+}
+
+// Caller must hold cs_txdbcache
+static bool FlushCache(leveldb::DB *pdb, bool fEvict)
+{
+    if (nTxDBCacheDirty > 0)
+    {
+        if (!pdb)
+            return error("FlushCache() : database not open");
+
+        // During initial sync WriteToDisk leaves blocks uncommitted, and the
+        // index entries written here may point at them
+        if (!CommitBlockFile())
+            return error("FlushCache() : block file commit failure");
+
+        leveldb::WriteBatch batch;
+        for (map<string, CTxDBCacheEntry>::iterator mi = mapTxDBCache.begin(); mi != mapTxDBCache.end(); ++mi)
+        {
+            if (!mi->second.fDirty)
+                continue;
+            if (mi->second.fErased)
+                batch.Delete(mi->first);
+            else
+                batch.Put(mi->first, mi->second.strValue);
+        }
+        // A flush is rare and may hold many blocks' worth of changes, so make
+        // sure it is durable before the cache forgets about it
+        leveldb::WriteOptions writeOptions;
+        writeOptions.sync = true;
+        leveldb::Status status = pdb->Write(writeOptions, &batch);
+        if (!status.ok())
+            return error("FlushCache() : LevelDB batch commit failure: %s", status.ToString());
+        LogPrint("db", "FlushCache() : wrote %u entries (%u bytes cached)\n", nTxDBCacheDirty, nTxDBCacheUsage);
+
+        // Everything is on disk now; delete markers are no longer needed
+        for (map<string, CTxDBCacheEntry>::iterator mi = mapTxDBCache.begin(); mi != mapTxDBCache.end(); )
+        {
+            if (mi->second.fErased)
+            {
+                nTxDBCacheUsage -= CacheEntryUsage(mi->first, mi->second);
+                mapTxDBCache.erase(mi++);
+                continue;
+            }
+            mi->second.fDirty = false;
+            ++mi;
+        }
+        nTxDBCacheDirty = 0;
+    }
+    if (fEvict)
+        EvictCache();
+    nTxDBCacheFlushes++;
+    nTxDBCacheLastFlush = GetTime();
+    return true;
+}
+
+// Flush when the cache grew past its limit or the flush interval has passed.
+// In batch mode the interval is ignored and the caller flushes explicitly.
+// Caller must hold cs_txdbcache
+static bool MaybeFlushCache(leveldb::DB *pdb)
+{
+    bool fFull = nTxDBCacheUsage > nTxDBCacheMax;
+    if (fFull || (!fTxDBBatchWrites && nTxDBCacheDirty > 0 && GetTime() - nTxDBCacheLastFlush >= nTxDBFlushInterval))
+        return FlushCache(pdb, fFull);
+    return true;
+}
+
 void init_blockindex(leveldb::Options& options, bool fRemoveOld = false) {
     // First time init.
     filesystem::path directory = GetDataDir() / "txleveldb";
@@ -145,6 +299,7 @@ CTxDB::CTxDB(const char* pszMode)
 
 void CTxDB::Close()
 {
+    Flush();
     delete txdb;
     txdb = pdb = NULL;
     delete options.filter_policy;
@@ -158,16 +313,49 @@ void CTxDB::Close()
 bool CTxDB::TxnBegin()
 {
     assert(!activeBatch);
-    activeBatch = new leveldb::WriteBatch();
+    activeBatch = new PendingWriteMap();
     return true;
 }
 
+bool CTxDB::Flush()
+{
+    LOCK(cs_txdbcache);
+    return FlushCache(txdb, false);
+}
+
+bool CTxDB::SetBatchWrites(bool fBatch)
+{
+    LOCK(cs_txdbcache);
+    if (fBatch == fTxDBBatchWrites)
+        return true;
+    fTxDBBatchWrites = fBatch;
+    LogPrint("db", "CTxDB::SetBatchWrites(%s)\n", fBatch ? "true" : "false");
+    return fBatch ? true : FlushCache(txdb, false);
+}
+
 bool CTxDB::TxnCommit()
 {
     assert(activeBatch);
-    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
+    if (nTxDBCacheMax > 0)
+    {
+        LOCK(cs_txdbcache);
+        for (PendingWriteMap::const_iterator it = activeBatch->begin(); it != activeBatch->end(); ++it)
+            CacheStore(it->first, it->second.strValue, it->second.fErased, true);
+        delete activeBatch;
+        activeBatch = NULL;
+        return MaybeFlushCache(pdb);
+    }
+    leveldb::WriteBatch batch;
+    for (PendingWriteMap::const_iterator it = activeBatch->begin(); it != activeBatch->end(); ++it)
+    {
+        if (it->second.fErased)
+            batch.Delete(it->first);
+        else
+            batch.Put(it->first, it->second.strValue);
+    }
     delete activeBatch;
     activeBatch = NULL;
+    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
     if (!status.ok()) {
         LogPrintf("LevelDB batch commit failure: %s\n", status.ToString());
         return false;
@@ -175,48 +363,103 @@ bool CTxDB::TxnCommit()
     return true;
 }
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
+// When performing a read, if we have an active batch we need to check it first
+// before reading from the database, as the rest of the code assumes that once
+// a database transaction begins reads are consistent with it.
+bool CTxDB::LookupBatch(const string &key, string *value, bool *deleted) const {
+    assert(activeBatch);
+    *deleted = false;
+    PendingWriteMap::const_iterator it = activeBatch->find(key);
+    if (it == activeBatch->end())
+        return false;
+    if (it->second.fErased)
+        *deleted = true;
+    else
+        *value = it->second.strValue;
+    return true;
+}
 
-    CBatchScanner() : foundEntry(false) {}
+bool CTxDB::ReadRaw(const string& strKey, string& strValue)
+{
+    if (activeBatch) {
+        // First we must search for it in the currently pending set of
+        // changes to the db. If not found in the batch, go on to the cache.
+        bool deleted = false;
+        if (LookupBatch(strKey, &strValue, &deleted))
+            return !deleted;
+    }
 
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
+    unsigned int nFlushes = 0;
+    if (nTxDBCacheMax > 0) {
+        LOCK(cs_txdbcache);
+        map<string, CTxDBCacheEntry>::iterator mi = mapTxDBCache.find(strKey);
+        if (mi != mapTxDBCache.end()) {
+            mi->second.nLastUse = ++nTxDBCacheClock;
+            if (mi->second.fErased)
+                return false;
+            strValue = mi->second.strValue;
+            return true;
         }
+        nFlushes = nTxDBCacheFlushes;
     }
 
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
+    leveldb::Status status = pdb->Get(leveldb::ReadOptions(), strKey, &strValue);
+    if (!status.ok()) {
+        if (status.IsNotFound())
+            return false;
+        // Some unexpected error.
+        LogPrintf("LevelDB read failure: %s\n", status.ToString());
+        return false;
+    }
+
+    if (nTxDBCacheMax > 0) {
+        LOCK(cs_txdbcache);
+        // Only remember what we read if nothing could have changed the key
+        // since: no newer cached entry, and no flush that may have dropped one
+        if (nFlushes == nTxDBCacheFlushes && !mapTxDBCache.count(strKey)) {
+            CacheStore(strKey, strValue, false, false);
+            MaybeFlushCache(pdb);
         }
     }
-};
+    return true;
+}
 
-// When performing a read, if we have an active batch we need to check it first
-// before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
-bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
-    assert(activeBatch);
-    *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
+bool CTxDB::WriteRaw(const string& strKey, const string& strValue)
+{
+    if (activeBatch) {
+        CPendingWrite& write = (*activeBatch)[strKey];
+        write.strValue = strValue;
+        write.fErased = false;
+        return true;
+    }
+    if (nTxDBCacheMax > 0) {
+        LOCK(cs_txdbcache);
+        CacheStore(strKey, strValue, false, true);
+        return MaybeFlushCache(pdb);
+    }
+    leveldb::Status status = pdb->Put(leveldb::WriteOptions(), strKey, strValue);
     if (!status.ok()) {
-        throw runtime_error(status.ToString());
+        LogPrintf("LevelDB write failure: %s\n", status.ToString());
+        return false;
+    }
+    return true;
+}
+
+bool CTxDB::EraseRaw(const string& strKey)
+{
+    if (activeBatch) {
+        CPendingWrite& write = (*activeBatch)[strKey];
+        write.strValue.clear();
+        write.fErased = true;
+        return true;
+    }
+    if (nTxDBCacheMax > 0) {
+        LOCK(cs_txdbcache);
+        CacheStore(strKey, string(), true, true);
+        return MaybeFlushCache(pdb);
     }
-    return scanner.foundEntry;
+    leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), strKey);
+    return (status.ok() || status.IsNotFound());
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
@@ -320,6 +563,94 @@ bool CTxDB::WriteCheckpointPubKey(const string& strPubKey)
     return Write(string("strCheckpointPubKey"), strPubKey);
 }
 
+bool CTxDB::ReadBlockSupport(uint256 hash, vector<unsigned int>& vSupport)
+{
+    vSupport.clear();
+    return Read(make_pair(string("support"), hash), vSupport);
+}
+
+bool CTxDB::WriteBlockSupport(uint256 hash, const vector<unsigned int>& vSupport)
+{
+    return Write(make_pair(string("support"), hash), vSupport);
+}
+
+bool CTxDB::ReadNotaryIndex(uint256 hash, vector<CNotaryIndexEntry>& vEntries)
+{
+    vEntries.clear();
+    return Read(make_pair(string("notary"), hash), vEntries);
+}
+
+bool CTxDB::AddNotaryIndex(uint256 hash, const CNotaryIndexEntry& entry)
+{
+    vector<CNotaryIndexEntry> vEntries;
+    ReadNotaryIndex(hash, vEntries);
+    BOOST_FOREACH(const CNotaryIndexEntry& e, vEntries)
+        if (e.hashTx == entry.hashTx)
+            return true;
+    vEntries.push_back(entry);
+    return Write(make_pair(string("notary"), hash), vEntries);
+}
+
+bool CTxDB::EraseNotaryIndex(uint256 hash, uint256 hashTx)
+{
+    vector<CNotaryIndexEntry> vEntries;
+    if (!ReadNotaryIndex(hash, vEntries))
+        return true;
+    for (vector<CNotaryIndexEntry>::iterator it = vEntries.begin(); it != vEntries.end(); )
+        if (it->hashTx == hashTx)
+            it = vEntries.erase(it);
+        else
+            ++it;
+    if (vEntries.empty())
+        return Erase(make_pair(string("notary"), hash));
+    return Write(make_pair(string("notary"), hash), vEntries);
+}
+
+// Height of the next block the background -notaryindex build has to scan,
+// or -1 once the index covers the whole chain
+bool CTxDB::ReadNotaryIndexHeight(int& nHeight)
+{
+    return Read(string("notaryindex"), nHeight);
+}
+
+bool CTxDB::WriteNotaryIndexHeight(int nHeight)
+{
+    return Write(string("notaryindex"), nHeight);
+}
+
+bool CTxDB::EraseNotaryIndexHeight()
+{
+    return Erase(string("notaryindex"));
+}
+
+bool CTxDB::WipeNotaryIndex()
+{
+    // The iterator bypasses the write-back cache, so flush it first
+    if (!Flush())
+        return error("WipeNotaryIndex() : flushing the write-back cache failed");
+
+    vector<string> vKeys;
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("notary"), uint256(0));
+    for (iterator->Seek(ssStartKey.str()); iterator->Valid(); iterator->Next())
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        string strType;
+        ssKey >> strType;
+        if (strType != "notary")
+            break;
+        vKeys.push_back(iterator->key().ToString());
+    }
+    delete iterator;
+
+    BOOST_FOREACH(const string& strKey, vKeys)
+        if (!EraseRaw(strKey))
+            return false;
+    return true;
+}
+
 static CBlockIndex *InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
@@ -349,7 +680,10 @@ bool CTxDB::LoadBlockIndex()
     }
     // The block index is an in-memory structure that maps hashes to on-disk
     // locations where the contents of the block can be found. Here, we scan it
-    // out of the DB and into mapBlockIndex.
+    // out of the DB and into mapBlockIndex. The iterator bypasses the
+    // write-back cache, so make sure LevelDB is up to date first.
+    if (!Flush())
+        return error("LoadBlockIndex() : flushing the write-back cache failed");
     leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
     // Seek to start key.
     CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
@@ -446,6 +780,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    chainActive.SetTip(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -12,6 +12,8 @@
 #include <string>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
@@ -43,9 +45,19 @@ public:
 private:
     leveldb::DB *pdb;  // Points to the global instance.
 
+    // A pending write: the new value of a key, or a marker that it is erased.
+    struct CPendingWrite
+    {
+        std::string strValue;
+        bool fErased;
+    };
+    typedef boost::unordered_map<std::string, CPendingWrite> PendingWriteMap;
+
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
-    leveldb::WriteBatch *activeBatch;
+    // It is indexed by key, so reads inside a transaction find pending changes
+    // in constant time; only the last change to each key needs to be kept.
+    PendingWriteMap *activeBatch;
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
@@ -54,7 +66,14 @@ protected:
     // Returns true and sets (value,false) if activeBatch contains the given key
     // or leaves value alone and sets deleted = true if activeBatch contains a
     // delete for it.
-    bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
+    bool LookupBatch(const std::string &key, std::string *value, bool *deleted) const;
+
+    // Raw key/value access. Reads look at the active batch first, then at the
+    // write-back cache of committed changes, and only then at LevelDB. Writes
+    // go to the active batch if there is one, else to the write-back cache.
+    bool ReadRaw(const std::string& strKey, std::string& strValue);
+    bool WriteRaw(const std::string& strKey, const std::string& strValue);
+    bool EraseRaw(const std::string& strKey);
 
     template<typename K, typename T>
     bool Read(const K& key, T& value)
@@ -63,28 +82,8 @@ protected:
         ssKey.reserve(1000);
         ssKey << key;
         std::string strValue;
-
-        bool readFromDb = true;
-        if (activeBatch) {
-            // First we must search for it in the currently pending set of
-            // changes to the db. If not found in the batch, go on to read disk.
-            bool deleted = false;
-            readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
-            if (deleted) {
-                return false;
-            }
-        }
-        if (readFromDb) {
-            leveldb::Status status = pdb->Get(leveldb::ReadOptions(),
-                                              ssKey.str(), &strValue);
-            if (!status.ok()) {
-                if (status.IsNotFound())
-                    return false;
-                // Some unexpected error.
-                LogPrintf("LevelDB read failure: %s\n", status.ToString());
-                return false;
-            }
-        }
+        if (!ReadRaw(ssKey.str(), strValue))
+            return false;
         // Unserialize value
         try {
             CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(),
@@ -109,17 +108,7 @@ protected:
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
-
-        if (activeBatch) {
-            activeBatch->Put(ssKey.str(), ssValue.str());
-            return true;
-        }
-        leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
-        if (!status.ok()) {
-            LogPrintf("LevelDB write failure: %s\n", status.ToString());
-            return false;
-        }
-        return true;
+        return WriteRaw(ssKey.str(), ssValue.str());
     }
 
     template<typename K>
@@ -133,12 +122,7 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        if (activeBatch) {
-            activeBatch->Delete(ssKey.str());
-            return true;
-        }
-        leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
-        return (status.ok() || status.IsNotFound());
+        return EraseRaw(ssKey.str());
     }
 
     template<typename K>
@@ -148,17 +132,7 @@ protected:
         ssKey.reserve(1000);
         ssKey << key;
         std::string unused;
-
-        if (activeBatch) {
-            bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
-                return true;
-            }
-        }
-
-
-        leveldb::Status status = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &unused);
-        return status.IsNotFound() == false;
+        return ReadRaw(ssKey.str(), unused);
     }
 
 
@@ -172,6 +146,16 @@ public:
         return true;
     }
 
+    // Write all committed changes held in the write-back cache to LevelDB.
+    // Safe to call when the database was never opened.
+    static bool Flush();
+
+    // While batch writes are on (during initial sync), committed transactions
+    // of consecutive blocks pile up in the write-back cache and are only
+    // written to LevelDB, as one atomic batch, when the cache fills up or on
+    // an explicit Flush(). Turning it off flushes.
+    static bool SetBatchWrites(bool fBatch);
+
     bool ReadVersion(int& nVersion)
     {
         nVersion = 0;
@@ -201,6 +185,15 @@ public:
     bool WriteSyncCheckpoint(uint256 hashCheckpoint);
     bool ReadCheckpointPubKey(std::string& strPubKey);
     bool WriteCheckpointPubKey(const std::string& strPubKey);
+    bool ReadBlockSupport(uint256 hash, std::vector<unsigned int>& vSupport);
+    bool WriteBlockSupport(uint256 hash, const std::vector<unsigned int>& vSupport);
+    bool ReadNotaryIndex(uint256 hash, std::vector<CNotaryIndexEntry>& vEntries);
+    bool AddNotaryIndex(uint256 hash, const CNotaryIndexEntry& entry);
+    bool EraseNotaryIndex(uint256 hash, uint256 hashTx);
+    bool ReadNotaryIndexHeight(int& nHeight);
+    bool WriteNotaryIndexHeight(int nHeight);
+    bool EraseNotaryIndexHeight();
+    bool WipeNotaryIndex();
     bool LoadBlockIndex();
 private:
     bool LoadBlockIndexGuts();
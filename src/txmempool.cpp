@@ -9,8 +9,49 @@
 
 using namespace std;
 
+CTxMemPoolEntry::CTxMemPoolEntry()
+{
+    nFee = 0;
+    nTxSize = 0;
+    nUsage = 0;
+    nTime = 0;
+    nHeight = 0;
+    nFeesWithDescendants = 0;
+    nSizeWithDescendants = 0;
+    nCountWithDescendants = 0;
+}
+
+double CTxMemPoolEntry::GetFeeRate() const
+{
+    return nTxSize ? nFee * 1000.0 / nTxSize : 0;
+}
+
+double CTxMemPoolEntry::GetScore() const
+{
+    double dPackageRate = nSizeWithDescendants ? nFeesWithDescendants * 1000.0 / nSizeWithDescendants : 0;
+    return std::max(GetFeeRate(), dPackageRate);
+}
+
+// Rough memory cost of a pool transaction: the transaction with its inputs and
+// outputs, plus its nodes in mapTx, mapInfo, the two sorted indexes and one
+// mapNextTx node per input. Each tree node adds about 48 bytes of overhead.
+static size_t EstimateUsage(const CTransaction& tx, unsigned int nTxSize)
+{
+    return nTxSize + sizeof(CTransaction) + sizeof(CTxMemPoolEntry) + 4 * 48 +
+        2 * (sizeof(pair<double, uint256>) + 48) +
+        tx.vin.size() * (sizeof(CTxIn) + sizeof(COutPoint) + sizeof(CInPoint) + 48) +
+        tx.vout.size() * sizeof(CTxOut);
+}
+
 CTxMemPool::CTxMemPool()
 {
+    nTransactionsUpdated = 0;
+    nMaxUsage = 0;
+    nTotalUsage = 0;
+    nTotalTxSize = 0;
+    nEvicted = 0;
+    dMinFeeRate = 0;
+    nMinFeeRateUpdate = 0;
 }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
@@ -25,21 +66,225 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+void CTxMemPool::CalculateAncestors(const uint256& hash, set<uint256>& setAncestors) const
+{
+    vector<uint256> vTodo(1, hash);
+    while (!vTodo.empty())
+    {
+        uint256 hashTx = vTodo.back();
+        vTodo.pop_back();
+        BOOST_FOREACH(const uint256& hashParent, mapInfo.find(hashTx)->second.setParents)
+            if (setAncestors.insert(hashParent).second)
+                vTodo.push_back(hashParent);
+    }
+}
+
+void CTxMemPool::CalculateDescendants(const uint256& hash, set<uint256>& setDescendants) const
+{
+    vector<uint256> vTodo(1, hash);
+    while (!vTodo.empty())
+    {
+        uint256 hashTx = vTodo.back();
+        vTodo.pop_back();
+        BOOST_FOREACH(const uint256& hashChild, mapInfo.find(hashTx)->second.setChildren)
+            if (setDescendants.insert(hashChild).second)
+                vTodo.push_back(hashChild);
+    }
+}
+
+void CTxMemPool::UpdateDescendantState(const uint256& hash, int64_t nFeeDelta, int64_t nSizeDelta, int64_t nCountDelta)
+{
+    CTxMemPoolEntry& entry = mapInfo[hash];
+    setByScore.erase(make_pair(entry.GetScore(), hash));
+    entry.nFeesWithDescendants += nFeeDelta;
+    entry.nSizeWithDescendants += nSizeDelta;
+    entry.nCountWithDescendants += nCountDelta;
+    setByScore.insert(make_pair(entry.GetScore(), hash));
+}
+
+void CTxMemPool::RecalculateDescendantState(const uint256& hash)
+{
+    CTxMemPoolEntry& entry = mapInfo[hash];
+    setByScore.erase(make_pair(entry.GetScore(), hash));
+    entry.nFeesWithDescendants = entry.nFee;
+    entry.nSizeWithDescendants = entry.nTxSize;
+    set<uint256> setDescendants;
+    CalculateDescendants(hash, setDescendants);
+    entry.nCountWithDescendants = 1 + setDescendants.size();
+    BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+    {
+        entry.nFeesWithDescendants += mapInfo[hashDescendant].nFee;
+        entry.nSizeWithDescendants += mapInfo[hashDescendant].nTxSize;
+    }
+    setByScore.insert(make_pair(entry.GetScore(), hash));
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx, int64_t nFee)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = tx;
+        CTransaction& txPool = mapTx[hash];
+        txPool = tx;
+
+        CTxMemPoolEntry& entry = mapInfo[hash];
+        entry.nFee = nFee;
+        entry.nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        entry.nUsage = EstimateUsage(tx, entry.nTxSize);
+        entry.nTime = GetTime();
+        entry.nHeight = nBestHeight;
+        entry.nFeesWithDescendants = entry.nFee;
+        entry.nSizeWithDescendants = entry.nTxSize;
+        entry.nCountWithDescendants = 1;
+
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+        {
+            const COutPoint& prevout = tx.vin[i].prevout;
+            mapNextTx[prevout] = CInPoint(&txPool, i);
+            if (mapInfo.count(prevout.hash))
+            {
+                entry.setParents.insert(prevout.hash);
+                mapInfo[prevout.hash].setChildren.insert(hash);
+            }
+        }
+
+        // Transactions from a disconnected block can come back while pool
+        // transactions spending them are still here
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+            if (it == mapNextTx.end())
+                continue;
+            uint256 hashChild = it->second.ptx->GetHash();
+            entry.setChildren.insert(hashChild);
+            mapInfo[hashChild].setParents.insert(hash);
+        }
+        if (!entry.setChildren.empty())
+        {
+            set<uint256> setDescendants;
+            CalculateDescendants(hash, setDescendants);
+            entry.nCountWithDescendants += setDescendants.size();
+            BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+            {
+                entry.nFeesWithDescendants += mapInfo[hashDescendant].nFee;
+                entry.nSizeWithDescendants += mapInfo[hashDescendant].nTxSize;
+            }
+        }
+
+        setByFeeRate.insert(make_pair(entry.GetFeeRate(), hash));
+        setByScore.insert(make_pair(entry.GetScore(), hash));
+
+        // An ancestor may already count some of the returning transaction's
+        // descendants through another path, so with descendants in the pool
+        // the ancestors' packages are summed up again
+        set<uint256> setAncestors;
+        CalculateAncestors(hash, setAncestors);
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+        {
+            if (entry.setChildren.empty())
+                UpdateDescendantState(hashAncestor, entry.nFee, entry.nTxSize, 1);
+            else
+                RecalculateDescendantState(hashAncestor);
+        }
+
+        nTotalUsage += entry.nUsage;
+        nTotalTxSize += entry.nTxSize;
         nTransactionsUpdated++;
     }
+
+    TrimToSize();
+    return mapTx.count(hash) != 0;
+}
+
+bool CTxMemPool::CheckPackageLimits(const CTransaction& tx, unsigned int nSize,
+                                    uint64_t nLimitAncestorCount, uint64_t nLimitAncestorSize,
+                                    uint64_t nLimitDescendantCount, uint64_t nLimitDescendantSize,
+                                    string& strError) const
+{
+    LOCK(cs);
+    set<uint256> setAncestors;
+    vector<uint256> vTodo;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (mapInfo.count(txin.prevout.hash) && setAncestors.insert(txin.prevout.hash).second)
+            vTodo.push_back(txin.prevout.hash);
+
+    uint64_t nAncestorSize = nSize;
+    while (!vTodo.empty())
+    {
+        uint256 hashTx = vTodo.back();
+        vTodo.pop_back();
+        const CTxMemPoolEntry& entry = mapInfo.find(hashTx)->second;
+
+        if (entry.nCountWithDescendants + 1 > nLimitDescendantCount)
+        {
+            strError = strprintf("too many descendants for tx %s [limit: %u]", hashTx.ToString(), nLimitDescendantCount);
+            return false;
+        }
+        if (entry.nSizeWithDescendants + nSize > nLimitDescendantSize)
+        {
+            strError = strprintf("exceeds descendant size limit for tx %s [limit: %u]", hashTx.ToString(), nLimitDescendantSize);
+            return false;
+        }
+
+        nAncestorSize += entry.nTxSize;
+        if (nAncestorSize > nLimitAncestorSize)
+        {
+            strError = strprintf("exceeds ancestor size limit [limit: %u]", nLimitAncestorSize);
+            return false;
+        }
+
+        BOOST_FOREACH(const uint256& hashParent, entry.setParents)
+            if (setAncestors.insert(hashParent).second)
+                vTodo.push_back(hashParent);
+        if (setAncestors.size() + 1 > nLimitAncestorCount)
+        {
+            strError = strprintf("too many unconfirmed ancestors [limit: %u]", nLimitAncestorCount);
+            return false;
+        }
+    }
     return true;
 }
 
+// Caller must hold cs
+void CTxMemPool::removeUnchecked(const uint256& hash)
+{
+    const CTransaction& tx = mapTx[hash];
+    const CTxMemPoolEntry& entry = mapInfo[hash];
+
+    set<uint256> setAncestors;
+    CalculateAncestors(hash, setAncestors);
+
+    BOOST_FOREACH(const uint256& hashParent, entry.setParents)
+        mapInfo[hashParent].setChildren.erase(hash);
+    BOOST_FOREACH(const uint256& hashChild, entry.setChildren)
+        mapInfo[hashChild].setParents.erase(hash);
+
+    // It no longer counts towards the packages of the transactions it spends.
+    // Neither do its descendants, unless they spend those some other way, so
+    // with descendants left in the pool the packages are summed up again.
+    // Descendants' own packages never included it and stay as they are.
+    BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+    {
+        if (entry.setChildren.empty())
+            UpdateDescendantState(hashAncestor, -entry.nFee, -(int64_t)entry.nTxSize, -1);
+        else
+            RecalculateDescendantState(hashAncestor);
+    }
+
+    setByFeeRate.erase(make_pair(entry.GetFeeRate(), hash));
+    setByScore.erase(make_pair(entry.GetScore(), hash));
+    nTotalUsage -= entry.nUsage;
+    nTotalTxSize -= entry.nTxSize;
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        mapNextTx.erase(txin.prevout);
+    mapInfo.erase(hash);
+    mapTx.erase(hash);
+    nTransactionsUpdated++;
+}
+
 bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
 {
     // Remove transaction from memory pool
@@ -55,10 +300,7 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
                         remove(*it->second.ptx, true);
                 }
             }
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
+            removeUnchecked(hash);
         }
     }
     return true;
@@ -83,7 +325,12 @@ void CTxMemPool::clear()
 {
     LOCK(cs);
     mapTx.clear();
+    mapInfo.clear();
     mapNextTx.clear();
+    setByFeeRate.clear();
+    setByScore.clear();
+    nTotalUsage = 0;
+    nTotalTxSize = 0;
     ++nTransactionsUpdated;
 }
 
@@ -105,3 +352,79 @@ bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
     result = i->second;
     return true;
 }
+
+void CTxMemPool::SetMaxUsage(size_t nBytes)
+{
+    {
+        LOCK(cs);
+        nMaxUsage = nBytes;
+    }
+    TrimToSize();
+}
+
+void CTxMemPool::TrimToSize()
+{
+    LOCK(cs);
+    while (nMaxUsage > 0 && nTotalUsage > nMaxUsage && !setByScore.empty())
+    {
+        uint256 hash = setByScore.begin()->second;
+        CTransaction tx = mapTx[hash];
+
+        // New transactions now have to pay more than what was evicted
+        double dRate = setByScore.begin()->first + MIN_RELAY_TX_FEE;
+        if (dRate > GetMinFeeRate())
+        {
+            dMinFeeRate = dRate;
+            nMinFeeRateUpdate = GetTime();
+        }
+
+        size_t nBefore = mapTx.size();
+        remove(tx, true);
+        nEvicted += nBefore - mapTx.size();
+        LogPrint("mempool", "TrimToSize() : evicted %s and %u transactions spending it\n",
+                 hash.ToString(), nBefore - mapTx.size() - 1);
+    }
+}
+
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return nTotalUsage;
+}
+
+uint64_t CTxMemPool::GetTotalTxSize() const
+{
+    LOCK(cs);
+    return nTotalTxSize;
+}
+
+uint64_t CTxMemPool::GetEvictedCount() const
+{
+    LOCK(cs);
+    return nEvicted;
+}
+
+double CTxMemPool::GetMinFeeRate()
+{
+    LOCK(cs);
+    if (dMinFeeRate == 0)
+        return 0;
+
+    int64_t nNow = GetTime();
+    if (nNow > nMinFeeRateUpdate)
+    {
+        // Decay faster while the pool has plenty of room again
+        double dHalfLife = MEMPOOL_MIN_FEE_HALFLIFE;
+        if (nTotalUsage < nMaxUsage / 4)
+            dHalfLife /= 4;
+        else if (nTotalUsage < nMaxUsage / 2)
+            dHalfLife /= 2;
+        dMinFeeRate /= pow(2.0, (nNow - nMinFeeRateUpdate) / dHalfLife);
+        nMinFeeRateUpdate = nNow;
+
+        // Back to the plain relay fee rules once it is insignificant
+        if (dMinFeeRate < MIN_RELAY_TX_FEE / 2)
+            dMinFeeRate = 0;
+    }
+    return dMinFeeRate;
+}
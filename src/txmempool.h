@@ -7,6 +7,46 @@
 
 #include "core.h"
 
+#include <set>
+
+/** Default for -maxmempool, maximum megabytes of memory used by the memory pool */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Seconds for the minimum fee rate raised by eviction to halve again */
+static const int64_t MEMPOOL_MIN_FEE_HALFLIFE = 12 * 60 * 60;
+/** Default for -limitancestorcount, most in-pool transactions a new one and its unconfirmed ancestors may add up to */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, most kilobytes a new transaction and its unconfirmed ancestors may add up to */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, most in-pool transactions any pool transaction and its descendants may add up to */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, most kilobytes any pool transaction and its descendants may add up to */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+
+/** What the memory pool knows about one of its transactions */
+class CTxMemPoolEntry
+{
+public:
+    int64_t nFee;               // fee paid by the transaction
+    unsigned int nTxSize;       // serialized size
+    size_t nUsage;              // estimated memory used, including the pool's indexes
+    int64_t nTime;              // when it entered the pool
+    int nHeight;                // best chain height when it entered the pool
+    std::set<uint256> setParents;   // in-pool transactions it spends
+    std::set<uint256> setChildren;  // in-pool transactions spending it
+
+    // the transaction together with all in-pool transactions spending it
+    int64_t nFeesWithDescendants;
+    uint64_t nSizeWithDescendants;
+    uint64_t nCountWithDescendants;
+
+    CTxMemPoolEntry();
+
+    /** Fee rate in satoshi per 1000 bytes */
+    double GetFeeRate() const;
+    /** Eviction score: the better of the transaction's own fee rate and that of its package */
+    double GetScore() const;
+};
+
 /*
  * CTxMemPool stores valid-according-to-the-current-best-chain
  * transactions that may be included in the next block.
@@ -19,17 +59,47 @@
  */
 class CTxMemPool
 {
+public:
+    typedef std::set<std::pair<double, uint256> > indexed_set;
+    typedef indexed_set::const_reverse_iterator feerate_iterator;
+    typedef indexed_set::const_reverse_iterator score_iterator;
+
 private:
     unsigned int nTransactionsUpdated;
+    size_t nMaxUsage;           // 0 = unlimited
+    size_t nTotalUsage;
+    uint64_t nTotalTxSize;
+    uint64_t nEvicted;
+    double dMinFeeRate;         // fee rate of the last evicted package plus an increment, decaying
+    int64_t nMinFeeRateUpdate;  // when dMinFeeRate last decayed
+
+    indexed_set setByFeeRate;   // (own fee rate, txid)
+    indexed_set setByScore;     // (GetScore(), txid), lowest is evicted first
+
+    void CalculateAncestors(const uint256& hash, std::set<uint256>& setAncestors) const;
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+    void UpdateDescendantState(const uint256& hash, int64_t nFeeDelta, int64_t nSizeDelta, int64_t nCountDelta);
+    void RecalculateDescendantState(const uint256& hash);
+    void removeUnchecked(const uint256& hash);
 
 public:
     mutable CCriticalSection cs;
     std::map<uint256, CTransaction> mapTx;
+    std::map<uint256, CTxMemPoolEntry> mapInfo;
     std::map<COutPoint, CInPoint> mapNextTx;
 
     CTxMemPool();
 
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+    /** Add a transaction paying nFee, then evict the lowest scoring packages
+     *  to stay within the size limit. Returns false if tx itself was evicted. */
+    bool addUnchecked(const uint256& hash, CTransaction &tx, int64_t nFee);
+    /** Check that tx of nSize bytes together with its in-pool ancestors stays within the
+     *  ancestor limits, and that none of those ancestors would exceed the descendant limits.
+     *  Sizes are in bytes. Stops walking as soon as a limit is hit. */
+    bool CheckPackageLimits(const CTransaction& tx, unsigned int nSize,
+                            uint64_t nLimitAncestorCount, uint64_t nLimitAncestorSize,
+                            uint64_t nLimitDescendantCount, uint64_t nLimitDescendantSize,
+                            std::string& strError) const;
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
@@ -50,6 +120,26 @@ public:
     }
 
     bool lookup(uint256 hash, CTransaction& result) const;
+
+    /** Limit the estimated memory used by the pool to nBytes, 0 for no limit */
+    void SetMaxUsage(size_t nBytes);
+    /** Evict the lowest scoring transactions, with everything spending them, until the pool fits its limit */
+    void TrimToSize();
+
+    size_t DynamicMemoryUsage() const;
+    uint64_t GetTotalTxSize() const;
+    uint64_t GetEvictedCount() const;
+    /** Fee rate, in satoshi per 1000 bytes, new transactions must pay since the pool last had to evict */
+    double GetMinFeeRate();
+
+    /** Transactions by fee rate, highest first; cs must be held while iterating */
+    feerate_iterator feerate_begin() const { return setByFeeRate.rbegin(); }
+    feerate_iterator feerate_end() const { return setByFeeRate.rend(); }
+
+    /** Transactions by GetScore(), the better of their own and their package's fee rate,
+     *  highest first; cs must be held while iterating */
+    score_iterator score_begin() const { return setByScore.rbegin(); }
+    score_iterator score_end() const { return setByScore.rend(); }
 };
 
 #endif /* BITCOIN_TXMEMPOOL_H */
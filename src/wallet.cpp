@@ -17,6 +17,9 @@
 #include "util.h"
 
 
+#include <cmath>
+#include <limits>
+
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/range/algorithm.hpp>
 #include <boost/numeric/ublas/matrix.hpp>
@@ -27,6 +30,7 @@ using namespace std;
 int64_t nTransactionFee = MIN_TX_FEE;
 int64_t nReserveBalance = 0;
 int64_t nMinimumInputValue = 0;
+bool fCheckWalletBalances = false;
 
 // limit the number of small outputs we spend at once, unless we have no option
 int     nMaxOutputsToSpend = 500; // each output we spend adds 147 or 148 bytes per compressed address, and 179 or 180 bytes per uncompressed address
@@ -250,6 +254,16 @@ void CWallet::SetBestChain(const CBlockLocator& loc)
     walletdb.WriteBestBlock(loc);
 }
 
+void CWallet::UpdatedBlockTip(const CBlockIndex* pindex)
+{
+    // Nobody stakes during the initial download; the first tip after it catches up
+    if (IsInitialBlockDownload())
+        return;
+
+    LOCK(cs_wallet);
+    UpdateStakeStats();
+}
+
 bool CWallet::SetMinVersion(enum WalletFeature nVersion, CWalletDB* pwalletdbIn, bool fExplicit)
 {
     LOCK(cs_wallet); // nWalletVersion
@@ -427,6 +441,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
                     LogPrintf("WalletUpdateSpent found spent coin %s CLAM %s\n", FormatMoney(GetCredit(wtx.vout[txin.prevout.n])), wtx.GetHash().ToString());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    MarkWalletTxDirty(txin.prevout.hash);
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
             }
@@ -450,6 +465,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
 
             if (fMine) {
                 wtx.WriteToDisk();
+                MarkWalletTxDirty(hash);
                 NotifyTransactionChanged(this, hash, CT_UPDATED);
             }
         }
@@ -463,6 +479,8 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        fStakeCandidatesDirty = true;
+        fWalletTxDirtyAll = true;
     }
 
     fAddressRewardsReady = false;
@@ -477,6 +495,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         pair<map<uint256, CWalletTx>::iterator, bool> ret = mapWallet.insert(make_pair(hash, wtxIn));
         CWalletTx& wtx = (*ret.first).second;
         wtx.BindWallet(this);
+        MarkWalletTxDirty(hash);
         bool fInsertedNew = ret.second;
         if (fInsertedNew)
         {
@@ -615,7 +634,10 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
             // Get merkle branch if transaction was found in a block
             if (pblock)
                 wtx.SetMerkleBranch(pblock);
-            return AddToWallet(wtx);
+            bool fRet = AddToWallet(wtx);
+            if (pblock)
+                AddStakeCandidates(mapWallet[hash], pblock);
+            return fRet;
         }
         else
             WalletUpdateSpent(tx);
@@ -635,7 +657,14 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool
         return;
     }
 
-    AddToWalletIfInvolvingMe(tx, pblock, true);
+    // Coins spent from the memory pool stop counting towards the stake weight
+    // at once; confirmed changes are picked up by UpdatedBlockTip. Takes
+    // cs_main itself, as sendrawtransaction gets here without it.
+    if (AddToWalletIfInvolvingMe(tx, pblock, true) && !pblock && IsFromMe(tx))
+    {
+        LOCK2(cs_main, cs_wallet);
+        UpdateStakeStats();
+    }
 }
 
 void CWallet::StakeTransaction(const CScript& script, int64_t nStakeReward, bool fConnect) {
@@ -687,6 +716,14 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         LOCK(cs_wallet);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
+        MarkWalletTxDirty(hash);
+        while (true)
+        {
+            map<COutPoint, CStakeCandidate>::iterator it = mapStakeCandidates.lower_bound(COutPoint(hash, 0));
+            if (it == mapStakeCandidates.end() || it->first.hash != hash)
+                break;
+            mapStakeCandidates.erase(it);
+        }
     }
     return;
 }
@@ -1020,6 +1057,7 @@ void CWallet::ReacceptWalletTransactions()
                     LogPrintf("ReacceptWalletTransactions found spent coin %s CLAM %s\n", FormatMoney(wtx.GetCredit()), wtx.GetHash().ToString());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
+                    MarkWalletTxDirty(wtx.GetHash());
                 }
             }
             else
@@ -1140,50 +1178,210 @@ void CWallet::TidyWalletTransactions()
 //
 
 
-int64_t CWallet::GetBalance() const
+std::string CWalletBalances::ToString() const
+{
+    return strprintf("CWalletBalances(balance=%s, unconfirmed=%s, immature=%s, stake=%s, newmint=%s)",
+        FormatMoney(nBalance), FormatMoney(nUnconfirmed), FormatMoney(nImmature), FormatMoney(nStake), FormatMoney(nNewMint));
+}
+
+// The share of one transaction in each balance. fVolatile is set when that
+// share can change without the transaction itself changing.
+CWalletBalances CWallet::GetTxBalances(const CWalletTx& wtx, bool& fVolatile) const
 {
-    int64_t nTotal = 0;
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    CWalletBalances b;
+    bool fFinal = IsFinalTx(wtx);
+    bool fTrusted = wtx.IsTrusted();
+    int nDepth = wtx.GetDepthInMainChain();
+    int nBlocksToMaturity = wtx.GetBlocksToMaturity();
+
+    if (fTrusted)
+        b.nBalance = wtx.GetAvailableCredit();
+    if (!fFinal || (!fTrusted && nDepth == 0))
+        b.nUnconfirmed = wtx.GetAvailableCredit();
+    if (nBlocksToMaturity > 0 && nDepth > 0)
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (wtx.IsCoinBase())
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+            b.nImmature = GetCredit(wtx);
+            b.nNewMint = b.nImmature;
         }
+        else if (wtx.IsCoinStake())
+            b.nStake = GetCredit(wtx);
     }
 
-    return nTotal;
+    fVolatile = !fFinal || nDepth <= 0 || nBlocksToMaturity > 0;
+    return b;
 }
 
-int64_t CWallet::GetUnconfirmedBalance() const
+void CWallet::UpdateTxBalances(const uint256& hash) const
 {
-    int64_t nTotal = 0;
+    map<uint256, CWalletBalances>::iterator it = mapTxBalances.find(hash);
+    if (it != mapTxBalances.end())
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        balances -= it->second;
+        mapTxBalances.erase(it);
+    }
+    setBalancesVolatile.erase(hash);
+
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi == mapWallet.end())
+        return;
+
+    bool fVolatile;
+    CWalletBalances b = GetTxBalances(mi->second, fVolatile);
+    if (!b.IsNull())
+    {
+        balances += b;
+        mapTxBalances.insert(make_pair(hash, b));
+    }
+    if (fVolatile)
+        setBalancesVolatile.insert(hash);
+}
+
+// Height of the main chain block holding wtx, INT_MAX if there is none
+static int GetUnspentHeight(const CWalletTx& wtx)
+{
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+    if (mi == mapBlockIndex.end() || !mi->second->IsInMainChain())
+        return std::numeric_limits<int>::max();
+    return mi->second->nHeight;
+}
+
+void CWallet::UpdateTxUnspent(const uint256& hash) const
+{
+    map<COutPoint, CWalletUnspent>::iterator it = mapWalletUnspent.lower_bound(COutPoint(hash, 0));
+    while (it != mapWalletUnspent.end() && it->first.hash == hash)
+    {
+        setWalletUnspentByHeight.erase(make_pair(it->second.nHeight, it->first));
+        mapWalletUnspent.erase(it++);
+    }
+
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi == mapWallet.end())
+        return;
+
+    const CWalletTx& wtx = mi->second;
+    CWalletUnspent unspent;
+    unspent.pwtx = &wtx;
+    unspent.nHeight = GetUnspentHeight(wtx);
+
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
+            mapWalletUnspent.insert(mapWalletUnspent.end(), make_pair(COutPoint(hash, i), unspent));
+            setWalletUnspentByHeight.insert(make_pair(unspent.nHeight, COutPoint(hash, i)));
         }
     }
-    return nTotal;
 }
 
-int64_t CWallet::GetImmatureBalance() const
+void CWallet::UpdateWalletTxCaches() const
 {
-    int64_t nTotal = 0;
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    // Blocks above the fork may have held confirmed transactions of ours
+    if (pindexBalances && !pindexBalances->IsInMainChain())
+        fWalletTxDirtyAll = true;
+    pindexBalances = pindexBest;
+
+    if (fWalletTxDirtyAll)
     {
-        LOCK2(cs_main, cs_wallet);
+        balances.SetNull();
+        mapTxBalances.clear();
+        setBalancesVolatile.clear();
+        mapWalletUnspent.clear();
+        setWalletUnspentByHeight.clear();
+        setWalletTxDirty.clear();
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
-            const CWalletTx& pcoin = (*it).second;
-            if (pcoin.IsCoinBase() && pcoin.GetBlocksToMaturity() > 0 && pcoin.IsInMainChain())
-                nTotal += GetCredit(pcoin);
+            UpdateTxBalances(it->first);
+            UpdateTxUnspent(it->first);
+        }
+        fWalletTxDirtyAll = false;
+    }
+    else
+    {
+        set<uint256> setDirty;
+        setDirty.swap(setWalletTxDirty);
+        BOOST_FOREACH(const uint256& hash, setDirty)
+            UpdateTxUnspent(hash);
+        setDirty.insert(setBalancesVolatile.begin(), setBalancesVolatile.end());
+        BOOST_FOREACH(const uint256& hash, setDirty)
+            UpdateTxBalances(hash);
+    }
+
+    if (fCheckWalletBalances)
+    {
+        CWalletBalances total;
+        set<pair<int, COutPoint> > setUnspent;
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        {
+            bool fVolatile;
+            total += GetTxBalances(it->second, fVolatile);
+            int nHeight = GetUnspentHeight(it->second);
+            for (unsigned int i = 0; i < it->second.vout.size(); i++)
+                if (!it->second.IsSpent(i) && IsMine(it->second.vout[i]))
+                    setUnspent.insert(make_pair(nHeight, COutPoint(it->first, i)));
+        }
+
+        // Both orderings must hold exactly the outputs and heights of the full scan
+        bool fUnspentMatch = setUnspent == setWalletUnspentByHeight && setUnspent.size() == mapWalletUnspent.size();
+        for (set<pair<int, COutPoint> >::const_iterator it = setUnspent.begin(); fUnspentMatch && it != setUnspent.end(); ++it)
+        {
+            map<COutPoint, CWalletUnspent>::const_iterator mi = mapWalletUnspent.find(it->second);
+            fUnspentMatch = mi != mapWalletUnspent.end() && mi->second.nHeight == it->first &&
+                            mi->second.pwtx == &mapWallet.find(it->second.hash)->second;
+        }
+
+        if (total != balances || !fUnspentMatch)
+        {
+            LogPrintf("ERROR: CWallet::UpdateWalletTxCaches() : running totals %s with %u unspent outputs differ from full scan %s with %u, recounting\n",
+                      balances.ToString(), mapWalletUnspent.size(), total.ToString(), setUnspent.size());
+            fWalletTxDirtyAll = true;
+            UpdateWalletTxCaches();
         }
     }
-    return nTotal;
+}
+
+void CWallet::MarkWalletTxDirty(const uint256& hash)
+{
+    AssertLockHeld(cs_wallet);
+    if (!fWalletTxDirtyAll)
+        setWalletTxDirty.insert(hash);
+}
+
+int64_t CWallet::GetBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateWalletTxCaches();
+    return balances.nBalance;
+}
+
+int64_t CWallet::GetUnconfirmedBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateWalletTxCaches();
+    return balances.nUnconfirmed;
+}
+
+int64_t CWallet::GetImmatureBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateWalletTxCaches();
+    return balances.nImmature;
+}
+
+// Checks AvailableCoins makes once per transaction; sets nDepth
+static bool IsAvailableTx(const CWalletTx& wtx, bool fOnlyConfirmed, bool fOnlyMature, int& nDepth)
+{
+    nDepth = wtx.GetDepthInMainChain();
+    return IsFinalTx(wtx) && (!fOnlyConfirmed || wtx.IsTrusted()) &&
+           !((wtx.IsCoinBase() || wtx.IsCoinStake()) && fOnlyMature && wtx.GetBlocksToMaturity() > 0) &&
+           nDepth >= 0;
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -1193,33 +1391,138 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
+        UpdateWalletTxCaches();
 
-            if (!IsFinalTx(*pcoin))
+        // Outputs of one transaction are adjacent in the index, so the
+        // per-transaction checks run once for each transaction with unspent outputs
+        const CWalletTx* pcoinLast = NULL;
+        bool fSkip = true;
+        int nDepth = 0;
+        for (map<COutPoint, CWalletUnspent>::const_iterator it = mapWalletUnspent.begin(); it != mapWalletUnspent.end(); ++it)
+        {
+            const CWalletTx* pcoin = (*it).second.pwtx;
+            if (pcoin != pcoinLast)
+            {
+                pcoinLast = pcoin;
+                fSkip = !IsAvailableTx(*pcoin, fOnlyConfirmed, fOnlyMature, nDepth);
+            }
+            if (fSkip)
                 continue;
 
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
+            unsigned int i = (*it).first.n;
+            if (pcoin->vout[i].nValue >= nMinimumInputValue &&
+                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first.hash, i)))
+                vCoins.push_back(COutput(pcoin, i, nDepth));
+        }
+    }
+}
 
-            if (pcoin->IsCoinBase() && fOnlyMature && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+// Like AvailableCoins without fOnlyConfirmed, but only for outputs between
+// nMinDepth and nMaxDepth confirmations, walking just the matching heights
+void CWallet::AvailableCoinsByDepth(vector<COutput>& vCoins, int nMinDepth, int nMaxDepth, bool fOnlyMature) const
+{
+    vCoins.clear();
 
-            if(pcoin->IsCoinStake() && fOnlyMature && pcoin->GetBlocksToMaturity() > 0)
+    {
+        LOCK2(cs_main, cs_wallet);
+        UpdateWalletTxCaches();
+
+        // Depth d >= 1 is height nBestHeight - d + 1; unconfirmed outputs sort last
+        int nHeightLow = std::numeric_limits<int>::max();
+        if (nMaxDepth > nBestHeight)
+            nHeightLow = 0;
+        else if (nMaxDepth > 0)
+            nHeightLow = nBestHeight - nMaxDepth + 1;
+        int nHeightHigh = nMinDepth > 0 ? nBestHeight - nMinDepth + 1 : std::numeric_limits<int>::max();
+
+        set<pair<int, COutPoint> >::const_iterator it = setWalletUnspentByHeight.lower_bound(make_pair(nHeightLow, COutPoint(uint256(0), 0)));
+        for (; it != setWalletUnspentByHeight.end() && it->first <= nHeightHigh; ++it)
+        {
+            const CWalletTx* pcoin = mapWalletUnspent.find(it->second)->second.pwtx;
+            int nDepth;
+            if (!IsAvailableTx(*pcoin, false, fOnlyMature, nDepth) || nDepth < nMinDepth || nDepth > nMaxDepth)
                 continue;
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 0)
-                continue;
+            unsigned int i = it->second.n;
+            if (pcoin->vout[i].nValue >= nMinimumInputValue)
+                vCoins.push_back(COutput(pcoin, i, nDepth));
+        }
+    }
+}
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue >= nMinimumInputValue &&
-                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                    vCoins.push_back(COutput(pcoin, i, nDepth));
+// Add the unspent outputs of wtx, which must be in a block, to the stake
+// candidates. The offset of the transaction in its block is taken from pblock
+// when given, then from existing candidates of the same transaction, and only
+// read from the transaction index as a last resort.
+void CWallet::AddStakeCandidates(const CWalletTx& wtx, const CBlock* pblock, CTxDB* ptxdb) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
 
-        }
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+    if (mi == mapBlockIndex.end())
+        return;
+    CBlockIndex* pindex = mi->second;
+
+    uint256 hash = wtx.GetHash();
+    vector<unsigned int> vOut;
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
+            vOut.push_back(i);
+    if (vOut.empty())
+        return;
+
+    unsigned int nTxPrevOffset = 0;
+    map<COutPoint, CStakeCandidate>::iterator it = mapStakeCandidates.lower_bound(COutPoint(hash, 0));
+    if (pblock && wtx.nIndex >= 0 && wtx.nIndex < (int)pblock->vtx.size())
+    {
+        nTxPrevOffset = ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(pblock->vtx.size());
+        for (int i = 0; i < wtx.nIndex; i++)
+            nTxPrevOffset += ::GetSerializeSize(pblock->vtx[i], SER_DISK, CLIENT_VERSION);
+    }
+    else if (it != mapStakeCandidates.end() && it->first.hash == hash && it->second.pindexFrom == pindex)
+        nTxPrevOffset = it->second.nTxPrevOffset;
+    else if (pindex->IsInMainChain())
+    {
+        CTxIndex txindex;
+        if (!(ptxdb ? ptxdb->ReadTxIndex(hash, txindex) : CTxDB("r").ReadTxIndex(hash, txindex)))
+            return;
+        nTxPrevOffset = txindex.pos.nTxPos - txindex.pos.nBlockPos;
+    }
+    else
+        return;
+
+    BOOST_FOREACH(unsigned int i, vOut)
+    {
+        CStakeCandidate& candidate = mapStakeCandidates[COutPoint(hash, i)];
+        candidate.pwtx = &wtx;
+        candidate.nValue = wtx.vout[i].nValue;
+        candidate.nTimeBlockFrom = pindex->GetBlockTime();
+        candidate.nTimeTx = wtx.nTime;
+        candidate.nTxPrevOffset = nTxPrevOffset;
+        candidate.nMaturityHeight = pindex->nHeight;
+        if (wtx.IsCoinBase() || wtx.IsCoinStake())
+            candidate.nMaturityHeight += nCoinbaseMaturity + 9;
+        candidate.pindexFrom = pindex;
+    }
+}
+
+// Add candidates missing after events that can make spent coins spendable again
+void CWallet::UpdateStakeCandidates() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (!fStakeCandidatesDirty)
+        return;
+
+    CTxDB txdb("r");
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    {
+        if ((*it).second.hashBlock != 0)
+            AddStakeCandidates((*it).second, NULL, &txdb);
     }
+    fStakeCandidatesDirty = false;
 }
 
 void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSpendTime) const
@@ -1228,29 +1531,38 @@ void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSp
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateStakeCandidates();
+
+        map<COutPoint, CStakeCandidate>::iterator it = mapStakeCandidates.begin();
+        while (it != mapStakeCandidates.end())
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CStakeCandidate& candidate = it->second;
+            const CWalletTx* pcoin = candidate.pwtx;
+            unsigned int i = it->first.n;
 
-            // Filtering by tx timestamp instead of block timestamp may give false positives but never false negatives
-            if (pcoin->nTime + nStakeMinAge > nSpendTime)
-                continue;
-    
-            if (pcoin->GetBlocksToMaturity() > 0)
+            // Forget coins that were spent or whose block left the main chain;
+            // they come back through SyncTransaction or UpdateStakeCandidates
+            if (pcoin->IsSpent(i) || !candidate.pindexFrom->IsInMainChain())
+            {
+                mapStakeCandidates.erase(it++);
                 continue;
+            }
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 1)
+            // Filtering by tx timestamp instead of block timestamp may give false positives but never false negatives
+            if (candidate.nTimeTx + nStakeMinAge > nSpendTime || nBestHeight < candidate.nMaturityHeight)
+            {
+                ++it;
                 continue;
+            }
 
             CTxDestination address;
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue >= nMinimumInputValue &&
-                    (!nMaxStakeValue || pcoin->vout[i].nValue <= nMaxStakeValue) &&
-                    (!setStakeAddresses.size() || (ExtractDestination(pcoin->vout[i].scriptPubKey, address) && setStakeAddresses.count(address)))) {
-                    pcoin->hash = it->first;
-                    vCoins.push_back(COutput(pcoin, i, nDepth));
-                }
+            if (IsMine(pcoin->vout[i]) && candidate.nValue >= nMinimumInputValue &&
+                (!nMaxStakeValue || candidate.nValue <= nMaxStakeValue) &&
+                (!setStakeAddresses.size() || (ExtractDestination(pcoin->vout[i].scriptPubKey, address) && setStakeAddresses.count(address)))) {
+                pcoin->hash = it->first.hash;
+                vCoins.push_back(COutput(pcoin, i, nBestHeight - candidate.pindexFrom->nHeight + 1));
+            }
+            ++it;
         }
     }
 }
@@ -1310,28 +1622,16 @@ static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,uns
 // ppcoin: total coins staked (non-spendable until maturity)
 int64_t CWallet::GetStake() const
 {
-    int64_t nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    UpdateWalletTxCaches();
+    return balances.nStake;
 }
 
 int64_t CWallet::GetNewMint() const
 {
-    int64_t nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    UpdateWalletTxCaches();
+    return balances.nNewMint;
 }
 
 struct LargerOrEqualThanThreshold
@@ -1848,6 +2148,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
             LogPrint("fee", "[FEE] start with fee = %s\n", FormatMoney(nFeeRet));
             while (true)
             {
+                wtxNew.UncacheHash();
                 wtxNew.vin.clear();
                 wtxNew.vout.clear();
                 wtxNew.fFromMe = true;
@@ -1932,8 +2233,9 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
 
                 // Sign
                 int nIn = 0;
+                CSignatureHashContext sighash(wtxNew);
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
-                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++)) {
+                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++, SIGHASH_ALL, &sighash)) {
                         LogPrintf("CWallet::CreateTransaction failed: signing failed\n");
                         return false;
                     }
@@ -1980,81 +2282,76 @@ bool CWallet::CreateTransaction(CScript scriptPubKey, int64_t nValue, int64_t nC
     return CreateTransaction(vecSend, wtxNew, reservekey, nFeeRet, strCLAMSpeech, coinControl);
 }
 
-bool CWallet::GetStakeWeight(uint64_t& nWeight)
+// Recompute the staking figures from the stake candidates. Needs no disk
+// access unless the candidates are dirty, and runs on every new tip and on
+// wallet transactions entering the memory pool rather than on every read.
+void CWallet::UpdateStakeStats()
 {
-    // Choose coins to use
-    int64_t nBalance = GetBalance();
-
-    if (nBalance <= nReserveBalance)
-        return false;
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
 
-    vector<const CWalletTx*> vwtxPrev;
+    CStakeStats stats;
+    stats.nHeight = nBestHeight;
 
+    int64_t nTime = GetTime();
     set<pair<const CWalletTx*,unsigned int> > setCoins;
+    int64_t nBalance = GetBalance();
     int64_t nValueIn = 0;
+    if (nBalance > nReserveBalance)
+        SelectCoinsForStaking(nBalance - nReserveBalance, nTime, setCoins, nValueIn);
+    else
+        UpdateStakeCandidates();
 
-    if (!SelectCoinsForStaking(nBalance - nReserveBalance, GetTime(), setCoins, nValueIn))
-        return false;
-
-    if (setCoins.empty())
-        return false;
-
-    nWeight = 0;
-
-    int64_t nCurrentTime = GetTime();
-    CTxDB txdb("r");
-
-    LOCK2(cs_main, cs_wallet);
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    for (map<COutPoint, CStakeCandidate>::const_iterator it = mapStakeCandidates.begin(); it != mapStakeCandidates.end(); ++it)
     {
-        CTxIndex txindex;
-        if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
+        const CStakeCandidate& candidate = it->second;
+        if (candidate.pwtx->IsSpent(it->first.n) || !candidate.pindexFrom->IsInMainChain())
             continue;
+        if (candidate.nTimeTx + nStakeMinAge > nTime || nBestHeight < candidate.nMaturityHeight)
+            stats.nImmature += candidate.nValue;
+        else
+            stats.nMature += candidate.nValue;
+    }
 
-        if (nCurrentTime - pcoin.first->nTime > nStakeMinAge)
-            nWeight += pcoin.first->vout[pcoin.second].nValue;
-    } 
+    // The chance of a coin hitting the target at one timestamp is about
+    // target * value / 2^256; work in doubles instead of a CBigNum per coin
+    unsigned int nBits = GetNextTargetRequired(pindexBest, true);
+    double dTarget = ldexp((double)(nBits & 0x007fffff), 8 * ((int)(nBits >> 24) - 3) - 256);
+    double dFail = 1;
+    BOOST_FOREACH(const PAIRTYPE(const CWalletTx*, unsigned int)& pcoin, setCoins)
+    {
+        int64_t nValue = pcoin.first->vout[pcoin.second].nValue;
+        if (nTime - pcoin.first->nTime > nStakeMinAge)
+            stats.nWeight += nValue;
 
-   return true;
+        // p(A or B) = p(not((not A) and (not B))) = 1 - (p(1 - A) * p(1 - B))
+        dFail *= 1 - std::min(1.0, dTarget * nValue);
+    }
+    if (dFail < 1)
+        stats.nExpectedTime = std::min((double)std::numeric_limits<uint64_t>::max(), (STAKE_TIMESTAMP_MASK + 1) / (1 - dFail));
+
+    LOCK(cs_stakestats);
+    stakeStats = stats;
 }
 
-bool CWallet::GetExpectedStakeTime(uint64_t& nExpected)
+CStakeStats CWallet::GetStakeStats() const
 {
-    unsigned int nBits = GetNextTargetRequired(pindexBest, true);
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
-    
-    int64_t nBalance = GetBalance();
-    if (nBalance <= nReserveBalance)
-        return false;
-    
-    set<pair<const CWalletTx*,unsigned int> > setCoins;
-    int64_t nValueIn = 0;
-    double fail = 1;
+    LOCK(cs_stakestats);
+    return stakeStats;
+}
 
-    if (!SelectCoinsForStaking(nBalance - nReserveBalance, GetTime(), setCoins, nValueIn))
-        return false;
+bool CWallet::GetStakeWeight(uint64_t& nWeight) const
+{
+    nWeight = GetStakeStats().nWeight;
+    return nWeight > 0;
+}
 
-    if (setCoins.empty())
+bool CWallet::GetExpectedStakeTime(uint64_t& nExpected) const
+{
+    CStakeStats stats = GetStakeStats();
+    if (!stats.nExpectedTime)
         return false;
-
-    CTxDB txdb("r");
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
-    {
-        CTxIndex txindex;
-        {
-            LOCK2(cs_main, cs_wallet);
-            if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-                continue;
-        }
-
-        // p(A or B) = p(not((not A) and (not B))) = 1 - (p(1 - A) * p(1 - B))
-        int64_t nValue = pcoin.first->vout[pcoin.second].nValue;
-        if (nValue)
-            fail *= 1 - 1.0/(CBigNum(~uint256(0)) / (bnTarget * nValue)).getulong();
-    }
-
-    nExpected = (STAKE_TIMESTAMP_MASK + 1) / (1 - fail);
+    nExpected = stats.nExpectedTime;
     return true;
 }
 
@@ -2064,6 +2361,7 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     CBigNum bnTargetPerCoinDay;
     bnTargetPerCoinDay.SetCompact(nBits);
 
+    txNew.UncacheHash();
     txNew.vin.clear();
     txNew.vout.clear();
 
@@ -2103,34 +2401,27 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     int64_t nCredit = 0;
     CScript scriptPubKeyKernel;
     int64_t nBlockTime;
-    CTxDB txdb("r");
     CKeyID stakingkeyID;
     uint256 hashProofOfStake = 0;
+    static int nMaxStakeSearchInterval = 60;
+    CStakeKernelSearch search(pindexPrev, nBits, txNew.nTime, min(nSearchInterval, (int64_t)nMaxStakeSearchInterval));
+    vector<pair<const CWalletTx*, unsigned int> > vSearchCoins;
     BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
     {
-        CTxIndex txindex;
-        {
-            LOCK2(cs_main, cs_wallet);
-            if (!txdb.ReadTxIndex(pcoin.first->hash, txindex)) {
-                LogPrint("stake", "[STAKE] skip %s:%-3d (%s CLAM) - can't read txindex\n",
-                          pcoin.first->hash.ToString(), pcoin.second, FormatMoney(pcoin.first->vout[pcoin.second].nValue));
-                continue;
-            }
-        }
-
-        // Read block header
-        CBlock block;
+        // Block time and offset of the coin come from the stake candidates
+        CStakeCandidate candidate;
         {
-            LOCK2(cs_main, cs_wallet);
-            if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false)) {
-                LogPrint("stake", "[STAKE] skip %s:%-3d (%s CLAM) - can't read block\n",
+            LOCK(cs_wallet);
+            map<COutPoint, CStakeCandidate>::const_iterator mi = mapStakeCandidates.find(COutPoint(pcoin.first->hash, pcoin.second));
+            if (mi == mapStakeCandidates.end()) {
+                LogPrint("stake", "[STAKE] skip %s:%-3d (%s CLAM) - not a stake candidate\n",
                           pcoin.first->hash.ToString(), pcoin.second, FormatMoney(pcoin.first->vout[pcoin.second].nValue));
                 continue;
             }
+            candidate = mi->second;
         }
 
-        static int nMaxStakeSearchInterval = 60;
-        nBlockTime = block.GetBlockTime();
+        nBlockTime = candidate.nTimeBlockFrom;
         if (nBlockTime + nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval) {
             LogPrint("stake", "[STAKE] skip %s:%-3d (%s CLAM) - only %d minutes old\n",
                       pcoin.first->hash.ToString(), pcoin.second, FormatMoney(pcoin.first->vout[pcoin.second].nValue),
@@ -2138,88 +2429,81 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
             continue; // only count coins meeting min age requirement
         }
 
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && pindexPrev == pindexBest; n++)
+        search.AddCoin(*pcoin.first, COutPoint(pcoin.first->hash, pcoin.second), candidate.nTimeBlockFrom, candidate.nTxPrevOffset, candidate.pindexFrom);
+        vSearchCoins.push_back(pcoin);
+    }
+
+    // Search backward in time from the given txNew timestamp, nSearchInterval
+    // seconds back up to nMaxStakeSearchInterval. Coins whose kernel cannot be
+    // used are passed over and the search resumes after them.
+    unsigned int nTimeKernel;
+    for (unsigned int nCoin = 0; search.Find(nCoin, nTimeKernel, hashProofOfStake); nCoin++)
+    {
+        PAIRTYPE(const CWalletTx*, unsigned int) pcoin = vSearchCoins[nCoin];
+        // Found a kernel
+        LogPrint("coinstake", "CreateCoinStake : kernel found\n");
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+        {
+            LogPrint("stake", "[STAKE] fail %s:%-3d (%s CLAM) - can't parse kernel\n",
+                      pcoin.first->hash.ToString(), pcoin.second, FormatMoney(pcoin.first->vout[pcoin.second].nValue));
+            continue;
+        }
+        LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
         {
-            boost::this_thread::interruption_point();
-            // Search backward in time from the given txNew timestamp 
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            uint256 targetProofOfStake = 0;
-            COutPoint prevoutStake = COutPoint(pcoin.first->hash, pcoin.second);
-            LogPrint("stake", "[STAKE] check %s:%-3d (%s CLAM)\n",
+            LogPrint("stake", "[STAKE] fail %s:%-3d (%s CLAM) - bad kernel type\n",
                       pcoin.first->hash.ToString(), pcoin.second, FormatMoney(pcoin.first->vout[pcoin.second].nValue));
-            if (CheckStakeKernelHash(pindexPrev, nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin.first, prevoutStake, txNew.nTime - n, hashProofOfStake, targetProofOfStake))
+            continue;  // only support pay to public key and pay to address
+        }
+        if (whichType == TX_PUBKEYHASH) // pay to address type
+        {
+            // convert to pay to public key type
+            stakingkeyID = uint160(vSolutions[0]);
+            if (!keystore.GetKey(stakingkeyID, key))
             {
-                // Found a kernel
-                LogPrint("coinstake", "CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    LogPrint("stake", "[STAKE] fail %s:%-3d (%s CLAM) - can't parse kernel\n",
-                              pcoin.first->hash.ToString(), pcoin.second, FormatMoney(pcoin.first->vout[pcoin.second].nValue));
-                    break;
-                }
-                LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    LogPrint("stake", "[STAKE] fail %s:%-3d (%s CLAM) - bad kernel type\n",
-                              pcoin.first->hash.ToString(), pcoin.second, FormatMoney(pcoin.first->vout[pcoin.second].nValue));
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    stakingkeyID = uint160(vSolutions[0]);
-                    if (!keystore.GetKey(stakingkeyID, key))
-                    {
-                        LogPrint("stake", "[STAKE] fail %s:%-3d (%s CLAM) - can't get public key (a)\n",
-                                  pcoin.first->hash.ToString(), pcoin.second, FormatMoney(pcoin.first->vout[pcoin.second].nValue));
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                if (whichType == TX_PUBKEY)
-                {
-                    valtype& vchPubKey = vSolutions[0];
-                    stakingkeyID = Hash160(vchPubKey);
-                    if (!keystore.GetKey(stakingkeyID, key))
-                    {
-                        LogPrint("stake", "[STAKE] fail %s:%-3d (%s CLAM) - can't get public key, type %d\n",
-                                  pcoin.first->hash.ToString(), pcoin.second, FormatMoney(pcoin.first->vout[pcoin.second].nValue),
-                                  whichType);
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        LogPrint("stake", "[STAKE] fail %s:%-3d (%s CLAM) - invalid key, type %d\n",
-                                  pcoin.first->hash.ToString(), pcoin.second, FormatMoney(pcoin.first->vout[pcoin.second].nValue),
-                                  whichType);
-                        break; // keys mismatch
-                    }
-
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
-
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->hash, pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); // this creates txNew.vout[1]
-                setCoins.erase(pcoin); // don't consider the staking coin for merging later
+                LogPrint("stake", "[STAKE] fail %s:%-3d (%s CLAM) - can't get public key (a)\n",
+                          pcoin.first->hash.ToString(), pcoin.second, FormatMoney(pcoin.first->vout[pcoin.second].nValue));
+                continue;  // unable to find corresponding public key
+            }
+            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+        }
+        if (whichType == TX_PUBKEY)
+        {
+            valtype& vchPubKey = vSolutions[0];
+            stakingkeyID = Hash160(vchPubKey);
+            if (!keystore.GetKey(stakingkeyID, key))
+            {
+                LogPrint("stake", "[STAKE] fail %s:%-3d (%s CLAM) - can't get public key, type %d\n",
+                          pcoin.first->hash.ToString(), pcoin.second, FormatMoney(pcoin.first->vout[pcoin.second].nValue),
+                          whichType);
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
 
-                LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+            if (key.GetPubKey() != vchPubKey)
+            {
+                LogPrint("stake", "[STAKE] fail %s:%-3d (%s CLAM) - invalid key, type %d\n",
+                          pcoin.first->hash.ToString(), pcoin.second, FormatMoney(pcoin.first->vout[pcoin.second].nValue),
+                          whichType);
+                continue; // keys mismatch
             }
+
+            scriptPubKeyOut = scriptPubKeyKernel;
         }
 
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+        txNew.nTime = nTimeKernel;
+        txNew.vin.push_back(CTxIn(pcoin.first->hash, pcoin.second));
+        nCredit += pcoin.first->vout[pcoin.second].nValue;
+        vwtxPrev.push_back(pcoin.first);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); // this creates txNew.vout[1]
+        setCoins.erase(pcoin); // don't consider the staking coin for merging later
+
+        LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
+        break;
     }
 
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
@@ -2331,9 +2615,10 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
 
     // Sign
     int nIn = 0;
+    CSignatureHashContext sighash(txNew);
     BOOST_FOREACH(const CWalletTx* pcoin, vwtxPrev)
     {
-        if (!SignSignature(*this, *pcoin, txNew, nIn++))
+        if (!SignSignature(*this, *pcoin, txNew, nIn++, SIGHASH_ALL, &sighash))
             return error("CreateCoinStake : failed to sign coinstake");
     }
 
@@ -2374,6 +2659,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                MarkWalletTxDirty(txin.prevout.hash);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
@@ -2515,6 +2801,7 @@ bool CWallet::CreateCLAMSpeechTransaction(CWalletTx& wtxNew, CReserveKey& reserv
 			LogPrint("fee", "[FEE] start with fee = %s\n", FormatMoney(nFeeRet));
 			while(true)
 			{
+				wtxNew.UncacheHash();
 				wtxNew.vin.clear();
 				wtxNew.vout.clear();
 				wtxNew.fFromMe = true;
@@ -2559,8 +2846,9 @@ bool CWallet::CreateCLAMSpeechTransaction(CWalletTx& wtxNew, CReserveKey& reserv
 
 				// Sign
                	 		int nIn = 0;
+                		CSignatureHashContext sighash(wtxNew);
                 		BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
-                    		if (!SignSignature(*this, *coin.first, wtxNew, nIn++)) {
+                    		if (!SignSignature(*this, *coin.first, wtxNew, nIn++, SIGHASH_ALL, &sighash)) {
                         		LogPrintf("CWallet::CreateTransaction failed: signing failed\n");
                         		return false;
                     		}
@@ -3012,6 +3300,8 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkUnspent(n);
                     pcoin->WriteToDisk();
+                    fStakeCandidatesDirty = true;
+                    MarkWalletTxDirty(pcoin->GetHash());
                 }
             }
             else if (IsMine(pcoin->vout[n]) && !pcoin->IsSpent(n) && (txindex.vSpent.size() > n && !txindex.vSpent[n].IsNull()))
@@ -3024,6 +3314,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkSpent(n);
                     pcoin->WriteToDisk();
+                    MarkWalletTxDirty(pcoin->GetHash());
                 }
             }
         }
@@ -3047,6 +3338,8 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                fStakeCandidatesDirty = true;
+                MarkWalletTxDirty(txin.prevout.hash);
             }
         }
     }
@@ -3218,7 +3511,15 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
 
 void CWallet::SearchNotaryTransactions(uint256 hash, std::vector<std::pair<std::string, int> >& vTxResults)
 {
-    int blockstogoback = pindexBest->nHeight - 362500;
+    std::vector<CNotaryIndexEntry> vEntries;
+    if (GetNotaryTransactions(hash, true, vEntries)) {
+        BOOST_FOREACH(const CNotaryIndexEntry& entry, vEntries)
+            vTxResults.push_back(std::make_pair(entry.hashTx.GetHex(), entry.nHeight));
+        return;
+    }
+
+    // no -notaryindex (or still building): read the chain back from the tip
+    int blockstogoback = pindexBest->nHeight - NOTARY_FIRST_HEIGHT;
     std::string matchingCLAMSpeech = "notary " + hash.GetHex();
 
     const CBlockIndex* pindexFirst = pindexBest;
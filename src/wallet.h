@@ -26,6 +26,7 @@ extern int64_t nReserveBalance;
 extern int64_t nMinimumInputValue;
 extern bool fWalletUnlockStakingOnly;
 extern bool fConfChange;
+extern bool fCheckWalletBalances;
 
 class CAccountingEntry;
 class CCoinControl;
@@ -73,6 +74,121 @@ public:
     )
 };
 
+/** Wallet balance totals, one per GetBalance style accessor. */
+class CWalletBalances
+{
+public:
+    int64_t nBalance;
+    int64_t nUnconfirmed;
+    int64_t nImmature;
+    int64_t nStake;
+    int64_t nNewMint;
+
+    CWalletBalances()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        nBalance = 0;
+        nUnconfirmed = 0;
+        nImmature = 0;
+        nStake = 0;
+        nNewMint = 0;
+    }
+
+    bool IsNull() const
+    {
+        return !nBalance && !nUnconfirmed && !nImmature && !nStake && !nNewMint;
+    }
+
+    CWalletBalances& operator+=(const CWalletBalances& b)
+    {
+        nBalance += b.nBalance;
+        nUnconfirmed += b.nUnconfirmed;
+        nImmature += b.nImmature;
+        nStake += b.nStake;
+        nNewMint += b.nNewMint;
+        return *this;
+    }
+
+    CWalletBalances& operator-=(const CWalletBalances& b)
+    {
+        nBalance -= b.nBalance;
+        nUnconfirmed -= b.nUnconfirmed;
+        nImmature -= b.nImmature;
+        nStake -= b.nStake;
+        nNewMint -= b.nNewMint;
+        return *this;
+    }
+
+    friend bool operator==(const CWalletBalances& a, const CWalletBalances& b)
+    {
+        return a.nBalance == b.nBalance && a.nUnconfirmed == b.nUnconfirmed && a.nImmature == b.nImmature &&
+               a.nStake == b.nStake && a.nNewMint == b.nNewMint;
+    }
+
+    friend bool operator!=(const CWalletBalances& a, const CWalletBalances& b)
+    {
+        return !(a == b);
+    }
+
+    std::string ToString() const;
+};
+
+/** A wallet output in a block that may be used as a stake kernel, together with
+ * the block data the kernel hash needs, so that staking passes never read the
+ * transaction index or block headers from disk.
+ */
+class CStakeCandidate
+{
+public:
+    const CWalletTx* pwtx;
+    int64_t nValue;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTimeTx;           // txPrev.nTime
+    unsigned int nTxPrevOffset;     // offset of txPrev in its block
+    int nMaturityHeight;            // best height at which the output is mature
+    CBlockIndex* pindexFrom;
+};
+
+/** An unspent output we own, as kept in CWallet's unspent output index */
+class CWalletUnspent
+{
+public:
+    const CWalletTx* pwtx;
+    int nHeight;                    // height of the block holding it, INT_MAX until it is in the main chain
+};
+
+/** Staking figures for the status bar and getstakinginfo. They are recomputed
+ * from the stake candidates when the tip or the wallet's coins change, and
+ * read under their own lock, so readers never wait for cs_main.
+ */
+class CStakeStats
+{
+public:
+    int64_t nWeight;                // value of the coins the staker would use now
+    int64_t nMature;                // value of coins old and mature enough to stake
+    int64_t nImmature;              // value of coins still short of age or maturity
+    uint64_t nExpectedTime;         // expected seconds to find a stake with nWeight
+    int nHeight;                    // best height the figures were computed at
+
+    CStakeStats()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        nWeight = 0;
+        nMature = 0;
+        nImmature = 0;
+        nExpectedTime = 0;
+        nHeight = -1;
+    }
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -80,6 +196,13 @@ class CWallet : public CCryptoKeyStore, public CWalletInterface
 {
 private:
     bool SelectCoinsForStaking(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
+    void AddStakeCandidates(const CWalletTx& wtx, const CBlock* pblock, CTxDB* ptxdb = NULL) const;
+    void UpdateStakeCandidates() const;
+    CWalletBalances GetTxBalances(const CWalletTx& wtx, bool& fVolatile) const;
+    void UpdateTxBalances(const uint256& hash) const;
+    void UpdateTxUnspent(const uint256& hash) const;
+    void UpdateWalletTxCaches() const;
+    void MarkWalletTxDirty(const uint256& hash);
     bool SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl=NULL) const;
 
     CWalletDB *pwalletdbEncryption;
@@ -112,6 +235,33 @@ public:
     std::map<std::string, int64_t> mapAddressRewards; // a running total of staking rewards collected per address
     bool fAddressRewardsReady;                        // whether we are keeping the running total yet or not
 
+    // Unspent outputs usable for staking. Entries are added as blocks connect;
+    // spent, orphaned and immature ones are skipped or dropped when staking.
+    // Events that can make a coin spendable again set fStakeCandidatesDirty,
+    // which makes the next staking pass add anything missing from mapWallet.
+    mutable std::map<COutPoint, CStakeCandidate> mapStakeCandidates;
+    mutable bool fStakeCandidatesDirty;
+
+    // Running balance totals and the share of each transaction in them, and
+    // the unspent outputs we own, by outpoint and by confirmation height.
+    // Transactions whose spent flags, contents or block change are marked
+    // dirty and reindexed by UpdateWalletTxCaches before the next read.
+    // Unconfirmed, non-final and immature transactions depend on the tip and
+    // the memory pool, so their balances are recounted on every read;
+    // everything is recounted after a reorganisation.
+    mutable CWalletBalances balances;
+    mutable std::map<uint256, CWalletBalances> mapTxBalances;
+    mutable std::set<uint256> setBalancesVolatile;
+    mutable std::map<COutPoint, CWalletUnspent> mapWalletUnspent;
+    mutable std::set<std::pair<int, COutPoint> > setWalletUnspentByHeight;
+    mutable std::set<uint256> setWalletTxDirty;
+    mutable bool fWalletTxDirtyAll;
+    mutable const CBlockIndex* pindexBalances;
+
+    // Last computed staking figures, see UpdateStakeStats
+    mutable CCriticalSection cs_stakestats;
+    CStakeStats stakeStats;
+
     CWallet()
     {
         nWalletVersion = FEATURE_BASE;
@@ -121,6 +271,9 @@ public:
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
         fAddressRewardsReady = false;
+        fStakeCandidatesDirty = true;
+        fWalletTxDirtyAll = true;
+        pindexBalances = NULL;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -132,6 +285,9 @@ public:
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
         fAddressRewardsReady = false;
+        fStakeCandidatesDirty = true;
+        fWalletTxDirtyAll = true;
+        pindexBalances = NULL;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -148,6 +304,7 @@ public:
 
     void AvailableCoinsForStaking(std::vector<COutput>& vCoins, unsigned int nSpendTime) const;
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl=NULL, bool fOnlyMature=true) const;
+    void AvailableCoinsByDepth(std::vector<COutput>& vCoins, int nMinDepth, int nMaxDepth, bool fOnlyMature=true) const;
     bool SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, bool fLogFailureReason) const;
     bool SelectCoinsMinConfByCoinAge(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, bool fLogFailureReason) const;
 
@@ -217,8 +374,10 @@ public:
     bool CreateCLAMSpeechTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, std::string clamSpeech, const CCoinControl *coinControl=NULL);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
 
-    bool GetExpectedStakeTime(uint64_t& nExpected);
-    bool GetStakeWeight(uint64_t& nWeight);
+    void UpdateStakeStats();
+    CStakeStats GetStakeStats() const;
+    bool GetExpectedStakeTime(uint64_t& nExpected) const;
+    bool GetStakeWeight(uint64_t& nWeight) const;
     bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CTransaction& txNew, CKey& key);
 
     std::string SendMoney(CScript scriptPubKey, int64_t nValue, int64_t nCount, CWalletTx& wtxNew, std::string strCLAMSpeech = "", bool fAskFee=false);
@@ -302,6 +461,7 @@ public:
         return nChange;
     }
     void SetBestChain(const CBlockLocator& loc);
+    void UpdatedBlockTip(const CBlockIndex* pindex);
 
     DBErrors LoadWallet(bool& fFirstRunRet);
     DBErrors LoadWalletImport();